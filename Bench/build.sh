@@ -0,0 +1 @@
+gmake transfer_bench
\ No newline at end of file
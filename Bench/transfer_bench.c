@@ -0,0 +1,909 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <dirent.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "histogram.h"
+
+// Transfer throughput benchmark
+//
+// Starts the Lab3 TCP file server, the Lab4 UDP file download server and a
+// p2p_client seeder (registered with its own p2p_index_server) on loopback,
+// generates test files of the requested sizes, and downloads them with 1..N
+// concurrent clients. For every (server, size, clients) run it reports
+// throughput, server and client CPU per GB, server system calls per MB and
+// time-to-first-byte percentiles as JSON.
+//
+// Server system calls are counted with a raw_syscalls:sys_enter perf
+// tracepoint on every thread of the server process. When tracefs or perf
+// events aren't available the read/write counters from /proc/<pid>/io are
+// used instead, which miss the socket calls (sendto, recvfrom, ...); the
+// "syscall_source" field of each result says which one was used.
+
+#define DEFAULT_BASE_PORT 17000
+#define DEFAULT_SIZES "1K,64K,1M,16M,256M"
+#define DEFAULT_MAX_CLIENTS 4
+#define DEFAULT_RUN_BYTES (256LL << 20)  // Aim for at least this much data per run
+#define MAX_REPS 2000                     // Cap on downloads per client per run
+#define MAX_SIZES 16
+#define MAX_THREADS 256
+#define UDP_IDLE_TIMEOUT_MS 2000
+
+#define LAB3_BUFLEN 256    // Lab3 chunk: 1 type byte + 255 data bytes
+#define LAB4_DATALEN 100   // Lab4 PDU data size
+#define P2P_BUFLEN 256     // Project PDU data size
+#define P2P_PEER_NAME "bench"
+
+enum { TARGET_TCP, TARGET_UDP, TARGET_P2P, NUM_TARGETS };
+
+static const char *target_names[NUM_TARGETS] = { "file_transfer_server", "file_download_udp_server", "p2p_seeder" };
+static const char *target_keys[NUM_TARGETS] = { "tcp", "udp", "p2p" };
+
+// Benchmark settings
+typedef struct {
+    const char *repo_root;
+    char workdir[512];
+    int keep_workdir;
+    int base_port;
+    long long sizes[MAX_SIZES];
+    int num_sizes;
+    int max_clients;
+    long long run_bytes;
+    int text_content;
+    int enabled[NUM_TARGETS];
+    FILE *out;
+} BenchConfig;
+
+// A running server under test
+// pid: Process serving the transfers
+// helper_pid: Extra process the server depends on (p2p index), or 0
+// stdin_fd: Write end of the seeder's stdin, or -1
+// ports: Per-file port (only differs between files for the p2p seeder)
+typedef struct {
+    pid_t pid;
+    pid_t helper_pid;
+    int stdin_fd;
+    int ports[MAX_SIZES];
+} Server;
+
+// Work for one client thread
+typedef struct {
+    int target;
+    int port;
+    const char *filename;
+    long long size;
+    int reps;
+    long long bytes;
+    int errors;
+    Histogram ttfb;
+} ClientJob;
+
+// System call counters on a server process
+// perf_fds: One raw_syscalls:sys_enter counter per thread
+// use_perf: 0 when falling back to syscr + syscw from /proc/<pid>/io
+typedef struct {
+    int perf_fds[MAX_THREADS];
+    int num_perf_fds;
+    int use_perf;
+} ProcCounters;
+
+static BenchConfig config;
+static int first_result = 1;
+
+// Returns a monotonic timestamp in microseconds
+static long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// Returns the file name used for a given size, e.g. "f64K"
+// Parameters:
+// - size: File size in bytes
+// - name: Buffer of at least 16 bytes for the result
+static void size_name(long long size, char *name) {
+    if (size >= (1LL << 30) && size % (1LL << 30) == 0) {
+        sprintf(name, "f%lldG", size >> 30);
+    } else if (size >= (1LL << 20) && size % (1LL << 20) == 0) {
+        sprintf(name, "f%lldM", size >> 20);
+    } else if (size >= 1024 && size % 1024 == 0) {
+        sprintf(name, "f%lldK", size >> 10);
+    } else {
+        sprintf(name, "f%lld", size);
+    }
+}
+
+// Parses a size with an optional K, M or G suffix
+// Parameters:
+// - text: The size, e.g. "64K"
+// Returns the size in bytes, or -1 if malformed
+static long long parse_size(const char *text) {
+    char *end;
+    long long v = strtoll(text, &end, 10);
+    if (*end == 'K' || *end == 'k') v <<= 10;
+    else if (*end == 'M' || *end == 'm') v <<= 20;
+    else if (*end == 'G' || *end == 'g') v <<= 30;
+    else if (*end != '\0') return -1;
+    return v > 0 ? v : -1;
+}
+
+// Parses a comma separated list of sizes
+// Parameters:
+// - list: The list from the command line
+// Returns 0 on success, -1 on a malformed list
+static int parse_sizes(const char *list) {
+    char copy[256], *tok, *save;
+    strncpy(copy, list, sizeof(copy) - 1);
+    copy[sizeof(copy) - 1] = '\0';
+    config.num_sizes = 0;
+    for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        long long v = parse_size(tok);
+        if (v <= 0 || config.num_sizes == MAX_SIZES) return -1;
+        config.sizes[config.num_sizes++] = v;
+    }
+    return config.num_sizes > 0 ? 0 : -1;
+}
+
+// Creates a test file unless one of the right size already exists
+// Parameters:
+// - size: File size in bytes
+static void generate_file(long long size) {
+    char name[16], path[600];
+    struct stat st;
+    static char block[1 << 20];
+    unsigned long long x = 0x9E3779B97F4A7C15ULL ^ (unsigned long long)size;
+    long long written = 0;
+    FILE *file;
+
+    size_name(size, name);
+    snprintf(path, sizeof(path), "%s/%s", config.workdir, name);
+    if (stat(path, &st) == 0 && st.st_size == size) {
+        return;
+    }
+    if ((file = fopen(path, "wb")) == NULL) {
+        perror("Cannot create test file");
+        exit(1);
+    }
+    fprintf(stderr, "Generating %s (%lld bytes)\n", path, size);
+    while (written < size) {
+        size_t n = sizeof(block), i;
+        if ((long long)n > size - written) {
+            n = (size_t)(size - written);
+        }
+        if (config.text_content) {
+            // Log-like lines, which compress roughly like real text content
+            size_t pos = 0;
+            while (pos < n) {
+                char line[128];
+                int len;
+                x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+                len = snprintf(line, sizeof(line), "2026-10-19T12:%02llu:%02llu INFO peer=%llu request served in %llu us\n",
+                               (x >> 8) % 60, (x >> 16) % 60, (x >> 24) % 1000, (x >> 40) % 10000);
+                if ((size_t)len > n - pos) {
+                    len = (int)(n - pos);
+                }
+                memcpy(block + pos, line, (size_t)len);
+                pos += (size_t)len;
+            }
+        } else {
+            for (i = 0; i + 8 <= n; i += 8) {
+                x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+                memcpy(block + i, &x, 8);
+            }
+            for (; i < n; i++) {
+                block[i] = (char)i;
+            }
+        }
+        if (fwrite(block, 1, n, file) != n) {
+            perror("Cannot write test file");
+            exit(1);
+        }
+        written += (long long)n;
+    }
+    fclose(file);
+}
+
+// Starts a program inside the work directory with its stdout discarded
+// Parameters:
+// - argv: Program path and arguments
+// - stdin_fd: If not NULL, set to the write end of a pipe on the child's stdin
+// Returns the child's pid
+static pid_t spawn(char *const argv[], int *stdin_fd) {
+    int fds[2] = { -1, -1 };
+    pid_t pid;
+
+    if (stdin_fd && pipe(fds) == -1) {
+        perror("Cannot create pipe");
+        exit(1);
+    }
+    if ((pid = fork()) == -1) {
+        perror("Cannot fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_RDWR);
+        if (stdin_fd) {
+            dup2(fds[0], 0);
+            close(fds[0]);
+            close(fds[1]);
+        } else {
+            dup2(devnull, 0);
+        }
+        dup2(devnull, 1);
+        if (chdir(config.workdir) == -1) {
+            perror("Cannot enter work directory");
+            _exit(1);
+        }
+        execv(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+    if (stdin_fd) {
+        close(fds[0]);
+        *stdin_fd = fds[1];
+    }
+    return pid;
+}
+
+// Stops a child process and reaps it
+// Parameters:
+// - pid: The child to stop
+static void stop_child(pid_t pid) {
+    if (pid > 0) {
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+}
+
+// Fills a loopback address
+// Parameters:
+// - addr: The address to fill
+// - port: Port number in host byte order
+static void loopback(struct sockaddr_in *addr, int port) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(port);
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+}
+
+// Waits until something accepts TCP connections on a loopback port
+// Parameters:
+// - port: The port to probe
+// Returns 0 once connectable, -1 after about five seconds
+static int wait_for_tcp(int port) {
+    struct sockaddr_in addr;
+    int attempt;
+    loopback(&addr, port);
+    for (attempt = 0; attempt < 100; attempt++) {
+        int sd = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(sd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            close(sd);
+            return 0;
+        }
+        close(sd);
+        usleep(50000);
+    }
+    return -1;
+}
+
+// Asks the p2p index where the bench peer serves a file
+// Parameters:
+// - index_port: Port of the index server
+// - filename: The registered file
+// Returns the seeder's TCP port, or -1 if the file isn't registered yet
+static int p2p_lookup(int index_port, const char *filename) {
+    struct sockaddr_in addr;
+    struct { char type; char data[P2P_BUFLEN]; } request, response;
+    struct pollfd pfd;
+    char ip[INET_ADDRSTRLEN];
+    int sd, port = -1;
+
+    loopback(&addr, index_port);
+    sd = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&request, 0, sizeof(request));
+    request.type = 'S';
+    snprintf(request.data, sizeof(request.data), "%-10s %-10s", P2P_PEER_NAME, filename);
+    sendto(sd, &request, sizeof(request), 0, (struct sockaddr *)&addr, sizeof(addr));
+    pfd.fd = sd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, 500) == 1 && recv(sd, &response, sizeof(response), 0) > 0 && response.type == 'S') {
+        if (sscanf(response.data, "%15[^:]:%d", ip, &port) != 2) {
+            port = -1;
+        }
+    }
+    close(sd);
+    return port;
+}
+
+// Starts the server for a target and waits until it is ready
+// Parameters:
+// - target: Which server to start
+// - server: Filled with the running server's details
+// Returns 0 on success, -1 if the server didn't come up
+static int start_server(int target, Server *server) {
+    char path[600], port_arg[16], index_arg[16];
+    int port = config.base_port + target, i;
+
+    memset(server, 0, sizeof(*server));
+    server->stdin_fd = -1;
+    snprintf(port_arg, sizeof(port_arg), "%d", port);
+
+    if (target == TARGET_TCP) {
+        char *argv[] = { path, port_arg, NULL };
+        snprintf(path, sizeof(path), "%s/Lab3/file_transfer_server", config.repo_root);
+        server->pid = spawn(argv, NULL);
+        for (i = 0; i < config.num_sizes; i++) {
+            server->ports[i] = port;
+        }
+        return wait_for_tcp(port);
+    }
+
+    if (target == TARGET_UDP) {
+        char *argv[] = { path, port_arg, NULL };
+        snprintf(path, sizeof(path), "%s/Lab4/FileDownloadServer/file_download_udp_server", config.repo_root);
+        server->pid = spawn(argv, NULL);
+        for (i = 0; i < config.num_sizes; i++) {
+            server->ports[i] = port;
+        }
+        usleep(200000);
+        return 0;
+    }
+
+    // p2p: an index server plus a p2p_client that registers every test file
+    {
+        char *index_argv[] = { path, index_arg, NULL };
+        char *client_argv[] = { path, "127.0.0.1", index_arg, NULL };
+        char script[64];
+        int attempt;
+
+        snprintf(index_arg, sizeof(index_arg), "%d", port + NUM_TARGETS);
+        snprintf(path, sizeof(path), "%s/Project/p2p_index_server", config.repo_root);
+        server->helper_pid = spawn(index_argv, NULL);
+        usleep(200000);
+
+        snprintf(path, sizeof(path), "%s/Project/p2p_client", config.repo_root);
+        server->pid = spawn(client_argv, &server->stdin_fd);
+        snprintf(script, sizeof(script), "%s\n", P2P_PEER_NAME);
+        write(server->stdin_fd, script, strlen(script));
+        for (i = 0; i < config.num_sizes; i++) {
+            char name[16];
+            size_name(config.sizes[i], name);
+            snprintf(script, sizeof(script), "register\n%s\n", name);
+            write(server->stdin_fd, script, strlen(script));
+        }
+        for (i = 0; i < config.num_sizes; i++) {
+            char name[16];
+            size_name(config.sizes[i], name);
+            for (attempt = 0; attempt < 50; attempt++) {
+                if ((server->ports[i] = p2p_lookup(port + NUM_TARGETS, name)) > 0) {
+                    break;
+                }
+                usleep(100000);
+            }
+            if (server->ports[i] <= 0 || wait_for_tcp(server->ports[i]) == -1) {
+                return -1;
+            }
+        }
+        return 0;
+    }
+}
+
+// Stops a target's server and anything it depends on
+// Parameters:
+// - server: The server to stop
+static void stop_server(Server *server) {
+    if (server->stdin_fd != -1) {
+        write(server->stdin_fd, "exit\n", 5);
+        close(server->stdin_fd);
+        usleep(100000);
+    }
+    stop_child(server->pid);
+    stop_child(server->helper_pid);
+}
+
+// Finds the raw_syscalls:sys_enter tracepoint id
+// Returns the id, or -1 if tracefs isn't available
+static long long syscall_tracepoint_id(void) {
+    const char *paths[] = {
+        "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+        "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id",
+    };
+    long long id = -1;
+    size_t i;
+    for (i = 0; i < sizeof(paths) / sizeof(paths[0]) && id < 0; i++) {
+        FILE *f = fopen(paths[i], "r");
+        if (f) {
+            if (fscanf(f, "%lld", &id) != 1) {
+                id = -1;
+            }
+            fclose(f);
+        }
+    }
+    return id;
+}
+
+// Starts counting a process's CPU time and system calls
+// Parameters:
+// - pid: The process to watch
+// - pc: Counter state to initialise
+static void counters_start(pid_t pid, ProcCounters *pc) {
+    long long id = syscall_tracepoint_id();
+    char path[64];
+    DIR *dir;
+    struct dirent *ent;
+
+    memset(pc, 0, sizeof(*pc));
+    if (id >= 0) {
+        snprintf(path, sizeof(path), "/proc/%d/task", (int)pid);
+        if ((dir = opendir(path)) != NULL) {
+            pc->use_perf = 1;
+            while ((ent = readdir(dir)) != NULL && pc->num_perf_fds < MAX_THREADS) {
+                struct perf_event_attr attr;
+                int fd;
+                if (ent->d_name[0] == '.') {
+                    continue;
+                }
+                memset(&attr, 0, sizeof(attr));
+                attr.type = PERF_TYPE_TRACEPOINT;
+                attr.size = sizeof(attr);
+                attr.config = (unsigned long long)id;
+                attr.inherit = 1;
+                fd = (int)syscall(SYS_perf_event_open, &attr, atoi(ent->d_name), -1, -1, 0);
+                if (fd == -1) {
+                    pc->use_perf = 0;
+                    break;
+                }
+                pc->perf_fds[pc->num_perf_fds++] = fd;
+            }
+            closedir(dir);
+        }
+        if (!pc->use_perf) {
+            while (pc->num_perf_fds > 0) {
+                close(pc->perf_fds[--pc->num_perf_fds]);
+            }
+        }
+    }
+}
+
+// Reads a process's CPU ticks and read/write system call counts from /proc
+// Parameters:
+// - pid: The process to read
+// - ticks: Set to utime + stime
+// - rw_calls: Set to syscr + syscw
+static void read_proc(pid_t pid, long long *ticks, long long *rw_calls) {
+    char path[64], buf[1024], *p;
+    FILE *f;
+    unsigned long utime = 0, stime = 0;
+
+    *ticks = 0;
+    *rw_calls = 0;
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    if ((f = fopen(path, "r")) != NULL) {
+        if (fgets(buf, sizeof(buf), f) && (p = strrchr(buf, ')')) != NULL) {
+            // Fields after the command name start at field 3; utime and stime are 14 and 15
+            sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime);
+        }
+        fclose(f);
+    }
+    *ticks = (long long)(utime + stime);
+
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    if ((f = fopen(path, "r")) != NULL) {
+        while (fgets(buf, sizeof(buf), f)) {
+            long long v;
+            if (sscanf(buf, "syscr: %lld", &v) == 1 || sscanf(buf, "syscw: %lld", &v) == 1) {
+                *rw_calls += v;
+            }
+        }
+        fclose(f);
+    }
+}
+
+// Reads the current totals for a watched process
+// Parameters:
+// - pid: The watched process
+// - pc: Counter state from counters_start
+// - ticks, syscalls: Set to the current totals
+static void counters_read(pid_t pid, ProcCounters *pc, long long *ticks, long long *syscalls) {
+    long long rw_calls;
+    int i;
+    read_proc(pid, ticks, &rw_calls);
+    if (!pc->use_perf) {
+        *syscalls = rw_calls;
+        return;
+    }
+    *syscalls = 0;
+    for (i = 0; i < pc->num_perf_fds; i++) {
+        long long v = 0;
+        if (read(pc->perf_fds[i], &v, sizeof(v)) == sizeof(v)) {
+            *syscalls += v;
+        }
+    }
+}
+
+// Releases perf counters
+// Parameters:
+// - pc: Counter state from counters_start
+static void counters_stop(ProcCounters *pc) {
+    while (pc->num_perf_fds > 0) {
+        close(pc->perf_fds[--pc->num_perf_fds]);
+    }
+}
+
+// Reads until the expected number of bytes arrived or the peer closed
+// Parameters:
+// - sd: Connected TCP socket
+// - expected: Number of stream bytes the transfer should produce
+// - start: Time the request started, for time-to-first-byte
+// - ttfb: Set to the time-to-first-byte in microseconds
+// - first: Set to the first byte of the stream
+// Returns the number of bytes received
+static long long read_stream(int sd, long long expected, long long start, long long *ttfb, char *first) {
+    static __thread char buf[1 << 16];
+    long long total = 0;
+    ssize_t n;
+    while (total < expected && (n = read(sd, buf, sizeof(buf))) > 0) {
+        if (total == 0) {
+            *ttfb = now_us() - start;
+            *first = buf[0];
+        }
+        total += n;
+    }
+    return total;
+}
+
+// Downloads a file from the Lab3 TCP file server
+// Returns the number of file bytes received, or -1 on error
+static long long fetch_tcp(int port, const char *filename, long long size, long long *ttfb) {
+    struct sockaddr_in addr;
+    long long start = now_us(), chunks, total;
+    char first = 0;
+    int sd;
+
+    loopback(&addr, port);
+    sd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(sd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(sd);
+        return -1;
+    }
+    write(sd, filename, strlen(filename));
+    // Every chunk is one 'F' byte followed by up to LAB3_BUFLEN - 1 bytes of data
+    chunks = (size + LAB3_BUFLEN - 2) / (LAB3_BUFLEN - 1);
+    total = read_stream(sd, size + chunks, start, ttfb, &first);
+    close(sd);
+    if (first != 'F' || total != size + chunks) {
+        return -1;
+    }
+    return size;
+}
+
+// Downloads a file from the Lab4 UDP file download server
+// Returns the number of file bytes received, or -1 on error or loss
+static long long fetch_udp(int port, const char *filename, long long size, long long *ttfb) {
+    struct sockaddr_in addr;
+    struct { char type; char data[LAB4_DATALEN]; } spdu;
+    struct pollfd pfd;
+    long long start, received = 0;
+    int sd, rcvbuf = 8 << 20, done = 0;
+    ssize_t n;
+
+    loopback(&addr, port);
+    sd = socket(AF_INET, SOCK_DGRAM, 0);
+    setsockopt(sd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    memset(&spdu, 0, sizeof(spdu));
+    spdu.type = 'C';
+    strncpy(spdu.data, filename, sizeof(spdu.data) - 1);
+    start = now_us();
+    sendto(sd, &spdu, sizeof(spdu), 0, (struct sockaddr *)&addr, sizeof(addr));
+
+    pfd.fd = sd;
+    pfd.events = POLLIN;
+    while (!done && poll(&pfd, 1, UDP_IDLE_TIMEOUT_MS) == 1) {
+        if ((n = recv(sd, &spdu, sizeof(spdu), 0)) <= 0) {
+            break;
+        }
+        if (spdu.type == 'D') {
+            if (received == 0) {
+                *ttfb = now_us() - start;
+            }
+            received += n - 1;
+        } else if (spdu.type == 'F') {
+            done = 1;
+        } else if (spdu.type == 'E') {
+            break;
+        }
+    }
+    close(sd);
+    return (done && received == size) ? size : -1;
+}
+
+// Downloads a file from a p2p_client seeder
+// Returns the number of file bytes received, or -1 on error
+static long long fetch_p2p(int port, const char *filename, long long size, long long *ttfb) {
+    struct sockaddr_in addr;
+    struct { char type; char data[P2P_BUFLEN]; } request;
+    long long start = now_us(), chunks, total;
+    char first = 0;
+    int sd;
+
+    loopback(&addr, port);
+    sd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(sd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(sd);
+        return -1;
+    }
+    memset(&request, 0, sizeof(request));
+    request.type = 'D';
+    strncpy(request.data, filename, sizeof(request.data) - 1);
+    write(sd, &request, sizeof(request));
+    // Every chunk is a CONTENT_DATA byte plus up to P2P_BUFLEN bytes, then one FINAL byte
+    chunks = (size + P2P_BUFLEN - 1) / P2P_BUFLEN;
+    total = read_stream(sd, size + chunks + 1, start, ttfb, &first);
+    close(sd);
+    if (first != 'C' || total != size + chunks + 1) {
+        return -1;
+    }
+    return size;
+}
+
+// Client thread: downloads the same file job->reps times
+// Parameters:
+// - arg: The ClientJob to run
+static void *client_thread(void *arg) {
+    ClientJob *job = (ClientJob *)arg;
+    int i;
+    for (i = 0; i < job->reps; i++) {
+        long long ttfb = 0, got;
+        switch (job->target) {
+        case TARGET_TCP: got = fetch_tcp(job->port, job->filename, job->size, &ttfb); break;
+        case TARGET_UDP: got = fetch_udp(job->port, job->filename, job->size, &ttfb); break;
+        default: got = fetch_p2p(job->port, job->filename, job->size, &ttfb); break;
+        }
+        if (got < 0) {
+            job->errors++;
+            continue;
+        }
+        job->bytes += got;
+        histogram_record(&job->ttfb, (uint64_t)ttfb);
+    }
+    return NULL;
+}
+
+// Returns the calling process's user + system CPU time in seconds
+static double self_cpu_seconds(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return (double)ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+           (double)ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+// Runs one (target, size, clients) measurement and writes its JSON record
+// Parameters:
+// - target: Server under test
+// - server: The running server
+// - size_index: Index of the file size in the configuration
+// - clients: Number of concurrent clients
+static void run_one(int target, Server *server, int size_index, int clients) {
+    static ClientJob jobs[MAX_THREADS];
+    pthread_t threads[MAX_THREADS];
+    ProcCounters pc;
+    Histogram ttfb;
+    char name[16];
+    long long size = config.sizes[size_index], start, elapsed_us;
+    long long ticks0, ticks1, sys0, sys1, bytes = 0;
+    double cpu0, cpu1, gb, mb;
+    int reps, errors = 0, transfers = 0, i;
+
+    size_name(size, name);
+    reps = (int)(config.run_bytes / size / clients);
+    if (reps < 1) reps = 1;
+    if (reps > MAX_REPS) reps = MAX_REPS;
+
+    for (i = 0; i < clients; i++) {
+        memset(&jobs[i], 0, sizeof(jobs[i]));
+        jobs[i].target = target;
+        jobs[i].port = server->ports[size_index];
+        jobs[i].filename = name;
+        jobs[i].size = size;
+        jobs[i].reps = reps;
+        histogram_init(&jobs[i].ttfb);
+    }
+
+    counters_start(server->pid, &pc);
+    counters_read(server->pid, &pc, &ticks0, &sys0);
+    cpu0 = self_cpu_seconds();
+    start = now_us();
+    for (i = 0; i < clients; i++) {
+        pthread_create(&threads[i], NULL, client_thread, &jobs[i]);
+    }
+    for (i = 0; i < clients; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    elapsed_us = now_us() - start;
+    cpu1 = self_cpu_seconds();
+    counters_read(server->pid, &pc, &ticks1, &sys1);
+    counters_stop(&pc);
+
+    histogram_init(&ttfb);
+    for (i = 0; i < clients; i++) {
+        bytes += jobs[i].bytes;
+        errors += jobs[i].errors;
+        transfers += jobs[i].reps - jobs[i].errors;
+        histogram_merge(&ttfb, &jobs[i].ttfb);
+    }
+    gb = (double)bytes / (1 << 30);
+    mb = (double)bytes / (1 << 20);
+
+    fprintf(stderr, "%-24s %-6s clients=%-3d %8.1f MB/s  errors=%d\n", target_names[target], name, clients,
+            elapsed_us > 0 ? mb / (elapsed_us / 1e6) : 0.0, errors);
+
+    fprintf(config.out, "%s    {\"server\": \"%s\", \"file_size\": %lld, \"clients\": %d, \"transfers\": %d, \"errors\": %d,\n",
+            first_result ? "" : ",\n", target_keys[target], size, clients, transfers, errors);
+    fprintf(config.out, "     \"bytes\": %lld, \"seconds\": %.6f, \"mb_per_s\": %.3f,\n",
+            bytes, elapsed_us / 1e6, elapsed_us > 0 ? mb / (elapsed_us / 1e6) : 0.0);
+    fprintf(config.out, "     \"server_cpu_s_per_gb\": %.4f, \"client_cpu_s_per_gb\": %.4f,\n",
+            gb > 0 ? (double)(ticks1 - ticks0) / sysconf(_SC_CLK_TCK) / gb : 0.0,
+            gb > 0 ? (cpu1 - cpu0) / gb : 0.0);
+    fprintf(config.out, "     \"server_syscalls_per_mb\": %.2f, \"syscall_source\": \"%s\",\n",
+            mb > 0 ? (double)(sys1 - sys0) / mb : 0.0, pc.use_perf ? "perf" : "proc_io");
+    fprintf(config.out, "     \"ttfb_us\": {\"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu}}",
+            (unsigned long long)histogram_percentile(&ttfb, 50.0),
+            (unsigned long long)histogram_percentile(&ttfb, 90.0),
+            (unsigned long long)histogram_percentile(&ttfb, 99.0),
+            (unsigned long long)histogram_percentile(&ttfb, 99.9),
+            (unsigned long long)ttfb.max);
+    first_result = 0;
+}
+
+// Removes the generated files and the work directory
+static void remove_workdir(void) {
+    int i;
+    for (i = 0; i < config.num_sizes; i++) {
+        char name[16], path[600];
+        size_name(config.sizes[i], name);
+        snprintf(path, sizeof(path), "%s/%s", config.workdir, name);
+        unlink(path);
+    }
+    rmdir(config.workdir);
+}
+
+// Prints usage information and exits
+// Parameters:
+// - prog: Name of the program
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-r repo_root] [-w workdir] [-k] [-p base_port] [-s sizes] [-c max_clients]\n"
+            "          [-b bytes_per_run] [-t tcp,udp,p2p] [-x] [-o results.json]\n"
+            "  -s  comma separated file sizes with K/M/G suffixes (default %s)\n"
+            "  -c  runs 1, 2, 4, ... up to this many concurrent clients (default %d)\n"
+            "  -x  generate log-like text instead of random bytes\n"
+            "  -k  keep the generated files\n",
+            prog, DEFAULT_SIZES, DEFAULT_MAX_CLIENTS);
+    exit(1);
+}
+
+// Entry point of the transfer benchmark
+// Parameters:
+// - argc: Number of command-line arguments
+// - argv: Array of command-line arguments
+int main(int argc, char *argv[]) {
+    const char *out_path = NULL;
+    int opt, target, i, clients;
+
+    config.repo_root = "..";
+    config.base_port = DEFAULT_BASE_PORT;
+    config.max_clients = DEFAULT_MAX_CLIENTS;
+    config.run_bytes = DEFAULT_RUN_BYTES;
+    parse_sizes(DEFAULT_SIZES);
+    for (i = 0; i < NUM_TARGETS; i++) {
+        config.enabled[i] = 1;
+    }
+
+    while ((opt = getopt(argc, argv, "r:w:kp:s:c:b:t:xo:")) != -1) {
+        switch (opt) {
+        case 'r': config.repo_root = optarg; break;
+        case 'w': strncpy(config.workdir, optarg, sizeof(config.workdir) - 1); config.keep_workdir = 1; break;
+        case 'k': config.keep_workdir = 1; break;
+        case 'p': config.base_port = atoi(optarg); break;
+        case 's':
+            if (parse_sizes(optarg) == -1) {
+                usage(argv[0]);
+            }
+            break;
+        case 'c': config.max_clients = atoi(optarg); break;
+        case 'b': config.run_bytes = parse_size(optarg); break;
+        case 't':
+            for (i = 0; i < NUM_TARGETS; i++) {
+                config.enabled[i] = strstr(optarg, target_keys[i]) != NULL;
+            }
+            break;
+        case 'x': config.text_content = 1; break;
+        case 'o': out_path = optarg; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (config.max_clients < 1 || config.max_clients > MAX_THREADS || config.run_bytes < 1) {
+        usage(argv[0]);
+    }
+
+    if (config.workdir[0] == '\0') {
+        strcpy(config.workdir, "/tmp/transfer_bench.XXXXXX");
+        if (mkdtemp(config.workdir) == NULL) {
+            perror("Cannot create work directory");
+            exit(1);
+        }
+    } else {
+        mkdir(config.workdir, 0755);
+    }
+    if (config.repo_root[0] != '/') {
+        // Servers run inside the work directory, so make the path absolute
+        static char root[512];
+        if (realpath(config.repo_root, root) == NULL) {
+            perror("Cannot resolve repository root");
+            exit(1);
+        }
+        config.repo_root = root;
+    }
+    config.out = stdout;
+    if (out_path && (config.out = fopen(out_path, "w")) == NULL) {
+        perror("Cannot open output file");
+        exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    for (i = 0; i < config.num_sizes; i++) {
+        generate_file(config.sizes[i]);
+    }
+
+    fprintf(config.out, "{\n  \"benchmark\": \"transfer\",\n  \"timestamp\": %lld,\n  \"content\": \"%s\",\n  \"results\": [\n",
+            (long long)time(NULL), config.text_content ? "text" : "random");
+    for (target = 0; target < NUM_TARGETS; target++) {
+        Server server;
+        if (!config.enabled[target]) {
+            continue;
+        }
+        if (start_server(target, &server) == -1) {
+            fprintf(stderr, "%s did not start, skipping\n", target_names[target]);
+            stop_server(&server);
+            continue;
+        }
+        for (i = 0; i < config.num_sizes; i++) {
+            for (clients = 1; ; clients *= 2) {
+                if (clients > config.max_clients) {
+                    clients = config.max_clients;
+                }
+                run_one(target, &server, i, clients);
+                if (clients == config.max_clients) {
+                    break;
+                }
+            }
+        }
+        stop_server(&server);
+    }
+    fprintf(config.out, "\n  ]\n}\n");
+    if (config.out != stdout) {
+        fclose(config.out);
+    }
+
+    if (!config.keep_workdir) {
+        remove_workdir();
+    }
+    return 0;
+}
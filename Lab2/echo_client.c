@@ -16,9 +16,8 @@ int main(int argc, char **argv)
 {
 	int 	n, i, bytes_to_read;
 	int 	sd, port;
-	struct	hostent		*hp;
-	struct	sockaddr_in server;
-	char	*host, *bp, rbuf[BUFLEN], sbuf[BUFLEN];
+	struct	addrinfo	hints, *res, *ai;
+	char	*host, *bp, rbuf[BUFLEN], sbuf[BUFLEN], service[16];
 
 	switch(argc){
 	case 2:
@@ -34,24 +33,28 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
-	/* Create a stream socket	*/	
-	if ((sd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-		fprintf(stderr, "Can't creat a socket\n");
-		exit(1);
-	}
-
-	bzero((char *)&server, sizeof(struct sockaddr_in));
-	server.sin_family = AF_INET;
-	server.sin_port = htons(port);
-	if (hp = gethostbyname(host)) 
-	  bcopy(hp->h_addr, (char *)&server.sin_addr, hp->h_length);
-	else if ( inet_aton(host, (struct in_addr *) &server.sin_addr) ){
+	/* Look up the server's IPv6 and IPv4 addresses	*/
+	bzero((char *)&hints, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	sprintf(service, "%d", port);
+	if (getaddrinfo(host, service, &hints, &res) != 0) {
 	  fprintf(stderr, "Can't get server's address\n");
 	  exit(1);
 	}
 
-	/* Connecting to the server */
-	if (connect(sd, (struct sockaddr *)&server, sizeof(server)) == -1){
+	/* Create a stream socket and connect, trying each address in turn */
+	sd = -1;
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+	  if ((sd = socket(ai->ai_family, ai->ai_socktype, 0)) == -1)
+	    continue;
+	  if (connect(sd, ai->ai_addr, ai->ai_addrlen) == 0)
+	    break;
+	  close(sd);
+	  sd = -1;
+	}
+	freeaddrinfo(res);
+	if (sd == -1){
 	  fprintf(stderr, "Can't connect \n");
 	  exit(1);
 	}
@@ -16,8 +16,8 @@ void reaper(int);
 
 int main(int argc, char **argv)
 {
-	int 	sd, new_sd, client_len, port;
-	struct	sockaddr_in server, client;
+	int 	sd, new_sd, client_len, port, off = 0;
+	struct	sockaddr_in6 server, client;
 
 	switch(argc){
 	case 1:
@@ -32,16 +32,18 @@ int main(int argc, char **argv)
 	}
 
 	/* Create a stream socket	*/	
-	if ((sd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+	if ((sd = socket(AF_INET6, SOCK_STREAM, 0)) == -1) {
 		fprintf(stderr, "Can't creat a socket\n");
 		exit(1);
 	}
+	/* Accept IPv4 clients too, as IPv4-mapped addresses	*/
+	setsockopt(sd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
 
 	/* Bind an address to the socket	*/
-	bzero((char *)&server, sizeof(struct sockaddr_in));
-	server.sin_family = AF_INET;
-	server.sin_port = htons(port);
-	server.sin_addr.s_addr = htonl(INADDR_ANY);
+	bzero((char *)&server, sizeof(struct sockaddr_in6));
+	server.sin6_family = AF_INET6;
+	server.sin6_port = htons(port);
+	server.sin6_addr = in6addr_any;
 	if (bind(sd, (struct sockaddr *)&server, sizeof(server)) == -1){
 		fprintf(stderr, "Can't bind name to socket\n");
 		exit(1);
@@ -6,14 +6,68 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <fcntl.h>
+#include <errno.h>
 
 #define SERVER_TCP_PORT 15000    /* Default server port */
 #define BUFLEN 256              /* Buffer length */
+#define WRITE_BUFFER_SIZE (1024 * 1024) /* File data gathered before each write to disk */
+
+/*
+    Reads one message from the server
+    The server sends full BUFLEN-byte messages except for the last one, but TCP may
+    hand them over in pieces, so this reads until a message is whole or the stream ends
+    sd -> Socket Descriptor
+    buffer -> BUFLEN bytes for the message
+    Returns the message length, 0 at the end of the stream, -1 on error
+*/
+int read_message(int sd, char *buffer) {
+    int got = 0, n;
+
+    while (got < BUFLEN) {
+        n = read(sd, buffer + got, BUFLEN - got);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break; // Server closed the connection
+        }
+        got += n;
+    }
+    return got;
+}
+
+/*
+    Writes buffered file data at its place in the file
+    fd -> File descriptor of the download
+    data -> Bytes to write
+    len -> Number of bytes
+    offset -> Where in the file they go
+    Returns 0 on success, -1 on error
+*/
+int write_at(int fd, const char *data, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, data, len, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        data += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
 
 int main(int argc, char *argv[]) {
     int sd, port; // Socket Descriptor and port
-    struct hostent *hp; // Pointer to a hostent used for DNS lookup
-    struct sockaddr_in server; // Server address
+    struct addrinfo hints, *res, *ai; // Lookup hints, the server's addresses and the one being tried
+    char service[16]; // Port as text for getaddrinfo
     char buffer[BUFLEN], filename[BUFLEN]; // Buffer's incoming data from server and filename that is taken from the user
     int n; // Stores the number of bytes read
 
@@ -26,26 +80,30 @@ int main(int argc, char *argv[]) {
     char *host = argv[1]; // gets the host ip as a string
     port = (argc == 3) ? atoi(argv[2]) : SERVER_TCP_PORT; // if the port is given use it or else use the defualt port
 
-    /* Create a TCP stream socket */
-    if ((sd = socket(AF_INET, SOCK_STREAM, 0)) == -1) { // Creates a TCP Socket (SOCK_STREAM) using IPv4 (AF_INET)
-        fprintf(stderr, "Can't create a socket\n");
-        exit(1);
-    }
-
-    /* Set up the server address structure */
-    bzero((char *)&server, sizeof(struct sockaddr_in)); // Creates a server address structure initialized to 0
-    server.sin_family = AF_INET; // IPv4
-    server.sin_port = htons(port); // Converts the port number to a network byte
-
-    /* Get the host address */
-    if ((hp = gethostbyname(host)) == NULL) { // Resolves the server's hostname to a IP Address
+    /* Get the host addresses */
+    bzero((char *)&hints, sizeof(hints)); // Zeroed hints mean no special flags
+    hints.ai_family = AF_UNSPEC; // IPv6 or IPv4, whichever the host has
+    hints.ai_socktype = SOCK_STREAM; // TCP
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(host, service, &hints, &res) != 0) { // Resolves the server's hostname or IPv4/IPv6 literal to its addresses
         fprintf(stderr, "Can't get server's address\n");
         exit(1);
     }
-    bcopy(hp->h_addr, (char *)&server.sin_addr, hp->h_length); // Copies the server's IP Address to the server address structure
 
-    /* Connect to the server */
-    if (connect(sd, (struct sockaddr *)&server, sizeof(server)) == -1) { // Connects to the server using the socket descriptor and the server address structure
+    /* Create a TCP stream socket and connect to the server */
+    sd = -1;
+    for (ai = res; ai != NULL; ai = ai->ai_next) { // Tries each address in order until one accepts
+        if ((sd = socket(ai->ai_family, ai->ai_socktype, 0)) == -1) { // Creates a TCP Socket in the address's family
+            continue;
+        }
+        if (connect(sd, ai->ai_addr, ai->ai_addrlen) == 0) { // Connects to the server using the socket descriptor and the address
+            break;
+        }
+        close(sd);
+        sd = -1;
+    }
+    freeaddrinfo(res);
+    if (sd == -1) {
         fprintf(stderr, "Can't connect to server\n");
         exit(1);
     }
@@ -58,32 +116,60 @@ int main(int argc, char *argv[]) {
     /* Send the filename to the server over the socket using the descriptor */
     write(sd, filename, strlen(filename));
 
-    /* Tries to create the file locally to store the recived data, on failure closes the socket */
-    FILE *file = fopen(filename, "wb");
-    if (file == NULL) {
+    /* Tries to create the file locally under a temporary name, renamed once the whole file is in; on failure closes the socket */
+    char temp[BUFLEN + 8]; // filename.part
+    snprintf(temp, sizeof(temp), "%s.part", filename);
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    char *pending = malloc(WRITE_BUFFER_SIZE); // File data not written to disk yet
+    size_t used = 0; // Bytes in pending
+    off_t offset = 0; // Bytes written to disk so far
+    int failed = 0; // Set if the server sent an error or writing failed
+    if (fd == -1 || pending == NULL) {
         fprintf(stderr, "Error opening file to write received data.\n");
         close(sd);
         exit(1);
     }
 
     /* Continously reads data from the socket/server */
-    while ((n = read(sd, buffer, BUFLEN)) > 0) {
+    while ((n = read_message(sd, buffer)) > 0) {
         if (buffer[0] == 'E') { // If the message starts with a E it is an error
             // Handle error message
+            buffer[n < BUFLEN ? n : BUFLEN - 1] = '\0';
             printf("Error from server: %s\n", buffer + 1);
-			remove(filename); // Delete the created file if there is an error from the server
+            failed = 1;
             break;
+        } else if (buffer[0] == 'S') { // If the message starts with S it holds the file size, reserve the space up front
+            buffer[BUFLEN - 1] = '\0';
+            posix_fallocate(fd, 0, atoll(buffer + 1)); // If it isn't supported the file just grows as it is written
         } else if (buffer[0] == 'F') { // If the message starts with F it contains file data and shoud be written to the file
-            // Write file data to the file
-            fwrite(buffer + 1, sizeof(char), n - 1, file); // Starting address / size of character / number of elements to write / file to write to
+            // Gather file data and write it in large pieces rather than one small write per message
+            memcpy(pending + used, buffer + 1, n - 1);
+            used += n - 1;
+            if (used > WRITE_BUFFER_SIZE - BUFLEN) {
+                if (write_at(fd, pending, used, offset) == -1) {
+                    failed = 1;
+                    break;
+                }
+                offset += used;
+                used = 0;
+            }
         }
     }
 
-    fclose(file); // Closes the file and socket
+    /* Writes what is left, trims any space reserved past the end, and moves the file into place */
+    if (!failed && n == 0 && (write_at(fd, pending, used, offset) == -1 || ftruncate(fd, offset + used) == -1)) {
+        fprintf(stderr, "Error writing received data.\n");
+        failed = 1;
+    }
+    close(fd); // Closes the file and socket
     close(sd);
+    free(pending);
+    if (failed || n < 0 || rename(temp, filename) == -1) {
+        unlink(temp); // Delete the partial file if there is an error
+    }
 
     /* Prints the result of the file transfer */
-    if (n == 0) {
+    if (n == 0 && !failed) {
         printf("File transfer complete.\n");
     } else if (n < 0) {
         printf("Error reading from server.\n");
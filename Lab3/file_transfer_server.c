@@ -5,9 +5,42 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <fcntl.h>
+#include <time.h>
 
 #define SERVER_TCP_PORT 15000    /* Default server port */
 #define BUFLEN 256              /* Buffer length */
+#define READAHEAD_MS 500                      /* Sending time the readahead window covers */
+#define READAHEAD_MIN (1024 * 1024)           /* Smallest readahead window */
+#define READAHEAD_MAX (64 * 1024 * 1024)      /* Largest readahead window */
+
+/*
+    Keeps the kernel reading the file ahead of what has been sent
+    The window covers READAHEAD_MS of sending at the rate the client has taken data
+    so far, so a slow client doesn't fill the page cache and a fast one doesn't wait on the disk
+    fd -> File descriptor of the file being sent
+    sent -> Bytes of the file sent so far
+    ahead -> End of the range asked for so far, updated
+    start -> When the transfer started
+*/
+void read_ahead(int fd, off_t sent, off_t *ahead, const struct timespec *start) {
+    struct timespec now;
+    double elapsed;
+    off_t window = READAHEAD_MIN;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+    if (elapsed > 0.1) { // The first moments say little about the client's rate
+        window = (off_t)(sent / elapsed * READAHEAD_MS / 1000);
+        window = window < READAHEAD_MIN ? READAHEAD_MIN : window;
+        window = window > READAHEAD_MAX ? READAHEAD_MAX : window;
+    }
+    if (sent + window / 2 >= *ahead) { // Top the window up once half of it has been sent
+        off_t from = *ahead > sent ? *ahead : sent;
+        posix_fadvise(fd, from, sent + window - from, POSIX_FADV_WILLNEED); // Starts reading in the background
+        *ahead = sent + window;
+    }
+}
 
 /* Process client requests */
 void handle_client(int new_sd) {
@@ -36,10 +69,26 @@ void handle_client(int new_sd) {
         return;
     }
 
+    // Announce the file size first so the client can reserve the space; the message is padded
+    // to a full chunk, and older clients skip it since it isn't an E or F message
+    fseek(file, 0, SEEK_END);
+    memset(buffer, 0, BUFLEN);
+    snprintf(buffer, BUFLEN, "S%ld", ftell(file)); // S -> Size indicator
+    fseek(file, 0, SEEK_SET);
+    write(new_sd, buffer, BUFLEN);
+
+    // Tell the kernel the file is read front to back, so it reads further ahead and drops pages behind us first
+    off_t sent = 0, ahead = 0; // Bytes of the file sent / end of the range the kernel is reading ahead
+    struct timespec start; // When sending started, for the client's rate
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    posix_fadvise(fileno(file), 0, 0, POSIX_FADV_SEQUENTIAL);
+
     // Send the file contents to the client in chunks 256 bytes a chunk of data
     buffer[0] = 'F'; // File indicator
     while ((n = fread(buffer + 1, sizeof(char), BUFLEN - 1, file)) > 0) {
+        read_ahead(fileno(file), sent, &ahead, &start);
         write(new_sd, buffer, n + 1); // Send the packet with data
+        sent += n;
     }
 
     fclose(file);
@@ -48,21 +97,23 @@ void handle_client(int new_sd) {
 
 int main(int argc, char *argv[]) {
     int sd, new_sd, client_len, port; // Socket descriptor for the server / sd of the client / length of the client address struct / server listen port
-    struct sockaddr_in server, client; // Two structures for the server's address and connected client's information
+    int off = 0; // IPV6_V6ONLY off, so the one socket serves IPv4 and IPv6 clients
+    struct sockaddr_in6 server, client; // Two structures for the server's address and connected client's information
 
     port = (argc == 2) ? atoi(argv[1]) : SERVER_TCP_PORT; // If the server port is given by the user use it or else use the defualt
 
     /* Create a TCP stream socket */
-    if ((sd = socket(AF_INET, SOCK_STREAM, 0)) == -1) { // Creates a TCP Socket (SOCK_STREAM) using IPv4 (AF_INET)
+    if ((sd = socket(AF_INET6, SOCK_STREAM, 0)) == -1) { // Creates a TCP Socket (SOCK_STREAM) using IPv6 (AF_INET6)
         fprintf(stderr, "Can't create a socket\n");
         exit(1);
     }
+    setsockopt(sd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)); // IPv4 clients arrive as IPv4-mapped addresses (::ffff:a.b.c.d)
 
     /* Set up the server address structure */
-    bzero((char *)&server, sizeof(struct sockaddr_in)); // Creates a server address structure initialized to 0
-    server.sin_family = AF_INET; // IPv4
-    server.sin_port = htons(port); // Converts the port number to a network byte
-    server.sin_addr.s_addr = htonl(INADDR_ANY); // Allows the server to accept connections on any of its IP addresses
+    bzero((char *)&server, sizeof(struct sockaddr_in6)); // Creates a server address structure initialized to 0
+    server.sin6_family = AF_INET6; // IPv6, which with V6ONLY off covers IPv4 too
+    server.sin6_port = htons(port); // Converts the port number to a network byte
+    server.sin6_addr = in6addr_any; // Allows the server to accept connections on any of its IP addresses
 
     /* Bind the socket */
     if (bind(sd, (struct sockaddr *)&server, sizeof(server)) == -1) { // Tries to bind the socket to the server address 
@@ -0,0 +1,167 @@
+#include <stdlib.h>
+#include <string.h>
+#include "fec.h"
+
+static unsigned char gf_exp[512];       // Powers of the generator, doubled so products need no modulo
+static unsigned char gf_log[256];       // Inverse of gf_exp
+static unsigned char gf_mul[256][256];  // Full product table, one row per multiplier
+
+/*
+    Builds the GF(256) tables, using the polynomial x^8 + x^4 + x^3 + x^2 + 1 (0x11d)
+    Call once before encoding or decoding
+*/
+void fec_init(void) {
+    int i, j, x = 1;
+
+    for (i = 0; i < 255; i++) {
+        gf_exp[i] = x;
+        gf_exp[i + 255] = x;
+        gf_log[x] = i;
+        x <<= 1;
+        if (x & 0x100) {
+            x ^= 0x11d;
+        }
+    }
+    for (i = 0; i < 256; i++) {
+        for (j = 0; j < 256; j++) {
+            gf_mul[i][j] = (i == 0 || j == 0) ? 0 : gf_exp[gf_log[i] + gf_log[j]];
+        }
+    }
+}
+
+/*
+    Returns the multiplicative inverse of a nonzero field element
+*/
+static unsigned char gf_inv(unsigned char a) {
+    return gf_exp[255 - gf_log[a]];
+}
+
+/*
+    Cauchy matrix entry for repair row j and data column i: 1 / (x_j + y_i), with x_j = k + j and y_i = i
+    Every square submatrix of a Cauchy matrix is invertible, so any k symbols are enough
+*/
+static unsigned char cauchy(int k, int j, int i) {
+    return gf_inv((unsigned char)((k + j) ^ i));
+}
+
+/*
+    dst += c * src, byte by byte
+*/
+static void mul_add(unsigned char *dst, const unsigned char *src, unsigned char c, int size) {
+    const unsigned char *row = gf_mul[c];
+    int n;
+
+    if (c == 0) {
+        return;
+    }
+    for (n = 0; n < size; n++) {
+        dst[n] ^= row[src[n]];
+    }
+}
+
+/*
+    Computes the repair symbols of a block
+    data -> The k data symbols
+    k -> Data symbols per block
+    repair -> Filled with the r repair symbols
+    r -> Repair symbols per block
+    size -> Bytes per symbol
+*/
+void fec_encode(unsigned char **data, int k, unsigned char **repair, int r, int size) {
+    int i, j;
+
+    for (j = 0; j < r; j++) {
+        memset(repair[j], 0, size);
+        for (i = 0; i < k; i++) {
+            mul_add(repair[j], data[i], cauchy(k, j, i), size);
+        }
+    }
+}
+
+/*
+    Rebuilds the missing data symbols of a block
+    symbols -> The k data then r repair symbols; missing data symbols must point to buffers to fill
+    present -> Nonzero for each symbol that was received
+    k -> Data symbols per block
+    r -> Repair symbols per block
+    size -> Bytes per symbol
+    Returns 0 if every data symbol is present afterwards, -1 if fewer than k symbols were received
+*/
+int fec_decode(unsigned char **symbols, const char *present, int k, int r, int size) {
+    int missing[256], rows[256], e = 0, found = 0, a, b, i, c;
+    unsigned char matrix[256][256], inverse[256][256];
+    unsigned char *rhs;
+
+    for (i = 0; i < k; i++) {
+        if (!present[i]) {
+            missing[e++] = i;
+        }
+    }
+    if (e == 0) {
+        return 0;
+    }
+    for (i = 0; i < r && found < e; i++) {
+        if (present[k + i]) {
+            rows[found++] = i;
+        }
+    }
+    if (found < e) {
+        return -1;
+    }
+
+    // Each chosen repair symbol minus the part the received data accounts for leaves
+    // a combination of the missing symbols only
+    rhs = malloc((size_t)e * size);
+    for (a = 0; a < e; a++) {
+        unsigned char *out = rhs + (size_t)a * size;
+        memcpy(out, symbols[k + rows[a]], size);
+        for (i = 0; i < k; i++) {
+            if (present[i]) {
+                mul_add(out, symbols[i], cauchy(k, rows[a], i), size);
+            }
+        }
+        for (b = 0; b < e; b++) {
+            matrix[a][b] = cauchy(k, rows[a], missing[b]);
+            inverse[a][b] = a == b;
+        }
+    }
+
+    // Invert the e x e system by Gauss-Jordan elimination
+    for (c = 0; c < e; c++) {
+        int pivot = c;
+        unsigned char scale;
+        while (matrix[pivot][c] == 0) {
+            pivot++; // A Cauchy submatrix is invertible, so a pivot always exists
+        }
+        if (pivot != c) {
+            for (b = 0; b < e; b++) {
+                unsigned char t = matrix[c][b]; matrix[c][b] = matrix[pivot][b]; matrix[pivot][b] = t;
+                t = inverse[c][b]; inverse[c][b] = inverse[pivot][b]; inverse[pivot][b] = t;
+            }
+        }
+        scale = gf_inv(matrix[c][c]);
+        for (b = 0; b < e; b++) {
+            matrix[c][b] = gf_mul[scale][matrix[c][b]];
+            inverse[c][b] = gf_mul[scale][inverse[c][b]];
+        }
+        for (a = 0; a < e; a++) {
+            unsigned char factor = matrix[a][c];
+            if (a == c || factor == 0) {
+                continue;
+            }
+            for (b = 0; b < e; b++) {
+                matrix[a][b] ^= gf_mul[factor][matrix[c][b]];
+                inverse[a][b] ^= gf_mul[factor][inverse[c][b]];
+            }
+        }
+    }
+
+    for (b = 0; b < e; b++) {
+        memset(symbols[missing[b]], 0, size);
+        for (a = 0; a < e; a++) {
+            mul_add(symbols[missing[b]], rhs + (size_t)a * size, inverse[b][a], size);
+        }
+    }
+    free(rhs);
+    return 0;
+}
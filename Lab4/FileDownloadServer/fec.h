@@ -0,0 +1,17 @@
+#ifndef FEC_H
+#define FEC_H
+
+/*
+    Forward error correction for the multicast push mode
+
+    Systematic Reed-Solomon erasure code over GF(256) with a Cauchy matrix:
+    a block of k data symbols gets r repair symbols, and any k of the k + r
+    symbols rebuild the data. Symbols are byte strings of equal size; the
+    code works on each byte position separately. k + r must be at most 256.
+*/
+
+void fec_init(void);
+void fec_encode(unsigned char **data, int k, unsigned char **repair, int r, int size);
+int fec_decode(unsigned char **symbols, const char *present, int k, int r, int size);
+
+#endif
@@ -7,15 +7,44 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <netinet/udp.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <net/if.h>
+#include "fec.h"
 
 #define DEFAULT_PORT 15000    /* Default server port */
 #define BUFLEN 100            /* Buffer length for file data chunks */
 
+#ifndef UDP_GRO
+#define UDP_GRO 104           /* Older headers lack the GRO option */
+#endif
+
+/* Bulk mode segments, see the server: 'S', 4-byte sequence number, file data.
+   K PDUs tell the server how many segments arrived and how many more fit. */
+#define BULK_SEGMENT_SIZE 1400                        /* Bytes per segment on the wire */
+#define BULK_HEADER 5                                 /* Type and sequence number */
+#define BULK_PAYLOAD (BULK_SEGMENT_SIZE - BULK_HEADER) /* File bytes per segment */
+#define BULK_TIMEOUT_SEC 5                            /* Give up if the server goes quiet this long */
+#define IOV_MAX_RUN 64                                /* Segments written by one pwritev() */
+#define WRITE_BUFFER_SIZE (1024 * 1024)               /* D PDU data gathered before each write to disk */
+
+/* Multicast push mode, see the server: A announces a push, M carries one
+   symbol of a block, F ends a round. Sizes come from the announcement. */
+#define MCAST_HEADER 10       /* Type, session, block, index */
+#define MCAST_MAX_SYMBOL 1472 /* Largest symbol a 1500-byte MTU carries after the header */
+#define MCAST_TIMEOUT_SEC 5   /* Give up if the group goes quiet this long */
+
 /*
     Protocol Data Units (PDUs) Data Structure
     Types:
         - C -> Filename
+        - B -> Filename, bulk mode
         - D -> Data
+        - S -> Bulk data segment
+        - K -> Bulk mode acknowledgement
         - F -> Final
         - E -> Error
 
@@ -26,38 +55,364 @@ struct pdu {
     char data[100];
 };
 
+/*
+    Receives a file sent in bulk mode
+    With UDP_GRO the kernel hands over many segments from the server in one
+    buffer, cut every gso_size bytes; without it each read returns one segment.
+    Segments carry their position, so they are written where they belong
+    even if they arrive out of order. A K PDU every quarter window lets the
+    server send more.
+    sd -> Socket Descriptor
+    server -> Server address information, where K PDUs go
+    server_len -> The length of the server address information
+    window -> Segments the receive buffer holds
+    fd -> Local file to save data
+    Returns 0 once the whole file arrived, -1 otherwise
+*/
+int receive_bulk(int sd, const struct sockaddr_storage *server, socklen_t server_len, uint32_t window, int fd) {
+    static char buffer[65536]; // Room for the largest coalesced datagram
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec run_iov[IOV_MAX_RUN]; // Consecutive segments waiting to be written
+    uint32_t received = 0, acked = 0, total, seq, run_seq = 0;
+    off_t plain_bytes = 0; // Bytes received in D PDUs
+    int n, run;
+    char ack[9] = { 'K' }; // Type, segments received, window
+
+    // Announce the window straight away; the server starts with a small one
+    acked = htonl(received);
+    window = htonl(window);
+    memcpy(ack + 1, &acked, sizeof(acked));
+    memcpy(ack + 5, &window, sizeof(window));
+    sendto(sd, ack, sizeof(ack), 0, (struct sockaddr *)server, server_len);
+    window = ntohl(window);
+    acked = 0;
+
+    while (1) {
+        struct iovec iov = { buffer, sizeof(buffer) };
+        struct msghdr msg;
+        struct cmsghdr *cm;
+        int segment_size, at;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if ((n = recvmsg(sd, &msg, 0)) <= 0) {
+            printf("Error: Server stopped sending.\n");
+            return -1;
+        }
+        segment_size = n; // A lone segment unless the kernel says it coalesced several
+        for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+                memcpy(&segment_size, CMSG_DATA(cm), sizeof(segment_size));
+            }
+        }
+
+        if (buffer[0] == 'E') {
+            buffer[n < (int)sizeof(buffer) ? n : (int)sizeof(buffer) - 1] = '\0';
+            printf("Error: %s\n", buffer + 1);
+            return -1;
+        } else if (buffer[0] == 'D') {
+            // A server without bulk mode answers with plain D PDUs
+            pwrite(fd, buffer + 1, n - 1, plain_bytes);
+            plain_bytes += n - 1;
+            continue;
+        } else if (buffer[0] == 'F' && n < 5) {
+            return 0;
+        } else if (buffer[0] == 'F') {
+            memcpy(&total, buffer + 1, sizeof(total));
+            total = ntohl(total);
+            if (received != total) {
+                printf("Error: %u of %u segments lost.\n", total - received, total);
+                return -1;
+            }
+            return 0;
+        }
+
+        // Write each segment at the offset its sequence number gives, runs of consecutive segments in one call
+        for (at = 0, run = 0; at + BULK_HEADER <= n; at += segment_size) {
+            int len = (n - at < segment_size ? n - at : segment_size) - BULK_HEADER;
+            if (buffer[at] != 'S') {
+                continue;
+            }
+            memcpy(&seq, buffer + at + 1, sizeof(seq));
+            seq = ntohl(seq);
+            if (run > 0 && (seq != run_seq + run || run == IOV_MAX_RUN)) {
+                pwritev(fd, run_iov, run, (off_t)run_seq * BULK_PAYLOAD);
+                run = 0;
+            }
+            if (run == 0) {
+                run_seq = seq;
+            }
+            run_iov[run].iov_base = buffer + at + BULK_HEADER;
+            run_iov[run].iov_len = len;
+            run++;
+            received++;
+        }
+        if (run > 0) {
+            pwritev(fd, run_iov, run, (off_t)run_seq * BULK_PAYLOAD);
+        }
+
+        // Data is on its way to disk, so the buffer has room again
+        if (received - acked >= window / 4) {
+            uint32_t value = htonl(received);
+            memcpy(ack + 1, &value, sizeof(value));
+            sendto(sd, ack, sizeof(ack), 0, (struct sockaddr *)server, server_len);
+            acked = received;
+        }
+    }
+}
+
+/*
+    Joins a multicast group and saves the file pushed to it
+    Symbols are kept per block until k of them have arrived; the missing data
+    symbols are then rebuilt from the repair symbols and the block is written
+    at its offset, so blocks can complete in any order and in any round.
+    group -> Multicast group address, IPv4 or IPv6
+    port -> UDP port of the group
+    interface -> Network interface to join on, NULL for the default
+    Returns 0 on success, -1 on error
+*/
+int join_push(const char *group, int port, const char *interface) {
+    struct addrinfo hints, *res;
+    char service[16];
+    unsigned char packet[MCAST_HEADER + MCAST_MAX_SYMBOL];
+    unsigned int ifindex = interface ? if_nametoindex(interface) : 0;
+    int sd, fd = -1, on = 1, rcvbuf = 8 * 1024 * 1024, k = 0, r = 0, symbol_size = 0, i, n, result = -1;
+    struct timeval timeout = {MCAST_TIMEOUT_SEC, 0};
+    uint32_t session = 0, blocks = 0, done = 0, block, value;
+    unsigned char **symbols = NULL; // Per block: k + r symbol buffers, allocated when the block's first symbol arrives
+    char *present = NULL;           // Per block and symbol: whether it arrived
+    unsigned char *complete = NULL; // Per block: whether it was written
+    long long file_size = 0, recovered = 0;
+    char filename[BUFLEN], temp[BUFLEN + 8];
+
+    if (interface != NULL && ifindex == 0) {
+        fprintf(stderr, "Unknown interface %s\n", interface);
+        return -1;
+    }
+    bzero((char *)&hints, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(group, service, &hints, &res) != 0) {
+        fprintf(stderr, "Invalid multicast group\n");
+        return -1;
+    }
+    if ((sd = socket(res->ai_family, SOCK_DGRAM, 0)) == -1) {
+        perror("Can't create socket");
+        freeaddrinfo(res);
+        return -1;
+    }
+    setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)); // Several receivers on one host share the port
+    setsockopt(sd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)); // Nobody slows the sender down, so buffer plenty
+    setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    // Bind to the group address itself, so only its packets arrive, then join it
+    if (res->ai_family == AF_INET6 && ((struct sockaddr_in6 *)res->ai_addr)->sin6_scope_id == 0) {
+        ((struct sockaddr_in6 *)res->ai_addr)->sin6_scope_id = ifindex; // Link-local groups need to know the interface
+    }
+    if (bind(sd, res->ai_addr, res->ai_addrlen) == -1) {
+        perror("Can't bind to the group");
+        freeaddrinfo(res);
+        close(sd);
+        return -1;
+    }
+    if (res->ai_family == AF_INET6) {
+        struct ipv6_mreq mreq;
+        memcpy(&mreq.ipv6mr_multiaddr, &((struct sockaddr_in6 *)res->ai_addr)->sin6_addr, sizeof(struct in6_addr));
+        mreq.ipv6mr_interface = ifindex;
+        n = setsockopt(sd, IPPROTO_IPV6, IPV6_JOIN_GROUP, &mreq, sizeof(mreq));
+    } else {
+        struct ip_mreqn mreq;
+        bzero((char *)&mreq, sizeof(mreq));
+        mreq.imr_multiaddr = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
+        mreq.imr_ifindex = ifindex;
+        n = setsockopt(sd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
+    }
+    freeaddrinfo(res);
+    if (n == -1) {
+        perror("Can't join the group");
+        close(sd);
+        return -1;
+    }
+    printf("Joined %s port %d, waiting for a push...\n", group, port);
+
+    while (1) {
+        n = recv(sd, packet, sizeof(packet), 0);
+        if (n < 0) {
+            fprintf(stderr, "Timed out waiting for the %s\n", fd == -1 ? "announcement" : "rest of the file");
+            break;
+        }
+        if (n < 5) {
+            continue; // Too short to belong to any push
+        }
+
+        if (packet[0] == 'A' && fd == -1 && n > 17) {
+            // The first announcement picks the push to follow
+            memcpy(&session, packet + 1, 4);
+            memcpy(&value, packet + 5, 4);
+            file_size = (long long)ntohl(value) << 32;
+            memcpy(&value, packet + 9, 4);
+            file_size |= ntohl(value);
+            symbol_size = (packet[13] << 8) | packet[14];
+            k = packet[15];
+            r = packet[16];
+            if (symbol_size == 0 || symbol_size > MCAST_MAX_SYMBOL || k == 0 || k + r > 256) {
+                fprintf(stderr, "Unsupported push parameters\n");
+                break;
+            }
+            packet[n - 1] = '\0';
+            char *name = strrchr((char *)packet + 17, '/') ? strrchr((char *)packet + 17, '/') + 1 : (char *)packet + 17;
+            snprintf(filename, sizeof(filename), "%.*s", BUFLEN - 1, name); // Saved in the current directory
+            snprintf(temp, sizeof(temp), "%s.part", filename); // Renamed to filename once complete
+            fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd == -1) {
+                perror("Can't create file");
+                break;
+            }
+            posix_fallocate(fd, 0, file_size); // Blocks arrive in any order, so reserve the whole file up front
+            blocks = (file_size + (long long)k * symbol_size - 1) / ((long long)k * symbol_size);
+            symbols = calloc(blocks, sizeof(*symbols));
+            present = calloc((size_t)blocks * (k + r), 1);
+            complete = calloc(blocks, 1);
+            printf("Receiving %s (%lld bytes)\n", filename, file_size);
+            if (blocks == 0) {
+                result = 0;
+                break;
+            }
+            continue;
+        }
+        if (fd == -1 || memcmp(packet + 1, &session, 4) != 0) {
+            continue; // No push followed yet, or another push
+        }
+
+        if (packet[0] == 'M' && n == MCAST_HEADER + symbol_size) {
+            char *have;
+            memcpy(&value, packet + 5, 4);
+            block = ntohl(value);
+            i = packet[9];
+            if (block >= blocks || i >= k + r || complete[block]) {
+                continue;
+            }
+            have = present + (size_t)block * (k + r);
+            if (have[i]) {
+                continue; // Repeated in a later round
+            }
+            if (symbols[block] == NULL) {
+                symbols[block] = malloc((size_t)(k + r) * symbol_size);
+            }
+            memcpy(symbols[block] + (size_t)i * symbol_size, packet + MCAST_HEADER, symbol_size);
+            have[i] = 1;
+
+            int count = 0, lost = 0;
+            for (int j = 0; j < k + r; j++) {
+                count += have[j];
+            }
+            if (count < k) {
+                continue;
+            }
+
+            // k symbols are enough: rebuild the data symbols and write the block
+            unsigned char *rows[256];
+            long long offset = (long long)block * k * symbol_size;
+            long long length = file_size - offset < (long long)k * symbol_size ? file_size - offset : (long long)k * symbol_size;
+            for (int j = 0; j < k + r; j++) {
+                rows[j] = symbols[block] + (size_t)j * symbol_size;
+            }
+            for (int j = 0; j < k; j++) {
+                lost += !have[j];
+            }
+            fec_decode(rows, have, k, r, symbol_size);
+            recovered += lost;
+            if (pwrite(fd, symbols[block], length, offset) != length) {
+                perror("Error writing file");
+                break;
+            }
+            free(symbols[block]);
+            symbols[block] = NULL;
+            complete[block] = 1;
+            if (++done == blocks) {
+                result = 0;
+                break;
+            }
+        } else if (packet[0] == 'F' && n >= 6 && packet[5] == 0) {
+            // Last round over and still missing blocks
+            fprintf(stderr, "Push ended with %u of %u blocks missing\n", blocks - done, blocks);
+            break;
+        }
+    }
+
+    if (fd != -1 && (close(fd) == -1 || (result == 0 && rename(temp, filename) == -1))) {
+        perror("Error saving file");
+        result = -1;
+    }
+    if (result == 0) {
+        printf("File received successfully: %lld bytes, %lld symbols rebuilt from repair data\n", file_size, recovered);
+    } else if (fd != -1) {
+        unlink(temp); // Don't leave a partial file behind
+    }
+    for (block = 0; symbols != NULL && block < blocks; block++) {
+        free(symbols[block]);
+    }
+    free(symbols);
+    free(present);
+    free(complete);
+    close(sd);
+    return result;
+}
+
 int main(int argc, char *argv[]) {
     int sd, port; // socket descriptor and port
-    struct sockaddr_in server; // server address information
-    struct hostent *hp;
-    socklen_t server_len = sizeof(server);
+    struct sockaddr_storage server; // server address information, IPv4 or IPv6
+    struct addrinfo hints, *res; // Lookup hints and the server's addresses
+    char service[16]; // Port as text for getaddrinfo
+    socklen_t server_len;
     struct pdu spdu; // PDU instance to send and recieve data
-    FILE *file; // File object for sotring the downloaded file
+    int fd; // Local file the download is written to
+    char temp[BUFLEN + 8]; // Name the download is written under until complete
+    char *pending; // D PDU data not written to disk yet
+    size_t used = 0; // Bytes in pending
+    off_t offset = 0; // Bytes written to disk so far
+    int complete = 0; // Set once the whole file arrived
     int n;
     char filename[BUFLEN];
+    int bulk = argc == 4; // Whether to ask for the file in bulk mode
+    uint32_t window = 0; // Bulk segments the receive buffer holds
+
+    // Multicast receivers join a group instead of asking a server
+    if ((argc == 4 || argc == 5) && strcmp(argv[3], "join") == 0) {
+        fec_init();
+        return join_push(argv[1], atoi(argv[2]), argc == 5 ? argv[4] : NULL) == 0 ? 0 : 1;
+    }
 
     // Check command-line arguments
-    if (argc < 2 || argc > 3) {
-        fprintf(stderr, "Usage: %s <server_ip> [port]\n", argv[0]);
+    if (argc < 2 || argc > 4 || (argc == 4 && strcmp(argv[3], "bulk") != 0)) {
+        fprintf(stderr, "Usage: %s <server_ip> [port] [bulk]\n       %s <group> <port> join [interface]\n", argv[0], argv[0]);
         exit(1);
     }
 
     // Decodes the server IP and port
     char *server_ip = argv[1];
-    port = (argc == 3) ? atoi(argv[2]) : DEFAULT_PORT;
+    port = (argc >= 3) ? atoi(argv[2]) : DEFAULT_PORT;
 
-    // Create UDP socket
-    if ((sd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) { // AF_INET -> IPv4 / SOCK_DGRAM -> UDP (User Datagram Protocal) / Protocal
-        perror("Can't create socket");
+    // Set up the server address structure
+    bzero((char *)&hints, sizeof(hints)); // Zeroed hints mean no special flags
+    hints.ai_family = AF_UNSPEC; // IPv6 or IPv4, whichever the server address is
+    hints.ai_socktype = SOCK_DGRAM; // UDP
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(server_ip, service, &hints, &res) != 0) { // Converts the given server name or IPv4/IPv6 address to binary
+        fprintf(stderr, "Invalid server IP address\n");
         exit(1);
     }
+    memcpy(&server, res->ai_addr, res->ai_addrlen); // Uses the first address found
+    server_len = res->ai_addrlen;
+    freeaddrinfo(res);
 
-    // Set up the server address structure
-    bzero((char *)&server, sizeof(server)); // Creates a server address structure initialized to 0
-    server.sin_family = AF_INET; // IPv4
-    server.sin_port = htons(port);  // Converts the port number to a network byte
-    if (inet_pton(AF_INET, server_ip, &server.sin_addr) <= 0) { // Converts the given server IP Address from text to binary AF_INET -> IPv4 / IP in text / Binary destination
-        fprintf(stderr, "Invalid server IP address\n");
+    // Create UDP socket
+    if ((sd = socket(server.ss_family, SOCK_DGRAM, 0)) == -1) { // Socket of the server's family / SOCK_DGRAM -> UDP (User Datagram Protocal) / Protocal
+        perror("Can't create socket");
         exit(1);
     }
 
@@ -65,36 +420,72 @@ int main(int argc, char *argv[]) {
     printf("Enter the filename to request from the server: ");
     fgets(spdu.data, sizeof(spdu.data), stdin);
     spdu.data[strlen(spdu.data) - 1] = '\0';  // Remove newline
-    spdu.type = 'C';
+    spdu.type = bulk ? 'B' : 'C';
     strncpy(filename, spdu.data, sizeof(filename) - 1);
 
+    if (bulk) {
+        struct timeval timeout = { BULK_TIMEOUT_SEC, 0 };
+        int on = 1, rcvbuf = 8 << 20;
+        socklen_t optlen = sizeof(rcvbuf);
+        // Ask for coalesced receives before data arrives; older kernels refuse and we read one segment at a time
+        if (setsockopt(sd, SOL_UDP, UDP_GRO, &on, sizeof(on)) == -1) {
+            printf("UDP receive offload unavailable, reading segments one by one\n");
+        }
+        setsockopt(sd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)); // Segments come in 60 KB bursts
+        getsockopt(sd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &optlen); // What we got; the kernel counts its overhead in it too
+        window = rcvbuf / 4 / BULK_SEGMENT_SIZE;
+        setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)); // Lost F PDU or dead server
+    }
+
     // Send filename PDU to the server
     sendto(sd, &spdu, sizeof(spdu), 0, (struct sockaddr *)&server, server_len);
 
-    // Open local file to save data
-    file = fopen(spdu.data, "wb"); // wb -> write binary
-    if (file == NULL) {
+    // Open local file to save data, under a temporary name so a partial download never has the real one
+    snprintf(temp, sizeof(temp), "%s.part", filename);
+    fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    pending = malloc(WRITE_BUFFER_SIZE);
+    if (fd == -1 || pending == NULL) {
         perror("Error opening file");
         close(sd);
         exit(1);
     }
 
-    // Receive file data
-    // Socket Descriptor / Buffer to store recived data / flags / source address object / source address object size
-    while ((n = recvfrom(sd, &spdu, sizeof(spdu), 0, (struct sockaddr *)&server, &server_len)) > 0) { 
-        if (spdu.type == 'E') {
-            remove(filename); // Delete the newly created file if there is an error
-            printf("Error: %s\n", spdu.data);
-            break;
-        } else if (spdu.type == 'D') {
-            fwrite(spdu.data, sizeof(char), n - 1, file); // Writes the recieved data to the file
-        } else if (spdu.type == 'F') {
-            printf("File transfer complete.\n"); // Stops the program once done
-            break;
+    if (bulk) {
+        complete = receive_bulk(sd, &server, server_len, window, fd) == 0;
+    } else {
+        // Receive file data
+        // Socket Descriptor / Buffer to store recived data / flags / source address object / source address object size
+        while ((n = recvfrom(sd, &spdu, sizeof(spdu), 0, (struct sockaddr *)&server, &server_len)) > 0) {
+            if (spdu.type == 'E') {
+                printf("Error: %s\n", spdu.data);
+                break;
+            } else if (spdu.type == 'D') {
+                // Gathers the data and writes it in large pieces rather than one small write per PDU
+                memcpy(pending + used, spdu.data, n - 1);
+                used += n - 1;
+                if (used > WRITE_BUFFER_SIZE - sizeof(spdu.data)) {
+                    if (pwrite(fd, pending, used, offset) != (ssize_t)used) {
+                        perror("Error writing file");
+                        break;
+                    }
+                    offset += used;
+                    used = 0;
+                }
+            } else if (spdu.type == 'F') {
+                // Writes what is left; the download is done
+                complete = used == 0 || pwrite(fd, pending, used, offset) == (ssize_t)used;
+                break;
+            }
         }
     }
 
-    fclose(file);
+    // Moves the finished file into place, or deletes it if the download failed
+    if (close(fd) == -1 || !complete || rename(temp, filename) == -1) {
+        unlink(temp);
+    } else {
+        printf("File transfer complete.\n"); // Stops the program once done
+    }
+    free(pending);
     close(sd);
     return 0;
 }
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE           /* sendmmsg() */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,15 +7,32 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netinet/udp.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <netdb.h>
+#include <net/if.h>
+#include <stdint.h>
+#include "fec.h"
 
 #define DEFAULT_PORT 15000    /* Default server port */
 #define BUFLEN 100            /* Buffer length for file data chunks */
 
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103       /* Older headers lack the GSO option */
+#endif
+
 /*
     Protocol Data Units (PDUs) Data Structure
     Types:
         - C -> Filename
+        - B -> Filename, bulk mode
         - D -> Data
+        - S -> Bulk data segment
+        - K -> Bulk mode acknowledgement
         - F -> Final
         - E -> Error
 
@@ -25,69 +43,573 @@ struct pdu {
     char data[100];
 };
 
+#define MAX_SESSIONS 64        /* Downloads served at the same time */
+#define SEND_BURST 8           /* PDUs (bulk mode: buffers) sent for one session before moving on to the next */
+
 /*
-    sd -> Socket Descriptor
-    client -> Client Address information
+    Bulk mode
+    A client asking with a B PDU gets the file in S segments instead of D PDUs:
+    type 'S', a 4-byte big-endian sequence number, then up to BULK_PAYLOAD bytes
+    of the file, which belong at offset sequence * BULK_PAYLOAD. Segments fit a
+    1500-byte MTU with IPv6 headers. The F PDU that ends the file carries the
+    number of segments sent (4 bytes, big endian) so the client can tell if any
+    were lost. The server hands the kernel BULK_SEGMENTS segments in one send
+    with UDP_SEGMENT (GSO), and the kernel splits them, so one system call
+    covers 60 KB instead of 100 bytes. Kernels without GSO get the same
+    segments through one sendmmsg() call.
+
+    So a fast server can't overrun the client's receive buffer, the client
+    sends K PDUs: segments received so far and the window, how many segments
+    it can buffer (4 bytes each, big endian). The server keeps at most a
+    window of segments beyond what the client has acknowledged, starting with
+    BULK_INITIAL_WINDOW until the first K arrives. A session that waits
+    longer than BULK_STALL_MS for a K assumes it was lost and carries on.
+*/
+#define BULK_SEGMENT_SIZE 1400                        /* Bytes per segment on the wire */
+#define BULK_HEADER 5                                 /* Type and sequence number */
+#define BULK_PAYLOAD (BULK_SEGMENT_SIZE - BULK_HEADER) /* File bytes per segment */
+#define BULK_SEGMENTS 44                              /* Segments per send, within the 64 KB datagram limit */
+#define BULK_INITIAL_WINDOW 128                       /* Segments in flight before the client's first K PDU */
+#define BULK_STALL_MS 100                             /* Wait for a K PDU this long before sending on anyway */
+
+int gso_supported = 1; // Cleared the first time the kernel refuses UDP_SEGMENT
+
+/*
+    Multicast push mode
+    file_download_udp_server push <group> <port> <file> [interface] [rounds]
+    streams one file to a multicast group instead of serving requests. The file
+    is cut into blocks of MCAST_K symbols of MCAST_SYMBOL_SIZE bytes, and each
+    block gets MCAST_R Reed-Solomon repair symbols (see fec.h), so a receiver
+    that loses up to MCAST_R of a block's packets rebuilds it on its own.
+    Packets (numbers big endian):
+        - A -> Announce: session (4), file size (8), symbol size (2), k (1), r (1), filename
+        - M -> Symbol: session (4), block (4), index in block (1), symbol; data symbols first, then repair
+        - F -> End of a round: session (4), rounds still to come (1)
+    The announcement repeats for MCAST_LEAD_IN_MS before the data so receivers
+    can join, and every MCAST_ANNOUNCE_EVERY blocks for late joiners. Sending
+    is paced to MCAST_RATE_MBIT, since nobody acknowledges anything. Later
+    rounds repeat the whole file for receivers that lost too much.
+*/
+#define MCAST_SYMBOL_SIZE 1024       /* File bytes per packet, within a 1500-byte MTU */
+#define MCAST_HEADER 10              /* Type, session, block, index */
+#define MCAST_K 32                   /* Data symbols per block */
+#define MCAST_R 8                    /* Repair symbols per block */
+#define MCAST_LEAD_IN_MS 1000        /* Announcing before the data starts */
+#define MCAST_ANNOUNCE_EVERY 64      /* Blocks between repeated announcements */
+#define MCAST_RATE_MBIT 200          /* Sending rate */
+
+/*
+    One client's download in progress
+    active -> Whether this slot holds a download
+    client -> Address the request came from, which also identifies the session
     client_len -> The length of the Client Address information object
+    file -> The file being sent
+    pending -> A PDU read from the file but not sent yet because the socket was full
+    pending_len -> Bytes of pending to send, 0 if there is none
+    bulk -> Whether the client asked for bulk mode
+    seq -> Next bulk segment number
+    acked -> Segments the client has acknowledged
+    window -> Segments the client can take beyond acked
+    stalled_ms -> When the session ran out of window, 0 if it hasn't
 */
-void handle_client(int sd, struct sockaddr_in *client, socklen_t client_len) {
-    struct pdu spdu; // Variables needed for the file transfer
-    char buffer[BUFLEN];
-    int n;
+struct session {
+    int active;
+    struct sockaddr_in6 client;
+    socklen_t client_len;
+    FILE *file;
+    struct pdu pending;
+    int pending_len;
+    int bulk;
+    uint32_t seq;
+    uint32_t acked;
+    uint32_t window;
+    long long stalled_ms;
+};
+
+struct session sessions[MAX_SESSIONS]; // Session table, looked up by client address
+int active_sessions = 0;               // Number of slots in use
+
+/*
+    Returns a monotonic clock in milliseconds
+*/
+long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+    Finds the session of a client, or a free slot for a new one
+    client -> Client Address information
+    Returns the session, a free slot (active == 0) if the client has none, or NULL if the table is full
+*/
+struct session *find_session(const struct sockaddr_in6 *client) {
+    struct session *free_slot = NULL;
+    int i;
+
+    for (i = 0; i < MAX_SESSIONS; i++) {
+        if (sessions[i].active) {
+            if (memcmp(&sessions[i].client.sin6_addr, &client->sin6_addr, sizeof(client->sin6_addr)) == 0 &&
+                sessions[i].client.sin6_port == client->sin6_port) {
+                return &sessions[i];
+            }
+        } else if (free_slot == NULL) {
+            free_slot = &sessions[i];
+        }
+    }
+    return free_slot;
+}
+
+/*
+    Ends a session and frees its slot
+    s -> The session
+*/
+void end_session(struct session *s) {
+    fclose(s->file);
+    s->active = 0;
+    active_sessions--;
+}
+
+/*
+    Takes the next datagram as a filename and starts a session sending that file
+    sd -> Socket Descriptor
+    Returns 0 if a datagram was handled, -1 once there are none waiting
+*/
+int handle_request(int sd) {
+    struct pdu spdu;
+    struct sockaddr_in6 client;
+    socklen_t client_len = sizeof(client);
+    struct session *s;
     FILE *file;
+    int n;
 
-    // Receive the filename (1st PDU) from the client
-    n = recvfrom(sd, &spdu, sizeof(spdu), 0, (struct sockaddr *)client, &client_len); // Socket Descriptor / Buffer to store recived data / flags / source address object / source address object size
+    // Receive the filename (1st PDU) from a client, without waiting if nothing has arrived
+    n = recvfrom(sd, &spdu, sizeof(spdu), 0, (struct sockaddr *)&client, &client_len); // Socket Descriptor / Buffer to store recived data / flags / source address object / source address object size
+    if (n >= 9 && spdu.type == 'K') {
+        // A bulk client reporting progress opens the window again
+        uint32_t acked, window;
+        s = find_session(&client);
+        if (s != NULL && s->active && s->bulk) {
+            memcpy(&acked, spdu.data, sizeof(acked));
+            memcpy(&window, spdu.data + 4, sizeof(window));
+            acked = ntohl(acked);
+            if (acked - s->acked < 0x80000000u) { // Ignore acknowledgements that arrive out of order
+                s->acked = acked;
+            }
+            s->window = ntohl(window) > 0 ? ntohl(window) : 1;
+            s->stalled_ms = 0;
+        }
+        return 0;
+    }
+    if (n > 0 && spdu.type != 'C' && spdu.type != 'B') {
+        return 0; // Only filename PDUs start a download
+    }
     if (n < 0) {
-        perror("Error receiving filename");
-        return;
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            perror("Error receiving filename");
+        }
+        return errno == EINTR ? 0 : -1;
+    }
+    if (n < 2) {
+        return 0; // Too short to hold a filename
     }
 
-    spdu.data[n - 1] = '\0';  // Null-terminate the string
+    spdu.data[n - 1 < (int)sizeof(spdu.data) ? n - 1 : (int)sizeof(spdu.data) - 1] = '\0';  // Null-terminate the string
     printf("Requested file: %s\n", spdu.data);
 
+    // A client asking again restarts its download; anyone else needs a free slot
+    s = find_session(&client);
+    if (s != NULL && s->active) {
+        end_session(s);
+    }
+    if (s == NULL) {
+        spdu.type = 'E';
+        snprintf(spdu.data, sizeof(spdu.data), "Server busy, try again later.");
+        printf("Error: %s\n", spdu.data);
+        sendto(sd, &spdu, sizeof(spdu), 0, (struct sockaddr *)&client, client_len);
+        return 0;
+    }
+
     // Open the file, send an error PDU if it can't be opened
     file = fopen(spdu.data, "rb"); // rb -> read bunary
     if (file == NULL) {
         spdu.type = 'E';
         snprintf(spdu.data, sizeof(spdu.data), "File not found or cannot be opened."); // Set the spdu data to the error message
         printf("Error: %s\n", spdu.data); // Log the error to the server console
-        sendto(sd, &spdu, sizeof(spdu), 0, (struct sockaddr *)client, client_len); // Send the pdu to the client and exit the process
-        return;
+        sendto(sd, &spdu, sizeof(spdu), 0, (struct sockaddr *)&client, client_len); // Send the pdu to the client and forget the request
+        return 0;
     }
 
-    // Send the file contents to the client in chunks with PDUs of type D
-    spdu.type = 'D';
-    while ((n = fread(spdu.data, sizeof(char), sizeof(spdu.data), file)) > 0) { // output data buffer / size of elements to be read (char)/ number of elements to read / file to read 
-        sendto(sd, &spdu, n + 1, 0, (struct sockaddr *)client, client_len);
-        // Socket Descriptor / data to be sent / number of bytes to send / for specail flags (none slected) / client address information / size of the address information
+    // The event loop sends the file from here on, interleaved with the other sessions
+    s->active = 1;
+    s->client = client;
+    s->client_len = client_len;
+    s->file = file;
+    s->pending_len = 0;
+    s->bulk = spdu.type == 'B';
+    s->seq = 0;
+    s->acked = 0;
+    s->window = BULK_INITIAL_WINDOW;
+    s->stalled_ms = 0;
+    active_sessions++;
+    return 0;
+}
+
+/*
+    Sends the next buffer of bulk segments of a session, as one GSO send if the kernel allows
+    sd -> Socket Descriptor
+    s -> The session
+    Returns 1 if segments were sent, 0 at the end of the file, -1 if the socket is full
+*/
+int send_bulk(int sd, struct session *s) {
+    static char buffer[BULK_SEGMENTS * BULK_SEGMENT_SIZE]; // Segments laid out back to back
+    struct iovec iov[BULK_SEGMENTS];
+    struct mmsghdr msgs[BULK_SEGMENTS];
+    int count, len = 0, sent;
+    long start = ftell(s->file);
+
+    // Fill the buffer with full segments; only the last one may be short, as GSO requires
+    for (count = 0; count < BULK_SEGMENTS; count++) {
+        char *segment = buffer + count * BULK_SEGMENT_SIZE;
+        uint32_t seq = htonl(s->seq + count);
+        int n = fread(segment + BULK_HEADER, sizeof(char), BULK_PAYLOAD, s->file);
+        if (n <= 0) {
+            break;
+        }
+        segment[0] = 'S';
+        memcpy(segment + 1, &seq, sizeof(seq));
+        iov[count].iov_base = segment;
+        iov[count].iov_len = BULK_HEADER + n;
+        len = count * BULK_SEGMENT_SIZE + BULK_HEADER + n;
+        if (n < BULK_PAYLOAD) {
+            count++;
+            break;
+        }
+    }
+    if (count == 0) {
+        return 0;
     }
 
-    // Send final PDU
-    spdu.type = 'F';
-    sendto(sd, &spdu, 1, 0, (struct sockaddr *)client, client_len);
+    if (gso_supported) {
+        // One datagram for the kernel to cut into BULK_SEGMENT_SIZE pieces
+        char control[CMSG_SPACE(sizeof(uint16_t))];
+        struct iovec whole = { buffer, len };
+        struct msghdr msg;
+        struct cmsghdr *cm;
+        uint16_t segment_size = BULK_SEGMENT_SIZE;
+
+        memset(&msg, 0, sizeof(msg));
+        memset(control, 0, sizeof(control));
+        msg.msg_name = &s->client;
+        msg.msg_namelen = s->client_len;
+        msg.msg_iov = &whole;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        memcpy(CMSG_DATA(cm), &segment_size, sizeof(segment_size));
+        if (sendmsg(sd, &msg, 0) >= 0) {
+            s->seq += count;
+            return 1;
+        }
+        if (errno != EINVAL && errno != EOPNOTSUPP && errno != ENOPROTOOPT && errno != EIO) {
+            int err = errno;
+            fseek(s->file, start, SEEK_SET); // Read the same data again next time
+            if (err == EAGAIN || err == EWOULDBLOCK || err == ENOBUFS) {
+                return -1;
+            }
+            fprintf(stderr, "Error sending file data: %s\n", strerror(err));
+            return 0; // Give up; the segment count in the F PDU tells the client
+        }
+        printf("UDP segmentation offload unavailable (%s), sending segments one by one\n", strerror(errno));
+        gso_supported = 0;
+    }
+
+    // No GSO: still one system call, one datagram per segment
+    memset(msgs, 0, sizeof(msgs));
+    for (sent = 0; sent < count; sent++) {
+        msgs[sent].msg_hdr.msg_name = &s->client;
+        msgs[sent].msg_hdr.msg_namelen = s->client_len;
+        msgs[sent].msg_hdr.msg_iov = &iov[sent];
+        msgs[sent].msg_hdr.msg_iovlen = 1;
+    }
+    sent = sendmmsg(sd, msgs, count, 0);
+    if (sent <= 0) {
+        int err = errno;
+        fseek(s->file, start, SEEK_SET);
+        if (err == EAGAIN || err == EWOULDBLOCK || err == ENOBUFS) {
+            return -1;
+        }
+        fprintf(stderr, "Error sending file data: %s\n", strerror(err));
+        return 0;
+    }
+    if (sent < count) {
+        fseek(s->file, start + (long)sent * BULK_PAYLOAD, SEEK_SET); // Resume after the last segment that went out
+    }
+    s->seq += sent;
+    return 1;
+}
+
+/*
+    Sends the next few PDUs of a session: file contents in D PDUs, then the F PDU
+    sd -> Socket Descriptor
+    s -> The session
+    Returns 0 if the session can take more, 1 if it waits for the client to acknowledge, -1 if the socket is full and sending should wait
+*/
+int send_burst(int sd, struct session *s) {
+    int i;
+
+    for (i = 0; i < SEND_BURST && s->active; i++) {
+        // Bulk sessions send their segments, then the F PDU with the segment count
+        if (s->bulk && s->pending_len == 0) {
+            int sent;
+            if (s->seq - s->acked >= s->window) {
+                if (s->stalled_ms == 0) {
+                    s->stalled_ms = now_ms();
+                } else if (now_ms() - s->stalled_ms >= BULK_STALL_MS) {
+                    s->acked = s->seq; // The K PDU was probably lost
+                    s->stalled_ms = 0;
+                    continue;
+                }
+                return 1;
+            }
+            sent = send_bulk(sd, s);
+            uint32_t total = htonl(s->seq);
+            if (sent != 0) {
+                if (sent == -1) {
+                    return -1;
+                }
+                continue;
+            }
+            s->pending.type = 'F';
+            memcpy(s->pending.data, &total, sizeof(total));
+            s->pending_len = 1 + sizeof(total);
+        }
+        // Read the next chunk unless one is still waiting from last time
+        if (s->pending_len == 0) {
+            int n = fread(s->pending.data, sizeof(char), sizeof(s->pending.data), s->file); // output data buffer / size of elements to be read (char)/ number of elements to read / file to read
+            s->pending.type = n > 0 ? 'D' : 'F';
+            s->pending_len = n + 1;
+        }
+        if (sendto(sd, &s->pending, s->pending_len, 0, (struct sockaddr *)&s->client, s->client_len) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+                return -1; // Keep the chunk and try again once the socket drains
+            }
+            perror("Error sending file data");
+            end_session(s);
+            return 0;
+        }
+        // Final PDU sent, the download is done
+        if (s->pending.type == 'F') {
+            end_session(s);
+        }
+        s->pending_len = 0;
+    }
+    return 0;
+}
+
+/*
+    Sleeps until a given time on the monotonic clock
+    target_ns -> Time to wake up, in nanoseconds
+*/
+void sleep_until(long long target_ns) {
+    struct timespec ts;
+    ts.tv_sec = target_ns / 1000000000LL;
+    ts.tv_nsec = target_ns % 1000000000LL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+        // Interrupted, keep sleeping
+    }
+}
+
+/*
+    Streams a file to a multicast group, see "Multicast push mode" above
+    group -> Multicast group address, IPv4 or IPv6
+    port -> UDP port of the group
+    filename -> File to push
+    interface -> Network interface to send on, NULL for the default route
+    rounds -> Times to send the whole file
+    Returns 0 on success, -1 on error
+*/
+int push_file(const char *group, int port, const char *filename, const char *interface, int rounds) {
+    struct addrinfo hints, *res;
+    char service[16];
+    struct sockaddr_storage dest;
+    socklen_t dest_len;
+    unsigned char packets[MCAST_K + MCAST_R][MCAST_HEADER + MCAST_SYMBOL_SIZE]; // One block, ready to send
+    unsigned char *data[MCAST_K], *repair[MCAST_R];
+    unsigned char announce[1 + 4 + 8 + 2 + 1 + 1 + BUFLEN];
+    unsigned char end[6];
+    const char *base = strrchr(filename, '/');
+    unsigned int ifindex = interface ? if_nametoindex(interface) : 0;
+    int sd, ttl = 1, i, round, announce_len;
+    uint32_t session, blocks, block, value;
+    long long file_size, start_ns, sent_bytes = 0;
+    struct timespec now;
+    FILE *file;
+
+    if (interface != NULL && ifindex == 0) {
+        fprintf(stderr, "Unknown interface %s\n", interface);
+        return -1;
+    }
+    file = fopen(filename, "rb"); // rb -> read binary
+    if (file == NULL) {
+        perror("Can't open file");
+        return -1;
+    }
+    fseek(file, 0, SEEK_END);
+    file_size = ftell(file);
+    blocks = (file_size + (long long)MCAST_K * MCAST_SYMBOL_SIZE - 1) / ((long long)MCAST_K * MCAST_SYMBOL_SIZE);
+
+    // Resolve the group; its family decides which multicast options apply
+    bzero((char *)&hints, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(group, service, &hints, &res) != 0) {
+        fprintf(stderr, "Invalid multicast group %s\n", group);
+        fclose(file);
+        return -1;
+    }
+    memcpy(&dest, res->ai_addr, res->ai_addrlen);
+    dest_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    if ((sd = socket(dest.ss_family, SOCK_DGRAM, 0)) == -1) {
+        perror("Can't create socket");
+        fclose(file);
+        return -1;
+    }
+    if (dest.ss_family == AF_INET6) {
+        if (((struct sockaddr_in6 *)&dest)->sin6_scope_id == 0) {
+            ((struct sockaddr_in6 *)&dest)->sin6_scope_id = ifindex; // Link-local groups need to know the interface
+        }
+        setsockopt(sd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &ttl, sizeof(ttl)); // Stay on the local network
+        if (ifindex != 0) {
+            setsockopt(sd, IPPROTO_IPV6, IPV6_MULTICAST_IF, &ifindex, sizeof(ifindex));
+        }
+    } else {
+        struct ip_mreqn mreq;
+        setsockopt(sd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+        if (ifindex != 0) {
+            bzero((char *)&mreq, sizeof(mreq));
+            mreq.imr_ifindex = ifindex;
+            setsockopt(sd, IPPROTO_IP, IP_MULTICAST_IF, &mreq, sizeof(mreq));
+        }
+    }
+
+    // A random session number keeps receivers from mixing packets of different pushes
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    srand(now.tv_nsec ^ getpid());
+    session = htonl(((uint32_t)rand() << 16) ^ (uint32_t)rand());
+
+    announce[0] = 'A';
+    memcpy(announce + 1, &session, 4);
+    value = htonl((uint32_t)(file_size >> 32));
+    memcpy(announce + 5, &value, 4);
+    value = htonl((uint32_t)file_size);
+    memcpy(announce + 9, &value, 4);
+    announce[13] = MCAST_SYMBOL_SIZE >> 8;
+    announce[14] = MCAST_SYMBOL_SIZE & 0xff;
+    announce[15] = MCAST_K;
+    announce[16] = MCAST_R;
+    snprintf((char *)announce + 17, BUFLEN, "%s", base ? base + 1 : filename); // Receivers save it under its own name
+    announce_len = 17 + strlen((char *)announce + 17) + 1;
+
+    printf("Pushing %s (%lld bytes, %u blocks of %d+%d symbols) to %s port %d\n", filename, file_size, blocks, MCAST_K,
+           MCAST_R, group, port);
+    for (i = 0; i < MCAST_LEAD_IN_MS / 100; i++) {
+        sendto(sd, announce, announce_len, 0, (struct sockaddr *)&dest, dest_len);
+        usleep(100000);
+    }
+
+    for (i = 0; i < MCAST_K; i++) {
+        data[i] = packets[i] + MCAST_HEADER;
+    }
+    for (i = 0; i < MCAST_R; i++) {
+        repair[i] = packets[MCAST_K + i] + MCAST_HEADER;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    start_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+    for (round = rounds - 1; round >= 0; round--) {
+        fseek(file, 0, SEEK_SET);
+        for (block = 0; block < blocks; block++) {
+            // Read a block, zero-padding the end of the file, and compute its repair symbols
+            for (i = 0; i < MCAST_K; i++) {
+                size_t n = fread(data[i], 1, MCAST_SYMBOL_SIZE, file);
+                memset(data[i] + n, 0, MCAST_SYMBOL_SIZE - n);
+            }
+            fec_encode(data, MCAST_K, repair, MCAST_R, MCAST_SYMBOL_SIZE);
+
+            if (block % MCAST_ANNOUNCE_EVERY == 0) {
+                sendto(sd, announce, announce_len, 0, (struct sockaddr *)&dest, dest_len);
+            }
+            for (i = 0; i < MCAST_K + MCAST_R; i++) {
+                value = htonl(block);
+                packets[i][0] = 'M';
+                memcpy(packets[i] + 1, &session, 4);
+                memcpy(packets[i] + 5, &value, 4);
+                packets[i][9] = i;
+                if (sendto(sd, packets[i], sizeof(packets[i]), 0, (struct sockaddr *)&dest, dest_len) < 0 && errno != ENOBUFS) {
+                    perror("Error sending to group");
+                    fclose(file);
+                    close(sd);
+                    return -1;
+                }
+            }
+
+            // Hold the rate: wait until the bytes sent so far are due
+            sent_bytes += (long long)(MCAST_K + MCAST_R) * sizeof(packets[0]);
+            sleep_until(start_ns + sent_bytes * 8 * 1000 / MCAST_RATE_MBIT);
+        }
+        end[0] = 'F';
+        memcpy(end + 1, &session, 4);
+        end[5] = round;
+        for (i = 0; i < 3; i++) {
+            sendto(sd, end, sizeof(end), 0, (struct sockaddr *)&dest, dest_len); // Repeated in case one is lost
+        }
+    }
+    printf("Push complete.\n");
     fclose(file);
+    close(sd);
+    return 0;
 }
 
 int main(int argc, char *argv[]) {
     int sd, port;
-    struct sockaddr_in server, client; // address information about the server and client
-    socklen_t client_len = sizeof(client); // Gets the size of the client address information to send to the handle_client method
+    int off = 0; // IPV6_V6ONLY off, so the one socket serves IPv4 and IPv6 clients
+    struct sockaddr_in6 server; // address information about the server
+    struct pollfd pfd; // What the event loop waits for on the socket
+    int next = 0; // Session the next sending round starts with, so every session gets its turn first
+    int waiting = 0; // Sessions that ran out of window in the last round
+
+    // Multicast push mode streams one file and exits
+    if (argc >= 5 && strcmp(argv[1], "push") == 0) {
+        fec_init();
+        return push_file(argv[2], atoi(argv[3]), argv[4], argc > 5 ? argv[5] : NULL, argc > 6 ? atoi(argv[6]) : 1) == 0 ? 0 : 1;
+    }
+    if (argc > 2) {
+        fprintf(stderr, "Usage: %s [port]\n       %s push <group> <port> <file> [interface] [rounds]\n", argv[0], argv[0]);
+        exit(1);
+    }
 
     // Determine the port from command-line arguments or use default
     port = (argc == 2) ? atoi(argv[1]) : DEFAULT_PORT;
 
     // Create a UDP socket
-    if ((sd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) { // AF_INET -> IPv4 / SOCK_DGRAM -> UDP (User Datagram Protocal) / Protocal
+    if ((sd = socket(AF_INET6, SOCK_DGRAM, 0)) == -1) { // AF_INET6 -> IPv6 / SOCK_DGRAM -> UDP (User Datagram Protocal) / Protocal
         perror("Can't create socket");
         exit(1);
     }
+    setsockopt(sd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)); // IPv4 clients arrive as IPv4-mapped addresses (::ffff:a.b.c.d)
+    fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) | O_NONBLOCK); // Never block on one client while others wait
 
     // Set up the server address structure
     bzero((char *)&server, sizeof(server)); // Creates a server address structure initialized to 0
-    server.sin_family = AF_INET; // IPv4
-    server.sin_port = htons(port); // Converts the port number to a network byte
-    server.sin_addr.s_addr = htonl(INADDR_ANY); // Allows the server to accept connections on any of its IP addresses
+    server.sin6_family = AF_INET6; // IPv6, which with V6ONLY off covers IPv4 too
+    server.sin6_port = htons(port); // Converts the port number to a network byte
+    server.sin6_addr = in6addr_any; // Allows the server to accept connections on any of its IP addresses
 
     // Bind the socket to the address
     if (bind(sd, (struct sockaddr *)&server, sizeof(server)) == -1) { // socket descriptor / server address information / size of server address information
@@ -97,9 +619,36 @@ int main(int argc, char *argv[]) {
 
     printf("Server listening on port %d\n", port); // Log port used for debugging
 
-    // Main loop to handle client requests
+    // Event loop: take new requests, then send each active session a burst in turn
+    pfd.fd = sd;
     while (1) {
-        handle_client(sd, &client, client_len);
+        int i, full = 0, result;
+
+        // Wait for requests, and for room to send while downloads that aren't waiting for a K PDU are in progress
+        pfd.events = POLLIN | (active_sessions > waiting ? POLLOUT : 0);
+        if (poll(&pfd, 1, active_sessions > 0 ? BULK_STALL_MS : -1) < 0) {
+            if (errno != EINTR) {
+                perror("poll");
+            }
+            continue;
+        }
+
+        if (pfd.revents & POLLIN) {
+            while (handle_request(sd) == 0) {
+                // Drain every waiting request before sending more data
+            }
+        }
+
+        waiting = 0;
+        for (i = 0; i < MAX_SESSIONS && !full && active_sessions > 0; i++) {
+            struct session *s = &sessions[(next + i) % MAX_SESSIONS];
+            if (s->active) {
+                result = send_burst(sd, s);
+                full = result == -1;
+                waiting += result == 1;
+            }
+        }
+        next = (next + 1) % MAX_SESSIONS;
     }
 
     close(sd);
@@ -12,10 +12,14 @@
 #include <arpa/inet.h>
                                                                                 
 #include <netdb.h>
+#include <stdint.h>
+#include <endian.h>
+#include <time.h>
 
 #define	BUFSIZE 64
 
 #define	MSG		"what time is it?\n"
+#define	BINARY_MSG	"B"	/* asks the server for a 64-bit timestamp	*/
 
 
 /*------------------------------------------------------------------------
@@ -28,14 +32,19 @@ main(int argc, char *argv[])
 	char	*host = "localhost";	/* host to use if none supplied	*/
 	char	*service = "3000";
 	char	now[100];		/* 32-bit integer to hold time	*/ 
-	struct hostent	*phe;	/* pointer to host information entry	*/
-	struct sockaddr_in sin;	/* an Internet endpoint address		*/
+	struct addrinfo	hints, *res, *ai;	/* lookup hints and results	*/
 	int	s, n, type;	/* socket descriptor and socket type	*/
+	int	binary = 0;	/* request the binary reply format	*/
+	uint64_t stamp;		/* binary reply, seconds since epoch	*/
+	time_t	secs;
 
 	switch (argc) {
 	case 1:
 		host = "localhost";
 		break;
+	case 4:
+		binary = (strcmp(argv[3], "binary") == 0);
+		/* FALL THROUGH */
 	case 3:
 		service = argv[2];
 		/* FALL THROUGH */
@@ -43,40 +52,51 @@ main(int argc, char *argv[])
 		host = argv[1];
 		break;
 	default:
-		fprintf(stderr, "usage: UDPtime [host [port]]\n");
+		fprintf(stderr, "usage: UDPtime [host [port [binary]]]\n");
 		exit(1);
 	}
 
-	memset(&sin, 0, sizeof(sin));
-        sin.sin_family = AF_INET;
-                                                                                
-    /* Map service name to port number */
-        sin.sin_port = htons((u_short)atoi(service));
+	memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;	/* IPv6 or IPv4			*/
+        hints.ai_socktype = SOCK_DGRAM;
                                                                                 
-        if ( phe = gethostbyname(host) ){
-                memcpy(&sin.sin_addr, phe->h_addr, phe->h_length);
-                }
-        else if ( (sin.sin_addr.s_addr = inet_addr(host)) == INADDR_NONE ){
+    /* Map host and service to addresses of either family */
+        if (getaddrinfo(host, service, &hints, &res) != 0) {
 		fprintf(stderr, "Can't get host entry \n");
 		exit(1);
 	}
                                                                                 
-                                                                                
-    /* Allocate a socket */
-        s = socket(PF_INET, SOCK_DGRAM, 0);
-        if (s < 0){
-		fprintf(stderr, "Can't create socket \n");
-		exit(1);
+    /* Allocate a socket and connect it to the first usable address */
+        s = -1;
+        for (ai = res; ai != NULL; ai = ai->ai_next) {
+		if ((s = socket(ai->ai_family, SOCK_DGRAM, 0)) < 0)
+			continue;
+		if (connect(s, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(s);
+		s = -1;
 	}
-	
-                                                                                
-    /* Connect the socket */
-        if (connect(s, (struct sockaddr *)&sin, sizeof(sin)) < 0){
+	freeaddrinfo(res);
+        if (s < 0){
 		fprintf(stderr, "Can't connect to %s %s \n", host, service);
 		exit(1);
 	}
 
 
+	if (binary) {
+		(void) write(s, BINARY_MSG, strlen(BINARY_MSG));
+
+		/* Read the 64-bit timestamp and format it locally */
+		n = read(s, (char *)&stamp, sizeof(stamp));
+		if (n != sizeof(stamp)) {
+			fprintf(stderr, "Read failed\n");
+			exit(1);
+		}
+		secs = (time_t)be64toh(stamp);
+		printf("%s", ctime(&secs));
+		exit(0);
+	}
+
 	(void) write(s, MSG, strlen(MSG));
 
 	/* Read the time */
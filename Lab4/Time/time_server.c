@@ -1,14 +1,78 @@
 /* time_server.c - main */
 
+#define _GNU_SOURCE
+
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/timerfd.h>
 #include <netinet/in.h>
 #include <stdlib.h>
 #include <string.h>
 #include <netdb.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
 #include <time.h>
+#include <unistd.h>
+#include <endian.h>
+
+#define	VLEN		64	/* datagrams handled per recvmmsg/sendmmsg	*/
+#define	REQLEN		100	/* "input" buffer; any size > 0		*/
+#define	BINARY_REQ	'B'	/* request byte asking for a binary reply	*/
+
+/*
+ * Cached replies, refreshed once per second by the timer instead of
+ * calling time()/ctime() for every datagram.
+ */
+static char	text_now[32];		/* ctime() formatted time	*/
+static size_t	text_len;		/* strlen(text_now)		*/
+static uint64_t	binary_now;		/* seconds since epoch, big endian */
+
+/*------------------------------------------------------------------------
+ * refresh_time - rebuild the cached text and binary replies
+ *------------------------------------------------------------------------
+ */
+static void
+refresh_time(void)
+{
+	time_t	now;			/* current time			*/
+	struct tm tm;
 
+	(void) time(&now);
+	localtime_r(&now, &tm);
+	(void) asctime_r(&tm, text_now);
+	text_len = strlen(text_now);
+	binary_now = htobe64((uint64_t)now);
+}
+
+/*------------------------------------------------------------------------
+ * start_timer - arm a timerfd that fires on every whole second
+ *------------------------------------------------------------------------
+ */
+static int
+start_timer(void)
+{
+	struct itimerspec its;
+	struct timespec	now;
+	int	tfd;
+
+	tfd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (tfd < 0)
+		return -1;
+
+	/* Align the first expiry to the next second boundary */
+	clock_gettime(CLOCK_REALTIME, &now);
+	its.it_value.tv_sec = now.tv_sec + 1;
+	its.it_value.tv_nsec = 0;
+	its.it_interval.tv_sec = 1;
+	its.it_interval.tv_nsec = 0;
+	if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		close(tfd);
+		return -1;
+	}
+	return tfd;
+}
 
 /*------------------------------------------------------------------------
  * main - Iterative UDP server for TIME service
@@ -17,18 +81,19 @@
 int
 main(int argc, char *argv[])
 {
-	struct sockaddr_in fsin;	/* the from address of a client	*/
+	struct sockaddr_in6 fsin[VLEN];	/* the from addresses of clients */
 	char	*service = "3000";	/* service name or port number	*/
-	char	buf[100];		/* "input" buffer; any size > 0	*/
-	char    *pts;
-	int	sock,n;			/* server socket		*/
-	time_t	now;			/* current time			*/
-	int	alen;			/* from-address length		*/
-        struct sockaddr_in sin; /* an Internet endpoint address         */
-        int     s, type;        /* socket descriptor and socket type    */
-	u_short	portbase = 0;	/* port base, for non-root servers	*/
-                                                                                
-
+	char	buf[VLEN][REQLEN];	/* "input" buffers		*/
+	struct mmsghdr	rmsg[VLEN];	/* batched receive headers	*/
+	struct mmsghdr	smsg[VLEN];	/* batched reply headers	*/
+	struct iovec	riov[VLEN];
+	struct iovec	siov[VLEN];
+	struct pollfd	pfd[2];
+        struct sockaddr_in6 sin; /* an Internet endpoint address        */
+        int     s, tfd;         /* socket and timer descriptors         */
+	int	off = 0;	/* IPV6_V6ONLY off: serve IPv4 clients too */
+	int	i, n, sent;
+	uint64_t expirations;
 
 	switch (argc) {
 	case	1:
@@ -37,39 +102,98 @@ main(int argc, char *argv[])
 		service = argv[1];
 		break;
 	default:
-		fprintf(stderr, "usage: time_server [host [port]]\n");
+		fprintf(stderr, "usage: time_server [port]\n");
 
 	}
 
-                                                                                
+
         memset(&sin, 0, sizeof(sin));
-        sin.sin_family = AF_INET;
-        sin.sin_addr.s_addr = INADDR_ANY;
+        sin.sin6_family = AF_INET6;
+        sin.sin6_addr = in6addr_any;
 
    /* Map service name to port number */
-        sin.sin_port = htons((u_short)atoi(service));
-                                                                                
-    /* Allocate a socket */
-        s = socket(AF_INET, SOCK_DGRAM, 0);
+        sin.sin6_port = htons((u_short)atoi(service));
+
+    /* Allocate a dual-stack socket; IPv4 clients appear as ::ffff:a.b.c.d */
+        s = socket(AF_INET6, SOCK_DGRAM, 0);
         if (s < 0){
 		fprintf(stderr, "can't creat socket\n");
 		exit(1);
 	}
-                                                                                
+	setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+
     /* Bind the socket */
-        if (bind(s, (struct sockaddr *)&sin, sizeof(sin)) < 0)
+        if (bind(s, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
 		fprintf(stderr, "can't bind to %s port\n", service);
+		exit(1);
+	}
+
+    /* Prime the cache and arm the once-per-second refresh */
+	refresh_time();
+	if ((tfd = start_timer()) < 0) {
+		fprintf(stderr, "can't create timer\n");
+		exit(1);
+	}
+
+	memset(rmsg, 0, sizeof(rmsg));
+	for (i = 0; i < VLEN; i++) {
+		riov[i].iov_base = buf[i];
+		riov[i].iov_len = sizeof(buf[i]);
+		rmsg[i].msg_hdr.msg_iov = &riov[i];
+		rmsg[i].msg_hdr.msg_iovlen = 1;
+		rmsg[i].msg_hdr.msg_name = &fsin[i];
+	}
+
+	pfd[0].fd = s;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = tfd;
+	pfd[1].events = POLLIN;
 
 	while (1) {
-		alen = sizeof(fsin);
-		if ((n = recvfrom(s, buf, sizeof(buf), 0,
-				(struct sockaddr *)&fsin, &alen)) < 0)
-			fprintf(stderr, "recvfrom error\n");
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno != EINTR)
+				fprintf(stderr, "poll error\n");
+			continue;
+		}
+
+		if (pfd[1].revents & POLLIN) {
+			if (read(tfd, &expirations, sizeof(expirations)) > 0)
+				refresh_time();
+		}
+
+		if (!(pfd[0].revents & POLLIN))
+			continue;
 
-		(void) time(&now);
-        	pts = ctime(&now);
+		/* Drain up to VLEN queued requests in one system call */
+		for (i = 0; i < VLEN; i++)
+			rmsg[i].msg_hdr.msg_namelen = sizeof(fsin[i]);
+		n = recvmmsg(s, rmsg, VLEN, MSG_DONTWAIT, NULL);
+		if (n < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				fprintf(stderr, "recvmmsg error\n");
+			continue;
+		}
 
-		(void) sendto(s, pts, strlen(pts), 0,
-			(struct sockaddr *)&fsin, sizeof(fsin));
+		/* Answer all of them from the cache in one more call */
+		for (i = 0; i < n; i++) {
+			if (rmsg[i].msg_len >= 1 && buf[i][0] == BINARY_REQ) {
+				siov[i].iov_base = &binary_now;
+				siov[i].iov_len = sizeof(binary_now);
+			} else {
+				siov[i].iov_base = text_now;
+				siov[i].iov_len = text_len;
+			}
+			memset(&smsg[i], 0, sizeof(smsg[i]));
+			smsg[i].msg_hdr.msg_iov = &siov[i];
+			smsg[i].msg_hdr.msg_iovlen = 1;
+			smsg[i].msg_hdr.msg_name = &fsin[i];
+			smsg[i].msg_hdr.msg_namelen = rmsg[i].msg_hdr.msg_namelen;
+		}
+		for (i = 0; i < n; i += sent) {
+			if ((sent = sendmmsg(s, &smsg[i], n - i, 0)) <= 0) {
+				fprintf(stderr, "sendmmsg error\n");
+				break;
+			}
+		}
 	}
 }
@@ -0,0 +1,104 @@
+#include <string.h>
+#include "bloom.h"
+
+// Computes the filter positions of a key by double hashing one FNV-1a hash
+// Parameters:
+// - key: The filename
+// - positions: Filled with BLOOM_HASHES bit positions
+static void bloom_positions(const char *key, uint32_t *positions) {
+    uint64_t hash = 14695981039346656037ULL;
+    uint32_t h1, h2;
+    int i;
+
+    while (*key) {
+        hash = (hash ^ (unsigned char)*key++) * 1099511628211ULL;
+    }
+    h1 = (uint32_t)hash;
+    h2 = (uint32_t)(hash >> 32) | 1;  // Odd, so the probes cover the whole filter
+    for (i = 0; i < BLOOM_HASHES; i++) {
+        positions[i] = (h1 + i * h2) % BLOOM_BITS;
+    }
+}
+
+// Sets or clears one bit of the published array and stamps its chunk
+static void bloom_flip(CountingBloom *bloom, uint32_t bit, int set) {
+    uint8_t mask = 1 << (bit % 8);
+    if (set) {
+        bloom->filter.bits[bit / 8] |= mask;
+    } else {
+        bloom->filter.bits[bit / 8] &= ~mask;
+    }
+    bloom->filter.version++;
+    bloom->chunk_version[bit / 8 / BLOOM_CHUNK_SIZE] = bloom->filter.version;
+}
+
+// Empties the filter; every chunk counts as changed so clients refetch it
+// Parameters:
+// - bloom: The filter
+void bloom_reset(CountingBloom *bloom) {
+    uint32_t version = bloom->filter.version + 1;
+    int i;
+
+    memset(bloom, 0, sizeof(*bloom));
+    bloom->filter.version = version;
+    for (i = 0; i < BLOOM_CHUNKS; i++) {
+        bloom->chunk_version[i] = version;
+    }
+}
+
+// Adds a registered filename
+// Parameters:
+// - bloom: The filter
+// - key: The filename
+void bloom_add(CountingBloom *bloom, const char *key) {
+    uint32_t positions[BLOOM_HASHES];
+    int i;
+
+    bloom_positions(key, positions);
+    for (i = 0; i < BLOOM_HASHES; i++) {
+        if (bloom->counts[positions[i]] == 0) {
+            bloom_flip(bloom, positions[i], 1);
+        }
+        if (bloom->counts[positions[i]] < UINT8_MAX) {
+            bloom->counts[positions[i]]++;
+        }
+    }
+}
+
+// Removes a deregistered filename
+// Parameters:
+// - bloom: The filter
+// - key: The filename, which must have been added
+void bloom_remove(CountingBloom *bloom, const char *key) {
+    uint32_t positions[BLOOM_HASHES];
+    int i;
+
+    bloom_positions(key, positions);
+    for (i = 0; i < BLOOM_HASHES; i++) {
+        // A saturated counter has lost count; leave its bit set for good
+        if (bloom->counts[positions[i]] == 0 || bloom->counts[positions[i]] == UINT8_MAX) {
+            continue;
+        }
+        if (--bloom->counts[positions[i]] == 0) {
+            bloom_flip(bloom, positions[i], 0);
+        }
+    }
+}
+
+// Checks whether a filename may be registered
+// Parameters:
+// - filter: The published filter
+// - key: The filename
+// Returns 0 if the filename is certainly absent, 1 if it may be present
+int bloom_may_contain(const BloomFilter *filter, const char *key) {
+    uint32_t positions[BLOOM_HASHES];
+    int i;
+
+    bloom_positions(key, positions);
+    for (i = 0; i < BLOOM_HASHES; i++) {
+        if (!(filter->bits[positions[i] / 8] & (1 << (positions[i] % 8)))) {
+            return 0;
+        }
+    }
+    return 1;
+}
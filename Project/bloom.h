@@ -0,0 +1,50 @@
+// bloom.h
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include <stdint.h>
+
+// Bloom filter summary of the registered filenames.
+//
+// The index server keeps a counting filter so deregistrations can clear
+// bits, and publishes only the bit array. The array is served in chunks;
+// every change bumps the filter's version and stamps the chunk it touched,
+// so a client that already holds version v fetches just the chunks stamped
+// after v. A filename the filter rejects is certainly not registered (as of
+// the client's copy); one it accepts still needs a SEARCH.
+//
+// SUMMARY request data: "<known version> <chunk>", chunk -1 for the header.
+// Answer data (binary): version (4 bytes, big endian), chunk index (1 byte,
+// 0xFF for the header), then for the header a bitmap of chunks changed since
+// the known version (BLOOM_CHUNKS bits), or for a chunk BLOOM_CHUNK_SIZE bytes
+// of the bit array.
+
+#define BLOOM_BITS 8192          // Filter size; about 1 in 200000 false positives at MAX_ENTRIES files
+#define BLOOM_HASHES 4
+#define BLOOM_CHUNK_SIZE 128     // Bit array bytes per SUMMARY answer
+#define BLOOM_CHUNKS (BLOOM_BITS / 8 / BLOOM_CHUNK_SIZE)
+#define BLOOM_HEADER_CHUNK 0xFF
+#define BLOOM_PAYLOAD_OFFSET 5   // Bytes of version and chunk index before the payload
+
+// The published filter, as held by clients
+// version: 0 until the first fetch
+typedef struct {
+    uint8_t bits[BLOOM_BITS / 8];
+    uint32_t version;
+} BloomFilter;
+
+// The index server's counting filter
+// counts: Registered entries hashing to each bit
+// chunk_version: Filter version at the last change to each chunk
+typedef struct {
+    uint8_t counts[BLOOM_BITS];
+    uint32_t chunk_version[BLOOM_CHUNKS];
+    BloomFilter filter;
+} CountingBloom;
+
+void bloom_reset(CountingBloom *bloom);
+void bloom_add(CountingBloom *bloom, const char *key);
+void bloom_remove(CountingBloom *bloom, const char *key);
+int bloom_may_contain(const BloomFilter *filter, const char *key);
+
+#endif // BLOOM_H
@@ -1 +1 @@
-gmake p2p_client p2p_index_server
\ No newline at end of file
+gmake p2p_client p2p_index_server p2p_loadgen
\ No newline at end of file
@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+#include "chunkmac.h"
+
+#define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+// One SipHash round over a state held in four variables
+#define SIPROUND(v0, v1, v2, v3) \
+    do { \
+        v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+        v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+        v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+        v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+    } while (0)
+
+// Reads a little-endian word from any alignment
+static uint64_t load64(const unsigned char *p) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    return le64toh(word);
+}
+
+// SipHash-2-4 of a buffer
+// Parameters:
+// - key: The key
+// - data: Bytes to hash
+// - len: Number of bytes
+// Returns the 64-bit hash
+uint64_t siphash24(const MacKey *key, const void *data, size_t len) {
+    const unsigned char *p = data, *end = p + (len & ~(size_t)7);
+    uint64_t v0 = key->k0 ^ 0x736f6d6570736575ULL, v1 = key->k1 ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = key->k0 ^ 0x6c7967656e657261ULL, v3 = key->k1 ^ 0x7465646279746573ULL;
+    uint64_t last = (uint64_t)len << 56, m;
+    int i;
+
+    for (; p != end; p += 8) {
+        m = load64(p);
+        v3 ^= m;
+        SIPROUND(v0, v1, v2, v3);
+        SIPROUND(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+    for (i = 0; i < (int)(len & 7); i++) {
+        last |= (uint64_t)p[i] << (8 * i);
+    }
+    v3 ^= last;
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    v0 ^= last;
+    v2 ^= 0xff;
+    for (i = 0; i < 4; i++) {
+        SIPROUND(v0, v1, v2, v3);
+    }
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+// Fills a key from the kernel's random source
+// Returns 0 on success, -1 if no randomness was available
+int mac_key_random(MacKey *key) {
+    int fd = open("/dev/urandom", O_RDONLY);
+    ssize_t n = fd == -1 ? -1 : read(fd, key, sizeof(*key));
+
+    if (fd != -1) {
+        close(fd);
+    }
+    if (n != sizeof(*key)) {
+        memset(key, 0, sizeof(*key));
+        return -1;
+    }
+    return 0;
+}
+
+// Checks whether a key holds anything
+int mac_key_is_set(const MacKey *key) {
+    return key->k0 != 0 || key->k1 != 0;
+}
+
+// Writes a key as 32 hex digits
+// Parameters:
+// - key: The key
+// - text: At least MAC_KEY_TEXT_SIZE bytes
+void mac_key_format(const MacKey *key, char *text) {
+    snprintf(text, MAC_KEY_TEXT_SIZE, "%016llx%016llx", (unsigned long long)key->k0, (unsigned long long)key->k1);
+}
+
+// Reads a key written by mac_key_format
+// Returns 0 on success, -1 if text isn't 32 hex digits
+int mac_key_parse(const char *text, MacKey *key) {
+    unsigned long long k0, k1;
+    int used = 0;
+
+    if (strspn(text, "0123456789abcdefABCDEF") < 32 ||
+        sscanf(text, "%16llx%16llx%n", &k0, &k1, &used) != 2 || used != 32) {
+        return -1;
+    }
+    key->k0 = k0;
+    key->k1 = k1;
+    return 0;
+}
+
+// Derives the key of one download from a seeder's secret
+// Parameters:
+// - secret: The seeder's registered secret
+// - nonce: The nonce the index handed out with the SEARCH answer
+// - session: Filled with the derived key
+void mac_derive(const MacKey *secret, uint64_t nonce, MacKey *session) {
+    unsigned char input[9];
+    uint64_t le = htole64(nonce);
+
+    memcpy(input, &le, sizeof(le));
+    input[8] = 0;
+    session->k0 = siphash24(secret, input, sizeof(input));
+    input[8] = 1;
+    session->k1 = siphash24(secret, input, sizeof(input));
+}
+
+// Makes a token for one download from a seeder's secret
+// Parameters:
+// - secret: The seeder's registered secret
+// - token: Filled with "<nonce>:<key>"
+// - size: Size of token, at least MAC_TOKEN_SIZE
+void mac_token_issue(const MacKey *secret, char *token, size_t size) {
+    MacKey nonce, session;
+    char key_text[MAC_KEY_TEXT_SIZE];
+
+    // Only the first word of a fresh random key is used as the nonce
+    mac_key_random(&nonce);
+    mac_derive(secret, nonce.k0, &session);
+    mac_key_format(&session, key_text);
+    snprintf(token, size, "%016llx:%s", (unsigned long long)nonce.k0, key_text);
+}
+
+// Reads a token made by mac_token_issue
+// Parameters:
+// - token: The token
+// - nonce: Filled with the nonce to send the seeder
+// - session: Filled with the key to check the seeder's frames with
+// Returns 0 on success, -1 if the token is malformed
+int mac_token_parse(const char *token, uint64_t *nonce, MacKey *session) {
+    unsigned long long n;
+    int used = 0;
+
+    if (sscanf(token, "%16llx:%n", &n, &used) != 1 || used != 17) {
+        return -1;
+    }
+    *nonce = n;
+    return mac_key_parse(token + used, session);
+}
+
+// Tags one frame
+// Parameters:
+// - key: The download's key
+// - seq: Position of the frame in the transfer, so frames can't be dropped or reordered
+// - header: The frame header
+// - header_len: Length of header, at most 16 bytes
+// - payload: The frame payload
+// - len: Length of payload
+// Returns the tag
+uint64_t mac_tag(const MacKey *key, uint64_t seq, const void *header, size_t header_len, const void *payload, size_t len) {
+    const unsigned char *p = payload, *end = p + len / (8 * MAC_LANES) * (8 * MAC_LANES);
+    uint64_t v0[MAC_LANES], v1[MAC_LANES], v2[MAC_LANES], v3[MAC_LANES];
+    unsigned char summary[16 + 16 + 8 * MAC_LANES + 8 * MAC_LANES];
+    size_t tail = len - (end - p), at = 0;
+    uint64_t word;
+    int lane, i;
+
+    for (lane = 0; lane < MAC_LANES; lane++) {
+        // Each lane starts from a different state, so swapping lanes changes the tag
+        v0[lane] = key->k0 ^ 0x736f6d6570736575ULL;
+        v1[lane] = key->k1 ^ 0x646f72616e646f6dULL ^ (uint64_t)(lane + 1);
+        v2[lane] = key->k0 ^ 0x6c7967656e657261ULL;
+        v3[lane] = key->k1 ^ 0x7465646279746573ULL;
+    }
+    for (; p != end; p += 8 * MAC_LANES) {
+        uint64_t m[MAC_LANES];
+        for (lane = 0; lane < MAC_LANES; lane++) {
+            m[lane] = load64(p + 8 * lane);
+        }
+        for (lane = 0; lane < MAC_LANES; lane++) {
+            v3[lane] ^= m[lane];
+            SIPROUND(v0[lane], v1[lane], v2[lane], v3[lane]);
+            SIPROUND(v0[lane], v1[lane], v2[lane], v3[lane]);
+            v0[lane] ^= m[lane];
+        }
+    }
+    for (lane = 0; lane < MAC_LANES; lane++) {
+        v2[lane] ^= 0xff;
+        for (i = 0; i < 4; i++) {
+            SIPROUND(v0[lane], v1[lane], v2[lane], v3[lane]);
+        }
+    }
+
+    // Sequence number, length, header, lane results and tail go through one plain SipHash
+    word = htole64(seq);
+    memcpy(summary + at, &word, 8);
+    word = htole64(len);
+    memcpy(summary + at + 8, &word, 8);
+    at += 16;
+    memset(summary + at, 0, 16);
+    memcpy(summary + at, header, header_len < 16 ? header_len : 16);
+    at += 16;
+    for (lane = 0; lane < MAC_LANES; lane++) {
+        word = htole64(v0[lane] ^ v1[lane] ^ v2[lane] ^ v3[lane]);
+        memcpy(summary + at, &word, 8);
+        at += 8;
+    }
+    memcpy(summary + at, p, tail);
+    return siphash24(key, summary, at + tail);
+}
@@ -0,0 +1,47 @@
+// chunkmac.h
+#ifndef CHUNKMAC_H
+#define CHUNKMAC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Keyed tags that let a downloader tell a seeder's frames from spoofed ones
+// without the cost of TLS.
+//
+// A seeder registers its files with a random secret. For each SEARCH the
+// index picks a random nonce and answers with a token, "<nonce>:<key>", where
+// the key is derived from the secret and the nonce; the seeder derives the
+// same key from the nonce alone, so the secret never leaves the seeder and
+// the index. Every frame of a transfer then carries a tag over its sequence
+// number, header and payload (see transfer.h). This keeps off-path hosts from
+// injecting or replacing data; it does not hide data, and anyone who can read
+// the SEARCH answer can forge frames for that one download.
+//
+// Tags are SipHash-2-4 based. A frame payload is spread over MAC_LANES
+// independent SipHash states, one 8-byte word to each in turn, so the lanes'
+// rounds don't wait on each other and the compiler can run them side by side
+// in vector registers. The lane results, the unaligned tail, the sequence
+// number, the header and the length are then hashed together into the tag.
+
+#define MAC_LANES 4              // Independent SipHash states per payload
+#define MAC_TAG_SIZE 8           // Bytes of tag after each frame
+#define MAC_KEY_TEXT_SIZE 33     // 32 hex digits and a terminator
+#define MAC_TOKEN_SIZE 50        // "<16 hex digits>:<32 hex digits>" and a terminator
+
+// 128-bit SipHash key; all zero means none
+typedef struct {
+    uint64_t k0;
+    uint64_t k1;
+} MacKey;
+
+uint64_t siphash24(const MacKey *key, const void *data, size_t len);
+int mac_key_random(MacKey *key);
+int mac_key_is_set(const MacKey *key);
+void mac_key_format(const MacKey *key, char *text);
+int mac_key_parse(const char *text, MacKey *key);
+void mac_derive(const MacKey *secret, uint64_t nonce, MacKey *session);
+void mac_token_issue(const MacKey *secret, char *token, size_t size);
+int mac_token_parse(const char *token, uint64_t *nonce, MacKey *session);
+uint64_t mac_tag(const MacKey *key, uint64_t seq, const void *header, size_t header_len, const void *payload, size_t len);
+
+#endif // CHUNKMAC_H
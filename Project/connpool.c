@@ -0,0 +1,117 @@
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include "connpool.h"
+
+// An idle connection
+// sd: Socket, -1 if the slot is free
+// since: When it was put back
+// connect_us: Time its connect() took
+typedef struct {
+    char peer_name[PEER_NAME_SIZE];
+    char ip[HOST_TEXT_SIZE];
+    int sd;
+    time_t since;
+    uint64_t connect_us;
+} PooledConnection;
+
+static PooledConnection pool[CONNPOOL_SIZE];
+static int pool_ready = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Marks every slot free the first time the pool is used; call with pool_lock held
+static void pool_init(void) {
+    int i;
+    if (!pool_ready) {
+        for (i = 0; i < CONNPOOL_SIZE; i++) {
+            pool[i].sd = -1;
+        }
+        pool_ready = 1;
+    }
+}
+
+// Checks that an idle connection can carry another request
+// A readable socket means the seeder closed it or sent something unasked; either way it's no use
+static int still_usable(int sd) {
+    struct pollfd pfd = { sd, POLLIN, 0 };
+    return poll(&pfd, 1, 0) == 0;
+}
+
+// Takes an idle connection to a peer out of the pool
+// Parameters:
+// - peer_name: Name the peer registered under
+// - ip: The peer's address, as the index gave it
+// - connect_us: Set to the time the connection's connect() took
+// Returns the socket, or -1 if there is none to reuse
+int connpool_take(const char *peer_name, const char *ip, uint64_t *connect_us) {
+    time_t now = time(NULL);
+    int i, sd = -1;
+
+    pthread_mutex_lock(&pool_lock);
+    pool_init();
+    for (i = 0; i < CONNPOOL_SIZE && sd == -1; i++) {
+        if (pool[i].sd == -1 || strcmp(pool[i].peer_name, peer_name) != 0 || strcmp(pool[i].ip, ip) != 0) {
+            continue;
+        }
+        if (now - pool[i].since < CONNPOOL_IDLE_SEC && still_usable(pool[i].sd)) {
+            sd = pool[i].sd;
+            *connect_us = pool[i].connect_us;
+        } else {
+            close(pool[i].sd);
+        }
+        pool[i].sd = -1;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return sd;
+}
+
+// Keeps a connection for the next download from the same peer
+// The oldest idle connection makes room if the pool is full
+// Parameters:
+// - peer_name: Name the peer registered under
+// - ip: The peer's address, as the index gave it
+// - sd: Socket whose last transfer ended cleanly
+// - connect_us: Time its connect() took
+void connpool_put(const char *peer_name, const char *ip, int sd, uint64_t connect_us) {
+    int i, slot = 0;
+
+    pthread_mutex_lock(&pool_lock);
+    pool_init();
+    for (i = 0; i < CONNPOOL_SIZE; i++) {
+        if (pool[i].sd == -1) {
+            slot = i;
+            break;
+        }
+        if (pool[i].since < pool[slot].since) {
+            slot = i;
+        }
+    }
+    if (pool[slot].sd != -1) {
+        close(pool[slot].sd);
+    }
+    strncpy(pool[slot].peer_name, peer_name, sizeof(pool[slot].peer_name) - 1);
+    pool[slot].peer_name[sizeof(pool[slot].peer_name) - 1] = '\0';
+    strncpy(pool[slot].ip, ip, sizeof(pool[slot].ip) - 1);
+    pool[slot].ip[sizeof(pool[slot].ip) - 1] = '\0';
+    pool[slot].sd = sd;
+    pool[slot].since = time(NULL);
+    pool[slot].connect_us = connect_us;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+// Closes every idle connection
+void connpool_clear(void) {
+    int i;
+
+    pthread_mutex_lock(&pool_lock);
+    pool_init();
+    for (i = 0; i < CONNPOOL_SIZE; i++) {
+        if (pool[i].sd != -1) {
+            close(pool[i].sd);
+            pool[i].sd = -1;
+        }
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
@@ -0,0 +1,28 @@
+// connpool.h
+#ifndef CONNPOOL_H
+#define CONNPOOL_H
+
+#include <stdint.h>
+#include "constants.h"
+#include "netaddr.h"
+
+// Idle connections to seeders, kept for the next download from the same peer.
+//
+// A seeder that accepted "keepalive" (see transfer.h) serves every file its
+// peer registered on any of its connections, so the pool is keyed by peer
+// name and address rather than by port. A connection is handed out once and
+// comes back only when its last transfer ended cleanly. Connections idle for
+// CONNPOOL_IDLE_SEC are closed rather than reused, since the seeder drops
+// them after SEEDER_IDLE_SEC, and so are connections the seeder has closed
+// or sent something on in the meantime. Each connection keeps the time its
+// connect() took, which downloads over it report as the peer's RTT.
+
+#define CONNPOOL_SIZE 8               // Idle connections kept
+#define CONNPOOL_IDLE_SEC 10          // Idle time after which a connection isn't reused
+#define SEEDER_IDLE_SEC 15            // Idle time after which a seeder closes a connection
+
+int connpool_take(const char *peer_name, const char *ip, uint64_t *connect_us);
+void connpool_put(const char *peer_name, const char *ip, int sd, uint64_t connect_us);
+void connpool_clear(void);
+
+#endif // CONNPOOL_H
@@ -7,6 +7,8 @@
 #define MAX_ENTRIES 100      // Maximum number of registered files
 #define FILENAME_SIZE 11    // Maximum size for filenames
 #define PEER_NAME_SIZE 11   // Maximum size for peer names
+#define PROXY_HEARTBEAT_SEC 10  // How often a caching proxy repeats PROXY_JOIN
+#define SUBSCRIPTION_LEASE_SEC 30  // A subscriber that doesn't renew within this long is dropped
 
 // Define PDU Types
 #define REGISTER 'R'
@@ -18,6 +20,15 @@
 #define ACKNOWLEDGE 'A'
 #define ERROR 'E'
 #define FINAL 'F'
+#define REPORT 'P'          // Downloader reports a completed transfer's throughput
+#define PROXY_JOIN 'J'      // Caching proxy (re)subscribes to an upstream index's invalidations
+#define INVALIDATE 'I'      // Upstream index tells proxies a filename's entries changed
+#define QUERY 'Q'           // Glob/prefix search over filenames, any or matching peers, paged
+#define SUMMARY 'B'         // Fetches the Bloom filter of registered filenames (see bloom.h)
+#define SUBSCRIBE 'W'       // Starts or renews a subscription to registry changes
+#define NOTIFY 'N'          // Pushed to subscribers: "<seq> +|-peer:file:ip:port"
+#define SLOW_DOWN 'L'       // Request refused by rate limiting or load shedding (see ratelimit.h)
+#define COMPRESSED_DATA 'Z' // Deflated file chunk in a framed transfer (see transfer.h)
 
 // PDU Data Structure
 struct pdu {
@@ -0,0 +1,123 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include "p2p_log.h"
+#include "filewriter.h"
+
+// Writes the buffered bytes at the current offset
+// Returns 0 on success, -1 on failure
+static int flush_buffer(FileWriter *writer) {
+    const unsigned char *p = writer->buffer;
+    size_t len = writer->used;
+
+    if (writer->direct && len % WRITER_ALIGN != 0) {
+        // Only the last write can be unaligned; it goes through the page cache
+        fcntl(writer->fd, F_SETFL, fcntl(writer->fd, F_GETFL) & ~O_DIRECT);
+        writer->direct = 0;
+    }
+    while (len > 0) {
+        ssize_t n = pwrite(writer->fd, p, len, writer->offset);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+        writer->offset += n;
+    }
+    writer->used = 0;
+    return 0;
+}
+
+// Starts a download
+// Parameters:
+// - writer: Filled in
+// - path: Where the file goes once complete
+// Returns 0 on success, -1 if the temporary file can't be created
+int file_writer_open(FileWriter *writer, const char *path) {
+    void *buffer;
+
+    memset(writer, 0, sizeof(*writer));
+    snprintf(writer->path, sizeof(writer->path), "%s", path);
+    snprintf(writer->temp, sizeof(writer->temp), "%s.part", path);
+    if (posix_memalign(&buffer, WRITER_ALIGN, WRITER_BUFFER_SIZE) != 0) {
+        return -1;
+    }
+    if ((writer->fd = open(writer->temp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+        free(buffer);
+        return -1;
+    }
+    writer->buffer = buffer;
+    return 0;
+}
+
+// Prepares for a file of known size: preallocates it, and turns on O_DIRECT if it is large
+// Failing either is harmless, the writes just take the slower path
+// Parameters:
+// - writer: The download
+// - size: Size the sender announced
+void file_writer_reserve(FileWriter *writer, long long size) {
+    const char *direct_io = getenv("P2P_DIRECT_IO");
+
+    if (size <= 0) {
+        return;
+    }
+    writer->size = size;
+    if (fallocate(writer->fd, 0, 0, size) == -1) {
+        LOG_DEBUG("Cannot preallocate %s: %s", writer->temp, strerror(errno));
+    }
+    if (size >= WRITER_DIRECT_MIN && writer->offset == 0 && writer->used == 0 &&
+        !(direct_io && strcmp(direct_io, "0") == 0)) {
+        // Some filesystems (tmpfs) refuse O_DIRECT
+        writer->direct = fcntl(writer->fd, F_SETFL, fcntl(writer->fd, F_GETFL) | O_DIRECT) == 0;
+    }
+}
+
+// Adds data to the end of the file
+// Returns 0 on success, -1 if writing failed
+int file_writer_write(FileWriter *writer, const void *data, size_t len) {
+    const unsigned char *p = data;
+
+    while (len > 0) {
+        size_t room = WRITER_BUFFER_SIZE - writer->used, take = len < room ? len : room;
+        memcpy(writer->buffer + writer->used, p, take);
+        writer->used += take;
+        p += take;
+        len -= take;
+        if (writer->used == WRITER_BUFFER_SIZE && flush_buffer(writer) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Finishes a complete download and moves it into place
+// Returns 0 on success, -1 on failure, in which case the temporary file is removed
+int file_writer_commit(FileWriter *writer) {
+    // Preallocation may have reserved more than arrived; the file ends where the data does
+    int failed = flush_buffer(writer) == -1 || ftruncate(writer->fd, writer->offset) == -1;
+
+    failed |= close(writer->fd) == -1;
+    free(writer->buffer);
+    writer->buffer = NULL;
+    if (failed || rename(writer->temp, writer->path) == -1) {
+        LOG_WARN("Cannot save %s: %s", writer->path, strerror(errno));
+        unlink(writer->temp);
+        return -1;
+    }
+    return 0;
+}
+
+// Drops an incomplete download
+void file_writer_abort(FileWriter *writer) {
+    close(writer->fd);
+    free(writer->buffer);
+    writer->buffer = NULL;
+    unlink(writer->temp);
+}
@@ -0,0 +1,48 @@
+// filewriter.h
+#ifndef FILEWRITER_H
+#define FILEWRITER_H
+
+#include <limits.h>
+
+// Write path for downloads.
+//
+// A download goes to "<name>.part" and is renamed to its name only once it
+// is complete, so a half-written file is never seen, served or registered
+// under the real name. Data is gathered in a WRITER_BUFFER_SIZE buffer and
+// written with one pwrite() per buffer instead of one write per PDU.
+//
+// When the size is known up front (the seeder announces it, see transfer.h)
+// the file is preallocated with fallocate(), which saves growing it block by
+// block and keeps it in few extents. Files of WRITER_DIRECT_MIN bytes or more
+// are written with O_DIRECT, so a multi-gigabyte download doesn't push
+// everything else out of the page cache; P2P_DIRECT_IO=0 turns that off.
+// Buffers are aligned and flushed at aligned offsets for O_DIRECT, and the
+// unaligned tail goes out through the page cache.
+
+#define WRITER_BUFFER_SIZE (1024 * 1024)      // Bytes gathered per pwrite()
+#define WRITER_ALIGN 4096                     // Buffer and offset alignment O_DIRECT needs
+#define WRITER_DIRECT_MIN (1LL << 30)         // Files this large skip the page cache
+
+// A download being written
+// direct: Whether O_DIRECT is on
+// used: Bytes waiting in buffer
+// offset: Bytes written to the file so far
+// size: Size the sender announced, 0 if it didn't
+typedef struct {
+    int fd;
+    int direct;
+    long long size;
+    unsigned char *buffer;
+    size_t used;
+    long long offset;
+    char path[PATH_MAX];
+    char temp[PATH_MAX + 8];
+} FileWriter;
+
+int file_writer_open(FileWriter *writer, const char *path);
+void file_writer_reserve(FileWriter *writer, long long size);
+int file_writer_write(FileWriter *writer, const void *data, size_t len);
+int file_writer_commit(FileWriter *writer);
+void file_writer_abort(FileWriter *writer);
+
+#endif // FILEWRITER_H
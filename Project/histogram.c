@@ -0,0 +1,107 @@
+#include <string.h>
+#include "histogram.h"
+
+// Maps a value to its bucket index
+// Parameters:
+// - value: The value to locate
+static int bucket_index(uint64_t value) {
+    int msb, shift;
+
+    if (value < HIST_SUB_COUNT) {
+        return (int)value;
+    }
+    msb = 63 - __builtin_clzll(value);
+    shift = msb - HIST_SUB_BITS + 1;
+    return HIST_SUB_COUNT + (shift - 1) * (HIST_SUB_COUNT / 2) +
+           (int)(value >> shift) - HIST_SUB_COUNT / 2;
+}
+
+// Returns the highest value that maps to a bucket
+// Parameters:
+// - index: The bucket index
+static uint64_t bucket_upper_value(int index) {
+    int shift;
+    uint64_t top;
+
+    if (index < HIST_SUB_COUNT) {
+        return (uint64_t)index;
+    }
+    shift = (index - HIST_SUB_COUNT) / (HIST_SUB_COUNT / 2) + 1;
+    top = (uint64_t)((index - HIST_SUB_COUNT) % (HIST_SUB_COUNT / 2) + HIST_SUB_COUNT / 2);
+    return ((top + 1) << shift) - 1;
+}
+
+// Resets a histogram to empty
+// Parameters:
+// - h: The histogram to reset
+void histogram_init(Histogram *h) {
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+// Records a single value
+// Parameters:
+// - h: The histogram to record into
+// - value: The value to record
+void histogram_record(Histogram *h, uint64_t value) {
+    h->counts[bucket_index(value)]++;
+    h->total++;
+    h->sum += (double)value;
+    if (value < h->min) {
+        h->min = value;
+    }
+    if (value > h->max) {
+        h->max = value;
+    }
+}
+
+// Adds every value recorded in src to dst
+// Parameters:
+// - dst: The histogram to add into
+// - src: The histogram to add from
+void histogram_merge(Histogram *dst, const Histogram *src) {
+    int i;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        dst->counts[i] += src->counts[i];
+    }
+    dst->total += src->total;
+    dst->sum += src->sum;
+    if (src->min < dst->min) {
+        dst->min = src->min;
+    }
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+}
+
+// Returns the value at or below which the given percentage of values fall
+// Parameters:
+// - h: The histogram to query
+// - percentile: Percentile in the range 0 to 100
+uint64_t histogram_percentile(const Histogram *h, double percentile) {
+    uint64_t target, seen = 0;
+    int i;
+
+    if (h->total == 0) {
+        return 0;
+    }
+    target = (uint64_t)(percentile / 100.0 * (double)h->total + 0.5);
+    if (target < 1) {
+        target = 1;
+    }
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= target) {
+            uint64_t value = bucket_upper_value(i);
+            return value < h->max ? value : h->max;
+        }
+    }
+    return h->max;
+}
+
+// Returns the mean of the recorded values
+// Parameters:
+// - h: The histogram to query
+double histogram_mean(const Histogram *h) {
+    return h->total ? h->sum / (double)h->total : 0.0;
+}
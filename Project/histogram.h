@@ -0,0 +1,29 @@
+// histogram.h
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+// Log-linear (HDR style) histogram of non-negative integer values.
+// Values below HIST_SUB_COUNT are counted exactly; above that every power
+// of two is split into HIST_SUB_COUNT / 2 linear sub-buckets, so any
+// recorded value is reported within 1 / (HIST_SUB_COUNT / 2) of itself.
+#define HIST_SUB_BITS 7
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (HIST_SUB_COUNT + (64 - HIST_SUB_BITS) * (HIST_SUB_COUNT / 2))
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;   // Number of recorded values
+    uint64_t min;     // Smallest recorded value
+    uint64_t max;     // Largest recorded value
+    double sum;       // Sum of recorded values, for the mean
+} Histogram;
+
+void histogram_init(Histogram *h);
+void histogram_record(Histogram *h, uint64_t value);
+void histogram_merge(Histogram *dst, const Histogram *src);
+uint64_t histogram_percentile(const Histogram *h, double percentile);
+double histogram_mean(const Histogram *h);
+
+#endif // HISTOGRAM_H
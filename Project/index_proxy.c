@@ -0,0 +1,427 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "constants.h"
+#include "metrics.h"
+#include "p2p_log.h"
+#include "index_proxy.h"
+#include "netaddr.h"
+#include "ratelimit.h"
+
+#define CACHE_KEY_SIZE (PEER_NAME_SIZE + FILENAME_SIZE + 1)
+#define POLL_INTERVAL_MS 100
+
+// A cached SEARCH or LIST_CONTENT answer
+// type: SEARCH or LIST_CONTENT; 0 marks a free slot
+// key: "peer filename" for SEARCH, empty for LIST_CONTENT
+// filename: File the answer is about, empty for LIST_CONTENT
+// expires_us: When the answer stops being served, on the metrics_now_us clock
+// response: The upstream's answer, including "not found" errors
+typedef struct {
+    char type;
+    char key[CACHE_KEY_SIZE];
+    char filename[FILENAME_SIZE];
+    uint64_t expires_us;
+    struct pdu response;
+} CacheEntry;
+
+// A request forwarded upstream and not answered yet
+// sd: Socket connected to the upstream index, -1 marks a free slot
+// client: Peer to relay the answer to
+// request: The request as the peer sent it
+// start_us: When the request arrived
+typedef struct {
+    int sd;
+    struct sockaddr_storage client;
+    struct pdu request;
+    uint64_t start_us;
+} PendingRequest;
+
+static CacheEntry cache[PROXY_CACHE_SIZE];
+static PendingRequest pending[PROXY_MAX_PENDING];
+static struct sockaddr_storage upstream;     // For the forwarding sockets
+static socklen_t upstream_len;
+static struct sockaddr_storage upstream_via;  // The same, in the family of the listening socket
+static socklen_t upstream_via_len;
+static uint64_t cache_ttl_us;
+
+// Builds the cache key of a SEARCH or LIST_CONTENT request
+// Parameters:
+// - request: The request
+// - key: Filled with the key
+// - filename: Filled with the file the request is about, or empty
+static void cache_key(const struct pdu *request, char *key, char *filename) {
+    char peer_name[PEER_NAME_SIZE] = {0};
+
+    key[0] = '\0';
+    filename[0] = '\0';
+    if (request->type == SEARCH) {
+        sscanf(request->data, "%10s %10s", peer_name, filename);
+        snprintf(key, CACHE_KEY_SIZE, "%s %s", peer_name, filename);
+    }
+}
+
+// Returns the cache slot for a key (FNV-1a; a colliding key evicts the old one)
+static CacheEntry *cache_slot(char type, const char *key) {
+    uint32_t hash = 2166136261u;
+    hash = (hash ^ (unsigned char)type) * 16777619u;
+    while (*key) {
+        hash = (hash ^ (unsigned char)*key++) * 16777619u;
+    }
+    return &cache[hash & (PROXY_CACHE_SIZE - 1)];
+}
+
+// Looks up a cached answer
+// Parameters:
+// - request: A SEARCH or LIST_CONTENT request
+// - allow_stale: Nonzero to also return an expired answer
+// Returns the entry, or NULL on a miss
+static CacheEntry *cache_lookup(const struct pdu *request, int allow_stale) {
+    char key[CACHE_KEY_SIZE], filename[FILENAME_SIZE];
+    CacheEntry *entry;
+
+    cache_key(request, key, filename);
+    entry = cache_slot(request->type, key);
+    if (entry->type != request->type || strcmp(entry->key, key) != 0) {
+        return NULL;
+    }
+    if (!allow_stale && entry->expires_us < metrics_now_us()) {
+        return NULL;
+    }
+    return entry;
+}
+
+// Caches an upstream answer
+// Parameters:
+// - request: The SEARCH or LIST_CONTENT request that was answered
+// - response: The upstream's answer
+static void cache_store(const struct pdu *request, const struct pdu *response) {
+    char key[CACHE_KEY_SIZE], filename[FILENAME_SIZE];
+    CacheEntry *entry;
+
+    cache_key(request, key, filename);
+    entry = cache_slot(request->type, key);
+    entry->type = request->type;
+    strcpy(entry->key, key);
+    strcpy(entry->filename, filename);
+    entry->expires_us = metrics_now_us() + cache_ttl_us;
+    entry->response = *response;
+}
+
+// Drops every cached answer a change to a file could affect
+// Parameters:
+// - filename: The changed file, or NULL to drop everything
+static void cache_invalidate(const char *filename) {
+    int i;
+    for (i = 0; i < PROXY_CACHE_SIZE; i++) {
+        if (cache[i].type == LIST_CONTENT || (cache[i].type == SEARCH &&
+            (filename == NULL || strcmp(cache[i].filename, filename) == 0))) {
+            cache[i].type = 0;
+        }
+    }
+}
+
+// Sends a reply to a peer and records it
+// Parameters:
+// - sd: The proxy's socket
+// - client: The peer
+// - request: The request being answered
+// - response: The answer
+// - start_us: When the request arrived
+static void reply(int sd, const struct sockaddr_storage *client, const struct pdu *request,
+                  const struct pdu *response, uint64_t start_us) {
+    sendto(sd, response, sizeof(*response), 0, (const struct sockaddr *)client, sizeof(*client));
+    metrics_request(request->type, response->type == ERROR, metrics_now_us() - start_us);
+    metrics_bytes(sizeof(*request), sizeof(*response));
+}
+
+// Forwards a request upstream on its own socket so answers can't be mixed up
+// Parameters:
+// - sd: The proxy's socket, used to refuse the request when too many are pending
+// - client: The peer that sent the request
+// - request: The request, rewritten to carry the peer's address where the upstream needs it
+// - start_us: When the request arrived
+static void forward(int sd, const struct sockaddr_storage *client, const struct pdu *request, uint64_t start_us) {
+    struct pdu busy;
+    int i;
+
+    for (i = 0; i < PROXY_MAX_PENDING; i++) {
+        if (pending[i].sd == -1) {
+            break;
+        }
+    }
+    if (i == PROXY_MAX_PENDING) {
+        busy.type = ERROR;
+        strcpy(busy.data, "Index proxy busy.");
+        reply(sd, client, request, &busy, start_us);
+        return;
+    }
+
+    if ((pending[i].sd = socket(upstream.ss_family, SOCK_DGRAM, 0)) == -1 ||
+        connect(pending[i].sd, (struct sockaddr *)&upstream, upstream_len) == -1 ||
+        send(pending[i].sd, request, sizeof(*request), 0) == -1) {
+        LOG_WARN("Cannot forward request upstream: %s", strerror(errno));
+        if (pending[i].sd != -1) {
+            close(pending[i].sd);
+            pending[i].sd = -1;
+        }
+        busy.type = ERROR;
+        strcpy(busy.data, "Upstream index unavailable.");
+        reply(sd, client, request, &busy, start_us);
+        return;
+    }
+    pending[i].client = *client;
+    pending[i].request = *request;
+    pending[i].start_us = start_us;
+}
+
+// Gives up on a forwarded request, answering from an expired cache entry if there is one
+// Parameters:
+// - sd: The proxy's socket
+// - p: The pending request that timed out
+static void expire(int sd, PendingRequest *p) {
+    struct pdu response;
+    CacheEntry *stale = NULL;
+
+    if (p->request.type == SEARCH || p->request.type == LIST_CONTENT) {
+        stale = cache_lookup(&p->request, 1);
+    }
+    if (stale != NULL) {
+        response = stale->response;
+    } else {
+        response.type = ERROR;
+        strcpy(response.data, "Upstream index unavailable.");
+    }
+    LOG_WARN("Upstream index did not answer, %s", stale ? "served a stale answer" : "failed the request");
+    reply(sd, &p->client, &p->request, &response, p->start_us);
+    close(p->sd);
+    p->sd = -1;
+}
+
+// Relays the upstream's answer to a forwarded request
+// Parameters:
+// - sd: The proxy's socket
+// - p: The pending request whose socket is readable
+static void complete(int sd, PendingRequest *p) {
+    struct pdu response;
+    char filename[FILENAME_SIZE] = {0};
+    char peer_name[PEER_NAME_SIZE];
+
+    if (recv(p->sd, &response, sizeof(response), 0) == -1) {
+        expire(sd, p);  // e.g. ICMP port unreachable: the upstream is down
+        return;
+    }
+    if (response.type == SLOW_DOWN) {
+        // The upstream is shedding load; an expired answer beats none
+        CacheEntry *stale = NULL;
+        if (p->request.type == SEARCH || p->request.type == LIST_CONTENT) {
+            stale = cache_lookup(&p->request, 1);
+        }
+        if (stale != NULL) {
+            response = stale->response;
+        }
+    } else if (p->request.type == SEARCH || p->request.type == LIST_CONTENT) {
+        cache_store(&p->request, &response);
+    } else if (response.type == ACKNOWLEDGE && p->request.type == REGISTER) {
+        // The upstream will invalidate too, but don't let our own peer read a stale answer meanwhile
+        sscanf(p->request.data, "%10s %10s", peer_name, filename);
+        cache_invalidate(filename);
+    } else if (response.type == ACKNOWLEDGE && p->request.type == DEREGISTER) {
+        sscanf(p->request.data, "%10[^:]", filename);
+        cache_invalidate(filename);
+    }
+    reply(sd, &p->client, &p->request, &response, p->start_us);
+    close(p->sd);
+    p->sd = -1;
+}
+
+// Handles one request from a peer
+// Parameters:
+// - sd: The proxy's socket
+// - client: The peer
+// - request: The request
+// - start_us: When the request arrived
+static void handle_request(int sd, const struct sockaddr_storage *client, struct pdu *request, uint64_t start_us) {
+    char client_host[HOST_TEXT_SIZE];
+    struct in6_addr client_addr;
+    struct pdu response;
+    size_t len;
+    CacheEntry *hit;
+
+    switch (request->type) {
+    case SEARCH:
+    case LIST_CONTENT:
+        if ((hit = cache_lookup(request, 0)) != NULL) {
+            LOG_DEBUG("Cache hit for %c %s", request->type, hit->key);
+            reply(sd, client, request, &hit->response, start_us);
+        } else {
+            forward(sd, client, request, start_us);
+        }
+        break;
+    case REGISTER:
+    case DEREGISTER:
+        // The upstream sees the proxy's address, so pass on the peer's
+        netaddr_from_sockaddr(client, &client_addr, NULL);
+        netaddr_format(&client_addr, client_host, sizeof(client_host));
+        request->data[BUFLEN - 1] = '\0';
+        len = strlen(request->data);
+        snprintf(request->data + len, sizeof(request->data) - len, " %s", client_host);
+        forward(sd, client, request, start_us);
+        break;
+    case REPORT:
+    case QUERY:
+    case SUMMARY:
+        forward(sd, client, request, start_us);
+        break;
+    case SUBSCRIBE:
+        // Notifications go to the subscriber's own address, which a forwarding socket can't provide
+        response.type = ERROR;
+        strcpy(response.data, "Subscribe with the upstream index directly.");
+        reply(sd, client, request, &response, start_us);
+        break;
+    default:
+        metrics_request(request->type, 1, metrics_now_us() - start_us);
+        break;  // Unknown requests are not answered
+    }
+}
+
+// Runs the index server as a caching proxy in front of another index server
+// Parameters:
+// - server_port: The port number for the proxy to listen on
+// - upstream_host: Name or address of the upstream index server, IPv4 or IPv6
+// - upstream_port: Port number of the upstream index server
+// - ttl_ms: How long cached answers are served
+void index_proxy_udp(int server_port, const char *upstream_host, int upstream_port, int ttl_ms) {
+    int sd;
+    struct sockaddr_storage client;
+    struct pdu request, join;
+    struct pollfd fds[PROXY_MAX_PENDING + 1];
+    int owner[PROXY_MAX_PENDING + 1];
+    socklen_t client_len;
+    uint64_t now, next_join = 0;
+    int subscribed = 0, join_outstanding = 0;
+    int nfds, i, admit;
+    struct in6_addr client_addr;
+    uint32_t retry_ms;
+    ssize_t n;
+
+    cache_ttl_us = (uint64_t)ttl_ms * 1000;
+    for (i = 0; i < PROXY_MAX_PENDING; i++) {
+        pending[i].sd = -1;
+    }
+
+    if (netaddr_resolve(upstream_host, upstream_port, SOCK_DGRAM, &upstream, &upstream_len) == -1) {
+        fprintf(stderr, "Invalid upstream index address %s\n", upstream_host);
+        exit(1);
+    }
+
+    // Create a dual-stack UDP socket for the peers
+    if ((sd = netaddr_listen(SOCK_DGRAM, server_port)) == -1) {
+        perror("Cannot bind socket");
+        exit(1);
+    }
+    upstream_via_len = netaddr_for_socket(sd, &upstream, &upstream_via);
+
+    LOG_INFO("Index proxy is listening on port %d, upstream %s:%d, cache TTL %d ms",
+             server_port, upstream_host, upstream_port, ttl_ms);
+
+    join.type = PROXY_JOIN;
+    memset(join.data, 0, sizeof(join.data));
+
+    while (1) {
+        now = metrics_now_us();
+
+        // Subscribe, and keep subscribing so a restarted upstream learns about us again.
+        // A heartbeat that went unanswered may have hidden invalidations: start over cold.
+        if (now >= next_join) {
+            if (join_outstanding && subscribed) {
+                LOG_WARN("Lost contact with upstream index, cache will be flushed on reconnect");
+                subscribed = 0;
+            }
+            sendto(sd, &join, sizeof(join), 0, (struct sockaddr *)&upstream_via, upstream_via_len);
+            join_outstanding = 1;
+            next_join = now + (uint64_t)PROXY_HEARTBEAT_SEC * 1000000;
+        }
+
+        // Expire forwarded requests the upstream never answered
+        for (i = 0; i < PROXY_MAX_PENDING; i++) {
+            if (pending[i].sd != -1 && now - pending[i].start_us > (uint64_t)PROXY_UPSTREAM_TIMEOUT_MS * 1000) {
+                expire(sd, &pending[i]);
+            }
+        }
+
+        fds[0].fd = sd;
+        fds[0].events = POLLIN;
+        nfds = 1;
+        for (i = 0; i < PROXY_MAX_PENDING; i++) {
+            if (pending[i].sd != -1) {
+                fds[nfds].fd = pending[i].sd;
+                fds[nfds].events = POLLIN;
+                owner[nfds] = i;
+                nfds++;
+            }
+        }
+        if (poll(fds, nfds, POLL_INTERVAL_MS) <= 0) {
+            continue;
+        }
+
+        for (i = 1; i < nfds; i++) {
+            if (fds[i].revents) {
+                complete(sd, &pending[owner[i]]);
+            }
+        }
+        if (!(fds[0].revents & POLLIN)) {
+            continue;
+        }
+
+        client_len = sizeof(client);
+        if ((n = recvfrom(sd, &request, sizeof(request), 0, (struct sockaddr *)&client, &client_len)) == -1) {
+            LOG_WARN("Failed to receive message: %s", strerror(errno));
+            continue;
+        }
+
+        if (netaddr_same(&client, &upstream)) {
+            // Traffic from the upstream itself: invalidations and heartbeat answers
+            if (request.type == INVALIDATE) {
+                request.data[FILENAME_SIZE - 1] = '\0';
+                LOG_DEBUG("Upstream invalidated %s", request.data);
+                cache_invalidate(request.data);
+            } else if (request.type == ACKNOWLEDGE) {
+                if (!subscribed) {
+                    cache_invalidate(NULL);
+                    LOG_INFO("Subscribed to upstream index invalidations");
+                }
+                subscribed = 1;
+                join_outstanding = 0;
+            } else if (request.type == ERROR) {
+                LOG_WARN("Upstream index refused subscription: %s", request.data);
+            }
+            continue;
+        }
+
+        // Peers behind the proxy are held to the same per-source limits as at the index
+        now = metrics_now_us();
+        netaddr_from_sockaddr(&client, &client_addr, NULL);
+        if ((admit = ratelimit_admit(&client_addr, request.type, now, &retry_ms)) != RATE_ADMIT) {
+            if (admit == RATE_WARN) {
+                struct pdu response;
+                response.type = SLOW_DOWN;
+                memset(response.data, 0, sizeof(response.data));
+                snprintf(response.data, sizeof(response.data), "%u Rate limit exceeded.", retry_ms);
+                sendto(sd, &response, sizeof(response), 0, (struct sockaddr *)&client, client_len);
+            }
+            metrics_refused(request.type, 0);
+            continue;
+        }
+        handle_request(sd, &client, &request, now);
+    }
+    close(sd);
+}
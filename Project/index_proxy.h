@@ -0,0 +1,21 @@
+// index_proxy.h
+#ifndef INDEX_PROXY_H
+#define INDEX_PROXY_H
+
+// Caching proxy mode of the index server.
+//
+// A proxy sits between a site's peers and a central index. SEARCH and
+// LIST_CONTENT answers are cached for a TTL and served locally; misses,
+// registrations and reports are forwarded upstream. The proxy subscribes to
+// the upstream index with PROXY_JOIN and drops cached answers when the
+// upstream sends INVALIDATE for a filename, so a registration elsewhere is
+// visible without waiting for the TTL.
+
+#define PROXY_CACHE_SIZE 512           // Cached answers, must be a power of two
+#define PROXY_MAX_PENDING 64           // Requests forwarded upstream at once
+#define PROXY_DEFAULT_TTL_MS 5000      // Lifetime of a cached answer
+#define PROXY_UPSTREAM_TIMEOUT_MS 2000 // Give up on an upstream answer after this long
+
+void index_proxy_udp(int server_port, const char *upstream_host, int upstream_port, int ttl_ms);
+
+#endif // INDEX_PROXY_H
@@ -0,0 +1,165 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "jobqueue.h"
+
+static Job *jobs = NULL;           // Every job, in the order added
+static Job *last_job = NULL;
+static int next_id = 1;
+static int pending = 0;            // Jobs queued or running
+static JobRunner runner = NULL;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_changed = PTHREAD_COND_INITIALIZER;  // A job was added, finished or requeued
+
+// Picks the next job to run; call with queue_lock held
+// Parameters:
+// - now: Current time
+// - wake: Set to the earliest time a waiting retry becomes due, left alone if there is none
+// Returns the queued job with the highest priority that may run now, NULL if there is none
+static Job *next_job(time_t now, time_t *wake) {
+    Job *job, *best = NULL;
+
+    for (job = jobs; job != NULL; job = job->next) {
+        if (job->state != JOB_QUEUED) {
+            continue;
+        }
+        if (job->not_before > now) {
+            if (*wake == 0 || job->not_before < *wake) {
+                *wake = job->not_before;
+            }
+            continue;
+        }
+        // Strictly higher only, so the earliest added wins a tie
+        if (best == NULL || job->priority > best->priority) {
+            best = job;
+        }
+    }
+    return best;
+}
+
+// Worker thread: runs jobs until the process exits
+static void *worker_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&queue_lock);
+    while (1) {
+        time_t wake = 0;
+        Job *job = next_job(time(NULL), &wake);
+        if (job == NULL) {
+            if (wake != 0) {
+                struct timespec until = { wake, 0 };
+                pthread_cond_timedwait(&queue_changed, &queue_lock, &until);
+            } else {
+                pthread_cond_wait(&queue_changed, &queue_lock);
+            }
+            continue;
+        }
+
+        job->state = JOB_RUNNING;
+        job->attempts++;
+        pthread_mutex_unlock(&queue_lock);
+        int result = runner(job);
+        pthread_mutex_lock(&queue_lock);
+
+        if (result == 0) {
+            job->state = JOB_DONE;
+        } else if (job->attempts >= JOBQUEUE_MAX_ATTEMPTS) {
+            job->state = JOB_FAILED;
+        } else {
+            // Back off, so a peer that is briefly away gets the chance to come back
+            job->state = JOB_QUEUED;
+            job->not_before = time(NULL) + JOBQUEUE_RETRY_SEC * job->attempts;
+            pthread_cond_broadcast(&queue_changed);
+            continue;
+        }
+        pending--;
+        pthread_cond_broadcast(&queue_changed);
+    }
+    return NULL;
+}
+
+// Starts the worker threads
+// Parameters:
+// - workers: Jobs run at once, clamped to 1..JOBQUEUE_MAX_WORKERS
+// - run: Called on a worker thread for each run of a job
+// Returns the number of workers started, -1 if none could be
+int jobqueue_start(int workers, JobRunner run) {
+    int i, started = 0;
+
+    workers = workers < 1 ? 1 : workers > JOBQUEUE_MAX_WORKERS ? JOBQUEUE_MAX_WORKERS : workers;
+    runner = run;
+    for (i = 0; i < workers; i++) {
+        pthread_t thread_id;
+        if (pthread_create(&thread_id, NULL, worker_thread, NULL) == 0) {
+            pthread_detach(thread_id);
+            started++;
+        }
+    }
+    return started > 0 ? started : -1;
+}
+
+// Queues a job
+// Parameters:
+// - payload: What the runner gets; must stay valid for as long as the job is listed
+// - priority: Higher runs first
+// Returns the job's id, -1 if it couldn't be queued
+int jobqueue_add(void *payload, int priority) {
+    Job *job = calloc(1, sizeof(Job));
+    int id;
+
+    if (job == NULL) {
+        return -1;
+    }
+    job->priority = priority;
+    job->state = JOB_QUEUED;
+    job->payload = payload;
+
+    pthread_mutex_lock(&queue_lock);
+    id = job->id = next_id++;
+    if (last_job != NULL) {
+        last_job->next = job;
+    } else {
+        jobs = job;
+    }
+    last_job = job;
+    pending++;
+    pthread_cond_broadcast(&queue_changed);
+    pthread_mutex_unlock(&queue_lock);
+    return id;
+}
+
+// Calls visit for every job, in the order they were added
+// The queue is locked meanwhile, so visit must not add jobs
+// Parameters:
+// - visit: Called with each job
+// - arg: Passed on to visit
+void jobqueue_each(void (*visit)(const Job *job, void *arg), void *arg) {
+    Job *job;
+
+    pthread_mutex_lock(&queue_lock);
+    for (job = jobs; job != NULL; job = job->next) {
+        visit(job, arg);
+    }
+    pthread_mutex_unlock(&queue_lock);
+}
+
+// Waits until every job has either finished or been given up on
+void jobqueue_drain(void) {
+    pthread_mutex_lock(&queue_lock);
+    while (pending > 0) {
+        pthread_cond_wait(&queue_changed, &queue_lock);
+    }
+    pthread_mutex_unlock(&queue_lock);
+}
+
+// Names a job state for listings
+const char *jobqueue_state_name(JobState state) {
+    switch (state) {
+    case JOB_QUEUED:
+        return "queued";
+    case JOB_RUNNING:
+        return "running";
+    case JOB_DONE:
+        return "done";
+    default:
+        return "failed";
+    }
+}
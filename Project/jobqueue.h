@@ -0,0 +1,45 @@
+// jobqueue.h
+#ifndef JOBQUEUE_H
+#define JOBQUEUE_H
+
+#include <time.h>
+
+// Queue of background jobs, run by a fixed pool of worker threads.
+//
+// Jobs run highest priority first, and in the order they were added within a
+// priority. A job whose run fails goes back in the queue, behind
+// JOBQUEUE_RETRY_SEC times the attempts so far, until it has failed
+// JOBQUEUE_MAX_ATTEMPTS times. Finished jobs stay listed with their outcome.
+// What a job does is up to the runner given to jobqueue_start(); the queue
+// only hands each job's payload to it.
+
+#define JOBQUEUE_MAX_WORKERS 64     // Most jobs run at once
+#define JOBQUEUE_MAX_ATTEMPTS 3     // Runs before a job is given up on
+#define JOBQUEUE_RETRY_SEC 2        // Wait before a retry, per failed attempt
+
+typedef enum { JOB_QUEUED, JOB_RUNNING, JOB_DONE, JOB_FAILED } JobState;
+
+// A job
+// attempts: Runs started so far
+// not_before: Earliest time the job may run again after a failure
+// payload: The caller's description of the work
+typedef struct Job {
+    int id;
+    int priority;
+    JobState state;
+    int attempts;
+    time_t not_before;
+    void *payload;
+    struct Job *next;
+} Job;
+
+// Runs a job; returns 0 once it is done, -1 if it should be retried
+typedef int (*JobRunner)(Job *job);
+
+int jobqueue_start(int workers, JobRunner run);
+int jobqueue_add(void *payload, int priority);
+void jobqueue_each(void (*visit)(const Job *job, void *arg), void *arg);
+void jobqueue_drain(void);
+const char *jobqueue_state_name(JobState state);
+
+#endif // JOBQUEUE_H
@@ -0,0 +1,304 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "constants.h"
+#include "metrics.h"
+#include "p2p_log.h"
+
+#define METRICS_BODY_SIZE 65536
+
+// Counters owned by a single thread
+typedef struct {
+    _Atomic uint64_t requests[METRIC_PDU_TYPES];
+    _Atomic uint64_t errors[METRIC_PDU_TYPES];
+    _Atomic uint64_t latency[METRIC_PDU_TYPES][METRICS_LATENCY_BUCKETS + 1];
+    _Atomic uint64_t latency_sum_us[METRIC_PDU_TYPES];
+    _Atomic uint64_t limited[METRIC_PDU_TYPES];
+    _Atomic uint64_t shed[METRIC_PDU_TYPES];
+    _Atomic uint64_t bytes_received;
+    _Atomic uint64_t bytes_sent;
+} MetricsSlot;
+
+static const char *metric_names[METRIC_PDU_TYPES] = {
+    "REGISTER", "DEREGISTER", "SEARCH", "LIST_CONTENT", "DOWNLOAD", "REPORT", "QUERY", "SUMMARY", "SUBSCRIBE", "OTHER"
+};
+
+static MetricsSlot slots[METRICS_MAX_THREADS];
+static _Atomic int slots_used = 0;
+static MetricsSlot overflow_slot;   // Shared by threads beyond METRICS_MAX_THREADS
+static __thread MetricsSlot *my_slot = NULL;
+static const char *component_name = "p2p";
+
+// Adds to a counter owned by the calling thread
+// Parameters:
+// - counter: The counter to add to
+// - value: The amount to add
+static inline void slot_add(_Atomic uint64_t *counter, uint64_t value) {
+    if (my_slot == &overflow_slot) {
+        atomic_fetch_add_explicit(counter, value, memory_order_relaxed);
+        return;
+    }
+    // Single writer: a plain load and store is enough and avoids a locked add
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value,
+                          memory_order_relaxed);
+}
+
+// Returns the calling thread's slot, claiming one on first use
+static MetricsSlot *get_slot(void) {
+    if (my_slot == NULL) {
+        int index = atomic_fetch_add(&slots_used, 1);
+        my_slot = index < METRICS_MAX_THREADS ? &slots[index] : &overflow_slot;
+    }
+    return my_slot;
+}
+
+// Maps a PDU type to its metric index
+// Parameters:
+// - pdu_type: The PDU type character
+static int metric_index(char pdu_type) {
+    switch (pdu_type) {
+    case REGISTER: return METRIC_REGISTER;
+    case DEREGISTER: return METRIC_DEREGISTER;
+    case SEARCH: return METRIC_SEARCH;
+    case LIST_CONTENT: return METRIC_LIST_CONTENT;
+    case DOWNLOAD: return METRIC_DOWNLOAD;
+    case REPORT: return METRIC_REPORT;
+    case QUERY: return METRIC_QUERY;
+    case SUMMARY: return METRIC_SUMMARY;
+    case SUBSCRIBE: return METRIC_SUBSCRIBE;
+    default: return METRIC_OTHER;
+    }
+}
+
+// Maps a latency to its histogram bucket
+// Parameters:
+// - latency_us: Latency in microseconds
+static int latency_bucket(uint64_t latency_us) {
+    int bucket = 0;
+    while (bucket < METRICS_LATENCY_BUCKETS && latency_us > (1ULL << bucket)) {
+        bucket++;
+    }
+    return bucket;
+}
+
+// Sets the component label reported with every metric
+// Parameters:
+// - component: Name of the program, e.g. "index_server"
+void metrics_init(const char *component) {
+    component_name = component;
+}
+
+// Returns a monotonic timestamp in microseconds
+uint64_t metrics_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000;
+}
+
+// Records one handled request
+// Parameters:
+// - pdu_type: Type of the request PDU
+// - error: Non-zero if the request was answered with an error
+// - latency_us: Time spent handling the request in microseconds
+void metrics_request(char pdu_type, int error, uint64_t latency_us) {
+    MetricsSlot *slot = get_slot();
+    int index = metric_index(pdu_type);
+
+    slot_add(&slot->requests[index], 1);
+    if (error) {
+        slot_add(&slot->errors[index], 1);
+    }
+    slot_add(&slot->latency[index][latency_bucket(latency_us)], 1);
+    slot_add(&slot->latency_sum_us[index], latency_us);
+}
+
+// Records bytes moved on the network
+// Parameters:
+// - received: Bytes received
+// - sent: Bytes sent
+void metrics_bytes(uint64_t received, uint64_t sent) {
+    MetricsSlot *slot = get_slot();
+    if (received) {
+        slot_add(&slot->bytes_received, received);
+    }
+    if (sent) {
+        slot_add(&slot->bytes_sent, sent);
+    }
+}
+
+// Records a request refused before it was handled
+// Parameters:
+// - pdu_type: Type of the request PDU
+// - shed: Non-zero if it was shed for overload, zero if its source was over its rate limit
+void metrics_refused(char pdu_type, int shed) {
+    MetricsSlot *slot = get_slot();
+    int index = metric_index(pdu_type);
+
+    if (shed) {
+        slot_add(&slot->shed[index], 1);
+    } else {
+        slot_add(&slot->limited[index], 1);
+    }
+}
+
+// Sums one counter across every slot
+// Parameters:
+// - offset: Byte offset of the counter within MetricsSlot
+static uint64_t sum_counter(size_t offset) {
+    uint64_t total = 0;
+    int used = atomic_load(&slots_used), i;
+    if (used > METRICS_MAX_THREADS) {
+        used = METRICS_MAX_THREADS;
+    }
+    for (i = 0; i < used; i++) {
+        total += atomic_load_explicit((_Atomic uint64_t *)((char *)&slots[i] + offset), memory_order_relaxed);
+    }
+    total += atomic_load_explicit((_Atomic uint64_t *)((char *)&overflow_slot + offset), memory_order_relaxed);
+    return total;
+}
+
+#define SUM(field) sum_counter(offsetof(MetricsSlot, field))
+
+// Renders every metric in the Prometheus text exposition format
+// Parameters:
+// - body: Output buffer
+// - size: Size of the output buffer
+// Returns the length of the rendered text
+static size_t render_metrics(char *body, size_t size) {
+    size_t len = 0;
+    int i, b;
+
+#define EMIT(...) do { \
+        int n = snprintf(body + len, size - len, __VA_ARGS__); \
+        if (n > 0) len = (size_t)n < size - len ? len + (size_t)n : size - 1; \
+    } while (0)
+
+    EMIT("# HELP p2p_requests_total Requests handled, by PDU type.\n# TYPE p2p_requests_total counter\n");
+    for (i = 0; i < METRIC_PDU_TYPES; i++) {
+        EMIT("p2p_requests_total{component=\"%s\",type=\"%s\"} %llu\n", component_name, metric_names[i],
+             (unsigned long long)SUM(requests[i]));
+    }
+    EMIT("# HELP p2p_errors_total Requests answered with an error, by PDU type.\n# TYPE p2p_errors_total counter\n");
+    for (i = 0; i < METRIC_PDU_TYPES; i++) {
+        EMIT("p2p_errors_total{component=\"%s\",type=\"%s\"} %llu\n", component_name, metric_names[i],
+             (unsigned long long)SUM(errors[i]));
+    }
+    EMIT("# HELP p2p_rate_limited_total Requests refused because their source was over its rate limit.\n"
+         "# TYPE p2p_rate_limited_total counter\n");
+    for (i = 0; i < METRIC_PDU_TYPES; i++) {
+        EMIT("p2p_rate_limited_total{component=\"%s\",type=\"%s\"} %llu\n", component_name, metric_names[i],
+             (unsigned long long)SUM(limited[i]));
+    }
+    EMIT("# HELP p2p_shed_total Requests refused because the server was overloaded.\n# TYPE p2p_shed_total counter\n");
+    for (i = 0; i < METRIC_PDU_TYPES; i++) {
+        EMIT("p2p_shed_total{component=\"%s\",type=\"%s\"} %llu\n", component_name, metric_names[i],
+             (unsigned long long)SUM(shed[i]));
+    }
+    EMIT("# HELP p2p_bytes_received_total Bytes received.\n# TYPE p2p_bytes_received_total counter\n");
+    EMIT("p2p_bytes_received_total{component=\"%s\"} %llu\n", component_name, (unsigned long long)SUM(bytes_received));
+    EMIT("# HELP p2p_bytes_sent_total Bytes sent.\n# TYPE p2p_bytes_sent_total counter\n");
+    EMIT("p2p_bytes_sent_total{component=\"%s\"} %llu\n", component_name, (unsigned long long)SUM(bytes_sent));
+
+    EMIT("# HELP p2p_handler_latency_seconds Time spent handling a request, by PDU type.\n"
+         "# TYPE p2p_handler_latency_seconds histogram\n");
+    for (i = 0; i < METRIC_PDU_TYPES; i++) {
+        uint64_t cumulative = 0;
+        if (SUM(requests[i]) == 0) {
+            continue;
+        }
+        for (b = 0; b <= METRICS_LATENCY_BUCKETS; b++) {
+            cumulative += SUM(latency[i][b]);
+            if (b < METRICS_LATENCY_BUCKETS) {
+                EMIT("p2p_handler_latency_seconds_bucket{component=\"%s\",type=\"%s\",le=\"%g\"} %llu\n",
+                     component_name, metric_names[i], (double)(1ULL << b) / 1e6, (unsigned long long)cumulative);
+            } else {
+                EMIT("p2p_handler_latency_seconds_bucket{component=\"%s\",type=\"%s\",le=\"+Inf\"} %llu\n",
+                     component_name, metric_names[i], (unsigned long long)cumulative);
+            }
+        }
+        EMIT("p2p_handler_latency_seconds_sum{component=\"%s\",type=\"%s\"} %.6f\n", component_name,
+             metric_names[i], (double)SUM(latency_sum_us[i]) / 1e6);
+        EMIT("p2p_handler_latency_seconds_count{component=\"%s\",type=\"%s\"} %llu\n", component_name,
+             metric_names[i], (unsigned long long)cumulative);
+    }
+#undef EMIT
+    return len;
+}
+
+// Stats server thread: answers every connection with the current metrics
+// Parameters:
+// - arg: Listening socket descriptor
+static void *metrics_thread(void *arg) {
+    int sd = (int)(intptr_t)arg;
+    char *body = malloc(METRICS_BODY_SIZE);
+    char request[1024];
+
+    if (body == NULL) {
+        return NULL;
+    }
+    while (1) {
+        struct pollfd pfd;
+        const char *header = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n\r\n";
+        size_t len;
+        int new_sd = accept(sd, NULL, NULL);
+        if (new_sd < 0) {
+            continue;
+        }
+        // Consume an HTTP request if one is sent, but also answer a bare connect (nc)
+        pfd.fd = new_sd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 100) == 1) {
+            (void)read(new_sd, request, sizeof(request));
+        }
+        len = render_metrics(body, METRICS_BODY_SIZE);
+        write(new_sd, header, strlen(header));
+        write(new_sd, body, len);
+        close(new_sd);
+    }
+    return NULL;
+}
+
+// Starts the stats server on the loopback interface
+// Parameters:
+// - port: TCP port for the stats server
+// Returns 0 on success, -1 on failure
+int metrics_start_server(int port) {
+    struct sockaddr_in server;
+    pthread_t thread_id;
+    int sd, on = 1;
+
+    if ((sd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+        perror("Cannot create metrics socket");
+        return -1;
+    }
+    setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    bzero(&server, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+    server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(sd, (struct sockaddr *)&server, sizeof(server)) == -1 || listen(sd, 5) == -1) {
+        perror("Cannot bind metrics socket");
+        close(sd);
+        return -1;
+    }
+    if (pthread_create(&thread_id, NULL, metrics_thread, (void *)(intptr_t)sd) != 0) {
+        close(sd);
+        return -1;
+    }
+    pthread_detach(thread_id);
+    LOG_INFO("Metrics available on 127.0.0.1:%d", port);
+    return 0;
+}
@@ -0,0 +1,39 @@
+// metrics.h
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+// Request counters, byte counters and per-handler latency histograms.
+//
+// Every thread that records metrics gets its own slot, written only by that
+// thread with relaxed atomic stores, so recording never takes a lock or
+// bounces a cache line between threads. The exporter sums all slots when it
+// is scraped.
+
+#define METRICS_MAX_THREADS 128
+#define METRICS_LATENCY_BUCKETS 24   // Upper bounds 1us, 2us, 4us, ... 2^22us (~4s), then +Inf
+
+// Request kinds tracked separately, one per PDU type handled
+enum {
+    METRIC_REGISTER,
+    METRIC_DEREGISTER,
+    METRIC_SEARCH,
+    METRIC_LIST_CONTENT,
+    METRIC_DOWNLOAD,
+    METRIC_REPORT,
+    METRIC_QUERY,
+    METRIC_SUMMARY,
+    METRIC_SUBSCRIBE,
+    METRIC_OTHER,
+    METRIC_PDU_TYPES
+};
+
+void metrics_init(const char *component);
+int metrics_start_server(int port);
+void metrics_request(char pdu_type, int error, uint64_t latency_us);
+void metrics_bytes(uint64_t received, uint64_t sent);
+void metrics_refused(char pdu_type, int shed);
+uint64_t metrics_now_us(void);
+
+#endif // METRICS_H
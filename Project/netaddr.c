@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include "netaddr.h"
+
+// Extracts the address and port of a socket address, mapping IPv4 into IPv6
+// Parameters:
+// - sa: An AF_INET or AF_INET6 socket address
+// - addr: Filled with the 16-byte address
+// - port: Filled with the port in host order, if not NULL
+void netaddr_from_sockaddr(const struct sockaddr_storage *sa, struct in6_addr *addr, int *port) {
+    if (sa->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)sa;
+        *addr = sin6->sin6_addr;
+        if (port) {
+            *port = ntohs(sin6->sin6_port);
+        }
+    } else {
+        const struct sockaddr_in *sin = (const struct sockaddr_in *)sa;
+        memset(addr, 0, sizeof(*addr));
+        addr->s6_addr[10] = 0xff;
+        addr->s6_addr[11] = 0xff;
+        memcpy(&addr->s6_addr[12], &sin->sin_addr, 4);
+        if (port) {
+            *port = ntohs(sin->sin_port);
+        }
+    }
+}
+
+// Checks whether two socket addresses name the same endpoint
+// Returns 1 if they do, 0 otherwise
+int netaddr_same(const struct sockaddr_storage *a, const struct sockaddr_storage *b) {
+    struct in6_addr addr_a, addr_b;
+    int port_a, port_b;
+
+    netaddr_from_sockaddr(a, &addr_a, &port_a);
+    netaddr_from_sockaddr(b, &addr_b, &port_b);
+    return port_a == port_b && memcmp(&addr_a, &addr_b, sizeof(addr_a)) == 0;
+}
+
+// Converts an address to the family of a socket, so an IPv4 destination can be
+// reached from a dual-stack IPv6 socket
+// Parameters:
+// - sd: The socket that will send
+// - in: The destination
+// - out: Filled with the destination in the socket's family
+// Returns the length of out
+socklen_t netaddr_for_socket(int sd, const struct sockaddr_storage *in, struct sockaddr_storage *out) {
+    struct sockaddr_storage local;
+    socklen_t len = sizeof(local);
+
+    memcpy(out, in, sizeof(*out));
+    if (getsockname(sd, (struct sockaddr *)&local, &len) == 0 && local.ss_family == AF_INET6 &&
+        in->ss_family == AF_INET) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)out;
+        int port;
+        netaddr_from_sockaddr(in, &sin6->sin6_addr, &port);
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(port);
+        sin6->sin6_flowinfo = 0;
+        sin6->sin6_scope_id = 0;
+    }
+    return out->ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+}
+
+// Parses a numeric host: "10.0.0.1", "2001:db8::1" or "[2001:db8::1]"
+// Parameters:
+// - text: The host
+// - addr: Filled with the 16-byte address
+// Returns 0 on success, -1 if the text is not an address
+int netaddr_parse(const char *text, struct in6_addr *addr) {
+    char host[HOST_TEXT_SIZE];
+    struct in_addr v4;
+    size_t len = strlen(text);
+
+    if (text[0] == '[' && len >= 2 && text[len - 1] == ']' && len - 2 < sizeof(host)) {
+        memcpy(host, text + 1, len - 2);
+        host[len - 2] = '\0';
+        text = host;
+    }
+    if (inet_pton(AF_INET6, text, addr) == 1) {
+        return 0;
+    }
+    if (inet_pton(AF_INET, text, &v4) == 1) {
+        memset(addr, 0, sizeof(*addr));
+        addr->s6_addr[10] = 0xff;
+        addr->s6_addr[11] = 0xff;
+        memcpy(&addr->s6_addr[12], &v4, 4);
+        return 0;
+    }
+    return -1;
+}
+
+// Formats an address for a PDU: dotted for IPv4 peers, bracketed for IPv6 peers
+// Parameters:
+// - addr: The 16-byte address
+// - buf: Output buffer, HOST_TEXT_SIZE bytes is always enough
+// - size: Size of buf
+void netaddr_format(const struct in6_addr *addr, char *buf, size_t size) {
+    char text[INET6_ADDRSTRLEN];
+
+    if (IN6_IS_ADDR_V4MAPPED(addr)) {
+        inet_ntop(AF_INET, &addr->s6_addr[12], buf, size);
+        return;
+    }
+    inet_ntop(AF_INET6, addr, text, sizeof(text));
+    snprintf(buf, size, "[%s]", text);
+}
+
+// Splits "host:port" or "[v6 host]:port"; the port is optional
+// Parameters:
+// - text: The endpoint
+// - host: Filled with the host, without brackets
+// - host_size: Size of host
+// - port: Filled with the port if one is given, left alone otherwise
+// Returns 0 on success, -1 if the text is malformed
+int netaddr_split(const char *text, char *host, size_t host_size, int *port) {
+    const char *end, *colon;
+    size_t len;
+
+    if (text[0] == '[') {
+        if ((end = strchr(text, ']')) == NULL) {
+            return -1;
+        }
+        text++;
+        colon = end[1] == ':' ? end + 1 : NULL;
+    } else {
+        // A bare IPv6 literal has several colons and no port
+        colon = strchr(text, ':');
+        if (colon != NULL && strchr(colon + 1, ':') != NULL) {
+            colon = NULL;
+        }
+        end = colon ? colon : text + strlen(text);
+    }
+    len = end - text;
+    if (len == 0 || len >= host_size) {
+        return -1;
+    }
+    memcpy(host, text, len);
+    host[len] = '\0';
+    if (colon != NULL) {
+        *port = atoi(colon + 1);
+    }
+    return 0;
+}
+
+// Resolves a host name or literal of either family
+// Parameters:
+// - host: Name, IPv4 or IPv6 literal (brackets allowed)
+// - port: Port number
+// - socktype: SOCK_STREAM or SOCK_DGRAM
+// - out: Filled with the first address found
+// - len: Filled with the length of the address
+// Returns 0 on success, -1 if the host can't be resolved
+int netaddr_resolve(const char *host, int port, int socktype, struct sockaddr_storage *out, socklen_t *len) {
+    struct addrinfo hints, *result;
+    char name[HOST_TEXT_SIZE], service[16];
+    int dummy;
+
+    if (netaddr_split(host, name, sizeof(name), &dummy) == -1) {
+        return -1;
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = socktype;
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(name, service, &hints, &result) != 0) {
+        return -1;
+    }
+    memcpy(out, result->ai_addr, result->ai_addrlen);
+    *len = result->ai_addrlen;
+    freeaddrinfo(result);
+    return 0;
+}
+
+// Creates a socket bound to a port on every local address, IPv6 and IPv4
+// Falls back to IPv4 only when the host has no IPv6. Stream sockets get
+// SO_REUSEADDR so a restarted server can rebind while old connections linger.
+// Parameters:
+// - socktype: SOCK_STREAM or SOCK_DGRAM
+// - port: Port to bind, 0 for any
+// Returns the socket, or -1 on failure
+int netaddr_listen(int socktype, int port) {
+    struct sockaddr_in6 server6;
+    struct sockaddr_in server;
+    int sd, off = 0, on = 1;
+
+    if ((sd = socket(AF_INET6, socktype, 0)) != -1) {
+        setsockopt(sd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+        if (socktype == SOCK_STREAM) {
+            setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        }
+        memset(&server6, 0, sizeof(server6));
+        server6.sin6_family = AF_INET6;
+        server6.sin6_port = htons(port);
+        server6.sin6_addr = in6addr_any;
+        if (bind(sd, (struct sockaddr *)&server6, sizeof(server6)) == 0) {
+            return sd;
+        }
+        int err = errno;
+        close(sd);
+        if (err != EADDRNOTAVAIL && err != EAFNOSUPPORT) {
+            errno = err;
+            return -1;  // e.g. the port is taken; IPv4 would fail the same way
+        }
+    }
+
+    if ((sd = socket(AF_INET, socktype, 0)) == -1) {
+        return -1;
+    }
+    if (socktype == SOCK_STREAM) {
+        setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    }
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+    server.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(sd, (struct sockaddr *)&server, sizeof(server)) == -1) {
+        close(sd);
+        return -1;
+    }
+    return sd;
+}
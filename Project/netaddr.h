@@ -0,0 +1,28 @@
+// netaddr.h
+#ifndef NETADDR_H
+#define NETADDR_H
+
+#include <stddef.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+// Dual-stack address helpers.
+//
+// Peers are identified by a 16-byte IPv6 address, with IPv4 peers stored as
+// IPv4-mapped addresses (::ffff:a.b.c.d), so the index compares and copies
+// addresses as plain bytes. Text is produced only when an answer is
+// formatted: IPv4 peers appear as before ("10.0.0.1"), IPv6 peers in
+// brackets ("[2001:db8::1]") so "host:port" stays unambiguous.
+
+#define HOST_TEXT_SIZE (INET6_ADDRSTRLEN + 2)  // A host as it appears in PDUs, with brackets
+
+void netaddr_from_sockaddr(const struct sockaddr_storage *sa, struct in6_addr *addr, int *port);
+socklen_t netaddr_for_socket(int sd, const struct sockaddr_storage *in, struct sockaddr_storage *out);
+int netaddr_same(const struct sockaddr_storage *a, const struct sockaddr_storage *b);
+int netaddr_parse(const char *text, struct in6_addr *addr);
+void netaddr_format(const struct in6_addr *addr, char *buf, size_t size);
+int netaddr_split(const char *text, char *host, size_t host_size, int *port);
+int netaddr_resolve(const char *host, int port, int socktype, struct sockaddr_storage *out, socklen_t *len);
+int netaddr_listen(int socktype, int port);
+
+#endif // NETADDR_H
@@ -2,13 +2,25 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
 #include "constants.h"
+#include "metrics.h"
+#include "p2p_log.h"
+#include "bloom.h"
+#include "netaddr.h"
+#include "filewriter.h"
+#include "transfer.h"
+#include "chunkmac.h"
+#include "connpool.h"
+#include "jobqueue.h"
 #include <netdb.h>  
 
 // Function prototypes
@@ -23,6 +35,15 @@ typedef struct {
     char filename[100];
 } ServerArgs;
 
+// Structure to pass arguments to the watch thread
+// server_ip, server_port: Index server to subscribe to
+// prefix: Only changes to files starting with this are shown; empty for all
+typedef struct {
+    char server_ip[HOST_TEXT_SIZE];
+    int server_port;
+    char prefix[FILENAME_SIZE];
+} WatchArgs;
+
 // Structure for file registry to track active files, ports, and thread IDs
 // filename: Name of the registered file
 // port: Port where the file is being served
@@ -36,24 +57,92 @@ typedef struct {
 // Array to store active file servers
 FileRegistryEntry registry[MAX_ENTRIES];  // Array to store active file servers
 int registry_count = 0;                   // Track the number of registered files
+pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;  // Seeder threads look files up while the user registers
+
+#define SEEDER_MAX_CONNECTIONS 32  // Connections served at once, each on its own thread; more are served one request at a time
+#define PIPELINE_DEPTH 16          // DOWNLOAD requests a downloader keeps in flight on one connection
+
+// Structure to pass arguments to a connection thread
+// sd: The accepted connection
+// filename: The file the accepting port serves to legacy downloaders
+typedef struct {
+    int sd;
+    char filename[100];
+} ConnectionArgs;
+
+int active_connections = 0;  // Connection threads running
+pthread_mutex_t connections_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define SUMMARY_REFRESH_SEC 5      // Age after which the filename summary is refreshed before use
+#define SUMMARY_TIMEOUT_SEC 1      // Give up on the index's summary and just ask it instead
+
+BloomFilter filename_summary;             // Local copy of the index's filename Bloom filter
+time_t summary_fetched = 0;               // When filename_summary was last brought up to date
+pthread_mutex_t summary_lock = PTHREAD_MUTEX_INITIALIZER;  // Queued downloads search at the same time
+MacKey transfer_secret;                   // Registered with our files so downloaders can check our frames
 
 typedef struct {
-    char ip[INET_ADDRSTRLEN];
+    char ip[HOST_TEXT_SIZE];  // Without brackets, as netaddr_resolve takes it
     int port;
+    char token[MAC_TOKEN_SIZE];  // Key for checking the transfer, empty if the peer has none
 } IpPortTuple;
 
+// Measurements of one download, reported back to the index server
+// bytes: File bytes received
+// wire_bytes: Bytes read from the socket, less than bytes when the seeder compressed
+// connect_us: Time taken by connect(), a stand-in for the peer's RTT
+// elapsed_us: Time from connecting, or from the request on a reused connection, to the FINAL PDU
+// complete: 1 if the transfer finished without error
+typedef struct {
+    long long bytes;
+    long long wire_bytes;
+    uint64_t connect_us;
+    uint64_t elapsed_us;
+    int complete;
+} TransferStats;
+
+// A file to download and what its request carries
+// caps: TRANSFER_CAP_* bits offered
+// nonce, session: From the SEARCH answer's token, if it had one
+// file: Where the file is being written; its size is the seeder's announcement, for progress
+typedef struct {
+    char filename[100];
+    IpPortTuple peer;
+    int caps;
+    uint64_t nonce;
+    MacKey session;
+    TransferStats stats;
+    FileWriter file;
+} Download;
+
+#define DOWNLOAD_WORKERS 4    // Queued downloads run at once, unless P2P_DOWNLOADS says otherwise
+#define FAILOVER_PEERS 8      // Holders of a file a queued download tries per attempt
+
+// A queued download, the payload of its job
+// peer_name: Peer to ask first, "*" to take whoever holds the file
+// from_peer: Peer the latest attempt went to
+// server_ip, server_port, own_name: Where to look the file up and register it once downloaded
+typedef struct {
+    char peer_name[PEER_NAME_SIZE];
+    char from_peer[PEER_NAME_SIZE];
+    Download download;
+    const char *server_ip;
+    int server_port;
+    const char *own_name;
+} QueuedDownload;
+
 // Checks if a file is already registered
 // Parameters:
 // - filename: The name of the file to check
 // Returns 1 if the file is registered, 0 otherwise
 int is_file_registered(const char *filename) {
-    int i;
-    for (i = 0; i < registry_count; i++) {
-        if (strcmp(registry[i].filename, filename) == 0) {
-            return 1;  // File is already registered
-        }
+    int i, found = 0;
+    pthread_mutex_lock(&registry_lock);
+    for (i = 0; i < registry_count && !found; i++) {
+        found = strcmp(registry[i].filename, filename) == 0;
     }
-    return 0;
+    pthread_mutex_unlock(&registry_lock);
+    return found;
 }
 
 // Removes an entry from the registry
@@ -61,6 +150,7 @@ int is_file_registered(const char *filename) {
 // - filename: The name of the file to remove
 void remove_registry_entry(const char *filename) {
     int i, j;
+    pthread_mutex_lock(&registry_lock);
     for (i = 0; i < registry_count; i++) {
         if (strcmp(registry[i].filename, filename) == 0) {
             pthread_cancel(registry[i].thread_id);  // Cancel the thread serving the file
@@ -71,6 +161,7 @@ void remove_registry_entry(const char *filename) {
             break;
         }
     }
+    pthread_mutex_unlock(&registry_lock);
 }
 
 // Adds an entry to the registry
@@ -79,6 +170,7 @@ void remove_registry_entry(const char *filename) {
 // - port: The port number to serve the file
 // - thread_id: The ID of the thread serving the file
 void add_registry_entry(const char *filename, int port, pthread_t thread_id) {
+    pthread_mutex_lock(&registry_lock);
     if (registry_count < MAX_ENTRIES) {
         strncpy(registry[registry_count].filename, filename, sizeof(registry[registry_count].filename) - 1);
         registry[registry_count].port = port;
@@ -87,6 +179,7 @@ void add_registry_entry(const char *filename, int port, pthread_t thread_id) {
     } else {
         printf("Registry is full, cannot add more entries.\n");
     }
+    pthread_mutex_unlock(&registry_lock);
 }
 
 // Gets the port number for a given filename
@@ -120,12 +213,26 @@ void cleanup_on_exit(const char *server_ip, int server_port) {
 // Generates a random port number between 20000 and 65535
 // Returns a random port number
 int get_random_port() {
+    static int seeded = 0;
     int min_port = 20000;
     int max_port = 65535;
-    srand(time(NULL));
+    // Seed once; reseeding with time(NULL) hands out the same port twice within a second
+    if (!seeded) {
+        srand(time(NULL) ^ getpid());
+        seeded = 1;
+    }
     return min_port + rand() % (max_port - min_port + 1);
 }
 
+// Tells the user the index server refused a request for now
+// Parameters:
+// - response: The SLOW_DOWN answer, "<retry after ms> <reason>"
+void report_slow_down(const struct pdu *response) {
+    char *reason;
+    unsigned long retry_ms = strtoul(response->data, &reason, 10);
+    printf("Index server busy:%s Try again in %lu ms.\n", reason, retry_ms);
+}
+
 // Registers content with the index server
 // Parameters:
 // - server_ip: IP address of the index server
@@ -135,25 +242,30 @@ int get_random_port() {
 // - tcp_port: The port number to serve the file
 void register_content(const char *server_ip, int server_port, const char *peer_name, const char *filename, int tcp_port) {
     int sd;
-    struct sockaddr_in server;
+    struct sockaddr_storage server;
     struct pdu request, response;
     socklen_t server_len = sizeof(server);
 
+    // Resolve the index server, IPv4 or IPv6
+    if (netaddr_resolve(server_ip, server_port, SOCK_DGRAM, &server, &server_len) == -1) {
+        fprintf(stderr, "Cannot resolve index server %s\n", server_ip);
+        exit(1);
+    }
+
     // Create UDP socket
-    if ((sd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+    if ((sd = socket(server.ss_family, SOCK_DGRAM, 0)) == -1) {
         perror("Cannot create socket");
         exit(1);
     }
 
-    // Set up server address structure
-    bzero(&server, sizeof(server));
-    server.sin_family = AF_INET;
-    server.sin_port = htons(server_port);
-    inet_pton(AF_INET, server_ip, &server.sin_addr);
-
     // Prepare the registration request
     request.type = REGISTER;
     snprintf(request.data, sizeof(request.data), "%-10s %-10s %d", peer_name, filename, tcp_port);
+    if (mac_key_is_set(&transfer_secret)) {
+        char key[MAC_KEY_TEXT_SIZE];
+        mac_key_format(&transfer_secret, key);
+        snprintf(request.data + strlen(request.data), sizeof(request.data) - strlen(request.data), " key=%s", key);
+    }
 
     // Send the registration request to the index server
     sendto(sd, &request, sizeof(request), 0, (struct sockaddr *)&server, server_len);
@@ -171,6 +283,8 @@ void register_content(const char *server_ip, int server_port, const char *peer_n
     } else if (response.type == ERROR) {
         printf("Error during registration: %s\n", response.data);
         printf("Please choose a different peer name.\n");
+    } else if (response.type == SLOW_DOWN) {
+        report_slow_down(&response);
     } else {
         printf("Unexpected response from index server.\n");
     }
@@ -187,22 +301,22 @@ void register_content(const char *server_ip, int server_port, const char *peer_n
 // - client_port: Port number of the client
 void deregister_content(const char *server_ip, int server_port, const char *filename, int client_port) {
     int sd;
-    struct sockaddr_in server;
+    struct sockaddr_storage server;
     struct pdu request;
     socklen_t server_len = sizeof(server);
 
+    // Resolve the index server, IPv4 or IPv6
+    if (netaddr_resolve(server_ip, server_port, SOCK_DGRAM, &server, &server_len) == -1) {
+        fprintf(stderr, "Cannot resolve index server %s\n", server_ip);
+        exit(1);
+    }
+
     // Create UDP socket
-    if ((sd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+    if ((sd = socket(server.ss_family, SOCK_DGRAM, 0)) == -1) {
         perror("Cannot create socket");
         exit(1);
     }
 
-    // Set up server address structure
-    bzero(&server, sizeof(server));
-    server.sin_family = AF_INET;
-    server.sin_port = htons(server_port);
-    inet_pton(AF_INET, server_ip, &server.sin_addr);
-
     // Prepare the deregistration request
     request.type = DEREGISTER;
     snprintf(request.data, sizeof(request.data), "%s:%d", filename, client_port);
@@ -212,39 +326,143 @@ void deregister_content(const char *server_ip, int server_port, const char *file
     close(sd);
 }
 
+// Reads one whole request PDU; with pipelining the next one may follow right behind it
+// Parameters:
+// - sd: Connected socket with a receive timeout
+// - request: Filled with the request
+// Returns the bytes read, 0 if the peer closed or went idle first
+int read_request(int sd, struct pdu *request) {
+    size_t got = 0;
+    while (got < sizeof(*request)) {
+        ssize_t n = read(sd, (char *)request + got, sizeof(*request) - got);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        got += n;
+    }
+    return got;
+}
+
+// Serves the DOWNLOAD requests of one connection
+// A framed downloader names the file it wants and may send more requests on the same connection;
+// a legacy downloader gets own_file and the connection closes after it
+// Parameters:
+// - sd: Connected socket
+// - own_file: The file this seeder's port was started for
+// - keepalive: Whether to keep the connection for further requests
+void serve_connection(int sd, const char *own_file, int keepalive) {
+    struct timeval idle = { SEEDER_IDLE_SEC, 0 };
+    struct pdu request;
+    int n;
+
+    setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));  // Idle connections are dropped
+    while ((n = read_request(sd, &request)) > 0 && request.type == DOWNLOAD) {
+        uint64_t start = metrics_now_us();
+        uint64_t sent = 0;
+        request.data[sizeof(request.data) - 1] = '\0';
+        uint64_t nonce = 0;
+        int caps = transfer_parse_caps(request.data, &nonce);
+        if (caps & TRANSFER_CAP_FRAMES) {
+            char requested[FILENAME_SIZE + 1] = "";
+            int result;
+            sscanf(request.data, "%11s", requested);
+            LOG_DEBUG("File request received for: %s", requested);
+            // Framed downloader: compress if it asked to and we allow it
+            if (getenv("P2P_COMPRESS") && strcmp(getenv("P2P_COMPRESS"), "0") == 0) {
+                caps &= ~TRANSFER_CAP_DEFLATE;
+            }
+            if (!keepalive) {
+                caps &= ~TRANSFER_CAP_KEEPALIVE;
+            }
+            // Tag frames with the key the index gave the downloader for this nonce
+            MacKey session, *key = NULL;
+            if ((caps & TRANSFER_CAP_MAC) && mac_key_is_set(&transfer_secret)) {
+                mac_derive(&transfer_secret, nonce, &session);
+                key = &session;
+            }
+            // Any file this peer registered can be asked for, nothing else
+            if (strcmp(requested, own_file) != 0 && !is_file_registered(requested)) {
+                result = transfer_send_error(sd, caps, key, "File not found", &sent);
+            } else {
+                result = transfer_send_file(sd, requested, caps, getenv("P2P_CACHE_DIR"), key, &sent);
+            }
+            metrics_request(DOWNLOAD, result != 0, metrics_now_us() - start);
+            metrics_bytes(n, sent);
+            // A transfer cut off midway leaves the downloader waiting for frames, not able to send requests
+            if (result == -1 || !(caps & TRANSFER_CAP_KEEPALIVE)) {
+                break;
+            }
+            continue;
+        }
+        LOG_DEBUG("File request received for: %s", own_file);
+        FILE *file = fopen(own_file, "rb");
+        if (!file) {
+            LOG_WARN("File not found: %s: %s", own_file, strerror(errno));
+            struct pdu error_pdu = { ERROR, "File not found" };
+            write(sd, &error_pdu, sizeof(error_pdu));
+            metrics_request(DOWNLOAD, 1, metrics_now_us() - start);
+            metrics_bytes(n, sizeof(error_pdu));
+            break;
+        }
+
+        // Let the kernel read further ahead; the small PDUs below would otherwise trickle reads to the disk
+        posix_fadvise(fileno(file), 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        // Prepare and send the file in chunks
+        struct pdu file_pdu;
+        file_pdu.type = CONTENT_DATA;
+        while ((n = fread(file_pdu.data, 1, sizeof(file_pdu.data), file)) > 0) {
+            write(sd, &file_pdu, n + sizeof(file_pdu.type));  // Send only data read plus type
+            sent += n + sizeof(file_pdu.type);
+        }
+        fclose(file);
+
+        // Send final packet with only the type set to FINAL
+        struct pdu end_pdu = { FINAL, {0} };
+        write(sd, &end_pdu, sizeof(end_pdu.type));  // Send only the type
+        sent += sizeof(end_pdu.type);
+        metrics_request(DOWNLOAD, 0, metrics_now_us() - start);
+        metrics_bytes(sizeof(request), sent);
+        break;
+    }
+    close(sd);
+}
+
+// Connection thread function
+// Parameters:
+// - args: ConnectionArgs, freed here
+void *connection_thread(void *args) {
+    ConnectionArgs *connection = (ConnectionArgs *)args;
+    serve_connection(connection->sd, connection->filename, 1);
+    free(connection);
+    pthread_mutex_lock(&connections_lock);
+    active_connections--;
+    pthread_mutex_unlock(&connections_lock);
+    return NULL;
+}
+
 // Starts a TCP server to serve files to requesting peers
+// Each connection gets its own thread, so a downloader keeping its connection open doesn't hold up others
 // Parameters:
 // - port: The port number to serve the file
 // - filename: The name of the file to serve
 void start_tcp_server(int port, const char *filename) {
     int sd, new_sd;
-    struct sockaddr_in server, client;
-    struct pdu request;
+    struct sockaddr_storage client;
     socklen_t client_len;
-    int n;
-
-    // Create TCP socket
-    if ((sd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-        perror("Cannot create TCP socket");
-        exit(1);
-    }
-
-    // Set up server address structure
-    bzero(&server, sizeof(server));
-    server.sin_family = AF_INET;
-    server.sin_port = htons(port);
-    server.sin_addr.s_addr = htonl(INADDR_ANY);
 
-    // Bind the socket to the server address
-    if (bind(sd, (struct sockaddr *)&server, sizeof(server)) == -1) {
+    // Create a dual-stack TCP socket so IPv4 and IPv6 peers can download
+    if ((sd = netaddr_listen(SOCK_STREAM, port)) == -1) {
         perror("Cannot bind TCP socket");
-        close(sd);
         exit(1);
     }
 
     // Listen for incoming connections
     listen(sd, 5);
-    printf("\nMessage: TCP Server listening on port %d to serve file: %s\n", port, filename);
+    LOG_INFO("\nMessage: TCP Server listening on port %d to serve file: %s", port, filename);
 
     // Infinite loop to handle incoming connections
     while (1) {
@@ -252,104 +470,322 @@ void start_tcp_server(int port, const char *filename) {
         // Accept a connection from a client
         new_sd = accept(sd, (struct sockaddr *)&client, &client_len);
         if (new_sd < 0) {
-            perror("Accept failed");
+            LOG_WARN("Accept failed: %s", strerror(errno));
             continue;
         }
 
-        // Read the request from the client
-        if ((n = read(new_sd, &request, sizeof(request))) > 0 && request.type == DOWNLOAD) {
-            printf("File request received for: %s\n", filename);
-            FILE *file = fopen(filename, "rb");
-            if (!file) {
-                perror("File not found");
-                struct pdu error_pdu = { ERROR, "File not found" };
-                write(new_sd, &error_pdu, sizeof(error_pdu));
-                close(new_sd);
-                continue;
-            }
-
-            // Prepare and send the file in chunks
-            struct pdu file_pdu;
-            file_pdu.type = CONTENT_DATA;
-            while ((n = fread(file_pdu.data, 1, sizeof(file_pdu.data), file)) > 0) {
-                write(new_sd, &file_pdu, n + sizeof(file_pdu.type));  // Send only data read plus type
+        pthread_t thread_id;
+        ConnectionArgs *connection = NULL;
+        pthread_mutex_lock(&connections_lock);
+        if (active_connections < SEEDER_MAX_CONNECTIONS && (connection = malloc(sizeof(ConnectionArgs))) != NULL) {
+            connection->sd = new_sd;
+            strncpy(connection->filename, filename, sizeof(connection->filename) - 1);
+            connection->filename[sizeof(connection->filename) - 1] = '\0';
+            if (pthread_create(&thread_id, NULL, connection_thread, connection) == 0) {
+                pthread_detach(thread_id);
+                active_connections++;
+            } else {
+                free(connection);
+                connection = NULL;
             }
-            fclose(file);
-
-            // Send final packet with only the type set to FINAL
-            struct pdu end_pdu = { FINAL, {0} };
-            write(new_sd, &end_pdu, sizeof(end_pdu.type));  // Send only the type
         }
-        close(new_sd);
+        pthread_mutex_unlock(&connections_lock);
+        if (connection == NULL) {
+            // Too many connections already: serve this one request here and close
+            serve_connection(new_sd, filename, 0);
+        }
     }
     close(sd);
 }
 
-
-// Downloads a file from a peer
+// Connects to a peer's seeder
 // Parameters:
 // - peer_ip: IP address of the peer hosting the file
 // - peer_port: Port number of the peer
-// - filename: The name of the file to download
-void download_file(const char *peer_ip, int peer_port, const char *filename) {
+// - connect_us: Set to the time connect() took
+// Returns the connected socket, -1 if the peer can't be reached
+int connect_peer(const char *peer_ip, int peer_port, uint64_t *connect_us) {
     int sd;
-    struct sockaddr_in server;
-    struct pdu request, response;
-    int n;
+    struct sockaddr_storage server;
+    socklen_t server_len;
+    uint64_t start;
+
+    // Resolve the peer, IPv4 or IPv6
+    if (netaddr_resolve(peer_ip, peer_port, SOCK_STREAM, &server, &server_len) == -1) {
+        fprintf(stderr, "Cannot resolve peer %s\n", peer_ip);
+        return -1;
+    }
 
     // Create TCP socket
-    if ((sd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+    if ((sd = socket(server.ss_family, SOCK_STREAM, 0)) == -1) {
         perror("Cannot create TCP socket");
-        exit(1);
+        return -1;
     }
 
-    // Set up server address structure
-    bzero(&server, sizeof(server));
-    server.sin_family = AF_INET;
-    server.sin_port = htons(peer_port);
-    inet_pton(AF_INET, peer_ip, &server.sin_addr);
-
-    // Connect to the peer server
-    if (connect(sd, (struct sockaddr *)&server, sizeof(server)) == -1) {
+    // Connect to the peer server; a dead peer only fails this download, others may have the file
+    start = metrics_now_us();
+    if (connect(sd, (struct sockaddr *)&server, server_len) == -1) {
         perror("Cannot connect to peer server");
         close(sd);
-        exit(1);
+        return -1;
+    }
+    *connect_us = metrics_now_us() - start;
+    return sd;
+}
+
+// Fills in a download from its SEARCH answer
+// Parameters:
+// - download: Filled in
+// - filename: The name of the file to download
+// - peer: The SEARCH answer
+// Returns 0 on success, -1 if the answer's token is malformed
+int prepare_download(Download *download, const char *filename, const IpPortTuple *peer) {
+    memset(download, 0, sizeof(*download));
+    strncpy(download->filename, filename, sizeof(download->filename) - 1);
+    download->peer = *peer;
+    // Offer framed, compressed transfer and further requests on the connection; old seeders ignore the offer
+    download->caps = TRANSFER_CAP_FRAMES | TRANSFER_CAP_DEFLATE | TRANSFER_CAP_KEEPALIVE;
+    if (peer->token[0] != '\0') {
+        if (mac_token_parse(peer->token, &download->nonce, &download->session) == -1) {
+            printf("Error: Malformed transfer token from index server\n");
+            return -1;
+        }
+        download->caps |= TRANSFER_CAP_MAC;
     }
+    return 0;
+}
+
+// Sends the DOWNLOAD request for a file
+// Parameters:
+// - sd: Connected socket
+// - download: The file to ask for
+// Returns 0 on success, -1 if the request couldn't be sent
+int send_download_request(int sd, const Download *download) {
+    struct pdu request;
 
-    // Send a download request
     request.type = DOWNLOAD;
-    strncpy(request.data, filename, sizeof(request.data));
-    write(sd, &request, sizeof(request));
+    transfer_format_request(request.data, sizeof(request.data), download->filename, download->caps, download->nonce);
+    return write(sd, &request, sizeof(request)) == sizeof(request) ? 0 : -1;
+}
 
-    // Open a file to write the downloaded data
-    FILE *file = fopen(filename, "wb");
-    if (!file) {
+// Receives the answer to a DOWNLOAD request and saves the file
+// Parameters:
+// - sd: Connected socket the request was sent on
+// - download: The file asked for; its stats are filled in
+// Returns 1 if the answer ended cleanly and the seeder keeps the connection for more requests,
+// 0 if the connection is done with, -1 if the seeder closed it before answering at all
+int receive_download(int sd, Download *download) {
+    struct pdu response;
+    int n, keep = 0;
+    uint64_t start = metrics_now_us();
+    TransferStats *stats = &download->stats;
+
+    // The first byte tells a framed seeder (ACKNOWLEDGE) from a legacy one
+    if ((n = read(sd, &response.type, 1)) != 1) {
+        return -1;
+    }
+
+    // Write the download beside its final name; it is renamed into place once complete
+    FileWriter *file = &download->file;
+    if (file_writer_open(file, download->filename) == -1) {
         perror("Failed to open file for writing");
+        return 0;
+    }
+
+    if (response.type == ACKNOWLEDGE) {
+        char error[BUFLEN];
+        int accepted, result;
+        result = transfer_receive_file(sd, file, download->caps & TRANSFER_CAP_MAC ? &download->session : NULL, &accepted,
+                                       &stats->bytes, &stats->wire_bytes, error, sizeof(error));
+        // Only an answer that ended where the seeder meant it to leaves the connection in step
+        keep = result != -1 && (accepted & TRANSFER_CAP_KEEPALIVE);
+        if (result == 0) {
+            stats->complete = 1;
+        } else {
+            printf("Error: %s\n", error);
+            file_writer_abort(file);  // Remove incomplete file
+            return keep;
+        }
+    } else if (download->caps & TRANSFER_CAP_MAC) {
+        // Whoever answered can't prove it is the peer the index named
+        printf("Error: Seeder did not authenticate the transfer\n");
+        file_writer_abort(file);
+        return 0;
+    } else {
+        // Receive the file from the peer server; the first PDU's type byte is already in
+        n = read(sd, response.data, sizeof(response.data));
+        n = n < 0 ? 1 : n + 1;
+        do {
+            stats->wire_bytes += n;
+            if (response.type == CONTENT_DATA) {
+                int data_size = n - 1;
+                if (data_size > 0) {
+                    if (file_writer_write(file, response.data, data_size) == -1) {
+                        break;
+                    }
+                    stats->bytes += data_size;
+                }
+            } else if (response.type == FINAL) {
+                stats->complete = 1;
+                break;  // End of file transfer
+            } else if (response.type == ERROR) {
+                printf("Error: %s\n", response.data);
+                file_writer_abort(file);  // Remove incomplete file
+                return 0;
+            }
+            // Clear the response data to prevent residual data
+            memset(response.data, 0, sizeof(response.data));
+        } while ((n = read(sd, &response, sizeof(response))) > 0);
+    }
+    if (!stats->complete) {
+        // The peer went away mid-transfer
+        printf("Error: Transfer interrupted\n");
+        file_writer_abort(file);
+    } else if (file_writer_commit(file) == -1) {
+        printf("Error: Cannot save %s\n", download->filename);
+        stats->complete = 0;
+    } else {
+        printf("File transfer complete: %s\n", download->filename);
+        if (stats->wire_bytes < stats->bytes) {
+            printf("Received %lld bytes as %lld on the wire\n", stats->bytes, stats->wire_bytes);
+        }
+    }
+    stats->elapsed_us += metrics_now_us() - start;
+    return keep;
+}
+
+// Gets a connection to a download's peer, an idle one from the pool if there is one
+// Parameters:
+// - peer_name: Name the peer registered under
+// - download: The download; its connect time and elapsed time are started
+// - reused: Set to 1 if the connection came from the pool
+// Returns the connected socket, -1 if the peer can't be reached
+int open_download(const char *peer_name, Download *download, int *reused) {
+    int sd;
+
+    *reused = (sd = connpool_take(peer_name, download->peer.ip, &download->stats.connect_us)) != -1;
+    if (!*reused) {
+        if ((sd = connect_peer(download->peer.ip, download->peer.port, &download->stats.connect_us)) == -1) {
+            return -1;
+        }
+        download->stats.elapsed_us = download->stats.connect_us;  // Elapsed time runs from connecting
+    }
+    return sd;
+}
+
+// Downloads a file from a peer, over an idle connection to it if there is one
+// Parameters:
+// - peer_name: Name the peer registered under
+// - download: The file to download; its stats are filled in
+// Returns 1 if the file was saved, 0 otherwise
+int download_file(const char *peer_name, Download *download) {
+    int sd, reused, keep;
+
+    if ((sd = open_download(peer_name, download, &reused)) == -1) {
+        return 0;
+    }
+    if (send_download_request(sd, download) == -1 || (keep = receive_download(sd, download)) == -1) {
         close(sd);
-        return;
+        if (!reused) {
+            printf("Error: Transfer interrupted\n");
+            return 0;
+        }
+        // The seeder dropped the idle connection just as we used it; a fresh one will do
+        if ((sd = open_download(peer_name, download, &reused)) == -1) {
+            return 0;
+        }
+        if (send_download_request(sd, download) == -1 || (keep = receive_download(sd, download)) == -1) {
+            printf("Error: Transfer interrupted\n");
+            keep = 0;
+        }
     }
+    if (keep == 1) {
+        connpool_put(peer_name, download->peer.ip, sd, download->stats.connect_us);
+    } else {
+        close(sd);
+    }
+    return download->stats.complete;
+}
+
+// Downloads several files from one peer over as few connections as it takes
+// The first request goes alone; once the seeder accepts keepalive, up to PIPELINE_DEPTH further requests
+// are kept in flight, so no file waits a round trip for the one before it. If the connection breaks, the
+// rest of the files are asked for again on a fresh one.
+// Parameters:
+// - peer_name: Name the peer registered under
+// - downloads: The files; their stats are filled in
+// - count: Number of files
+void download_files(const char *peer_name, Download *downloads, int count) {
+    int next = 0;  // First file not yet received
+
+    while (next < count) {
+        int sd, reused, keep, sent;
 
-    // Receive the file from the peer server
-    while ((n = read(sd, &response, sizeof(response))) > 0) {
-        if (response.type == CONTENT_DATA) {
-            int data_size = n - 1;
-            if (data_size > 0) {
-                fwrite(response.data, 1, data_size, file);
+        if ((sd = open_download(peer_name, &downloads[next], &reused)) == -1) {
+            next++;  // Unreachable; the files after it may still come over a pooled connection
+            continue;
+        }
+        if (send_download_request(sd, &downloads[next]) == -1 || (keep = receive_download(sd, &downloads[next])) == -1) {
+            close(sd);
+            if (!reused) {
+                printf("Error: Transfer interrupted\n");
+                next++;
             }
-        } else if (response.type == FINAL) {
-            printf("File transfer complete\n");
-            break;  // End of file transfer
-        } else if (response.type == ERROR) {
-            printf("Error: %s\n", response.data);
-            fclose(file);
-            remove(filename);  // Remove incomplete file
-            break;
+            continue;  // A stale pooled connection is retried on a fresh one
+        }
+        sent = ++next;
+        while (keep == 1 && next < count) {
+            // Top the pipeline up with requests for files at the same address
+            while (sent < count && sent - next < PIPELINE_DEPTH &&
+                   strcmp(downloads[sent].peer.ip, downloads[next - 1].peer.ip) == 0 &&
+                   send_download_request(sd, &downloads[sent]) == 0) {
+                downloads[sent].stats.connect_us = downloads[next - 1].stats.connect_us;
+                sent++;
+            }
+            if (sent == next || (keep = receive_download(sd, &downloads[next])) == -1) {
+                break;  // The next file is elsewhere, or the seeder went away; start over from it
+            }
+            next++;
+        }
+        if (keep == 1 && sent == next) {
+            connpool_put(peer_name, downloads[next - 1].peer.ip, sd, downloads[next - 1].stats.connect_us);
+        } else {
+            close(sd);
         }
-        // Clear the response data to prevent residual data
-        memset(response.data, 0, sizeof(response.data));
     }
+}
+
+// Reports a completed download so the index server can rank the peer
+// The report is fire-and-forget: losing it only delays the peer's score
+// Parameters:
+// - server_ip: IP address of the index server
+// - server_port: Port number of the index server
+// - peer_name: The peer the file was downloaded from
+// - filename: The downloaded file
+// - stats: Measurements of the transfer
+void report_transfer(const char *server_ip, int server_port, const char *peer_name, const char *filename,
+                     const TransferStats *stats) {
+    int sd;
+    struct sockaddr_storage server;
+    socklen_t server_len;
+    struct pdu request;
 
-    fclose(file);
+    if (!stats->complete || stats->bytes == 0) {
+        return;
+    }
+    // Resolve the index server, IPv4 or IPv6
+    if (netaddr_resolve(server_ip, server_port, SOCK_DGRAM, &server, &server_len) == -1) {
+        return;
+    }
+
+    if ((sd = socket(server.ss_family, SOCK_DGRAM, 0)) == -1) {
+        return;
+    }
+
+    request.type = REPORT;
+    snprintf(request.data, sizeof(request.data), "%-10s %-10s %lld %llu %llu", peer_name, filename, stats->bytes,
+             (unsigned long long)stats->elapsed_us, (unsigned long long)stats->connect_us);
+    sendto(sd, &request, sizeof(request), 0, (struct sockaddr *)&server, server_len);
     close(sd);
 }
 
@@ -363,6 +799,95 @@ void *tcp_server_thread(void *args) {
     return NULL;
 }
 
+// Sends one SUMMARY request and waits for the answer
+// Parameters:
+// - sd: UDP socket with a receive timeout
+// - server: Address of the index server
+// - chunk: Chunk to fetch, or -1 for the header
+// - response: Filled with the answer
+// Returns 0 on success, -1 on failure
+int fetch_summary_part(int sd, struct sockaddr_storage *server, int chunk, struct pdu *response) {
+    struct pdu request;
+    socklen_t server_len = sizeof(*server);
+
+    request.type = SUMMARY;
+    snprintf(request.data, sizeof(request.data), "%u %d", filename_summary.version, chunk);
+    if (sendto(sd, &request, sizeof(request), 0, (struct sockaddr *)server, server_len) == -1 ||
+        recvfrom(sd, response, sizeof(*response), 0, (struct sockaddr *)server, &server_len) == -1 ||
+        response->type != SUMMARY) {
+        return -1;
+    }
+    return 0;
+}
+
+// Brings the local filename summary up to date, fetching only chunks that changed
+// Parameters:
+// - server_ip: IP address of the index server
+// - server_port: Port number of the index server
+// Returns 0 on success, -1 if the summary could not be fetched
+int refresh_summary(const char *server_ip, int server_port) {
+    int sd, chunk;
+    struct sockaddr_storage server;
+    socklen_t server_len;
+    struct pdu header, response;
+    struct timeval timeout = { SUMMARY_TIMEOUT_SEC, 0 };
+    uint32_t version;
+    int result = 0;
+
+    // Resolve the index server, IPv4 or IPv6
+    if (netaddr_resolve(server_ip, server_port, SOCK_DGRAM, &server, &server_len) == -1) {
+        return -1;
+    }
+
+    if ((sd = socket(server.ss_family, SOCK_DGRAM, 0)) == -1) {
+        return -1;
+    }
+    setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+
+    if (fetch_summary_part(sd, &server, -1, &header) == -1) {
+        close(sd);
+        return -1;
+    }
+    memcpy(&version, header.data, sizeof(version));
+
+    // Chunks fetched now may be newer than the header; they are stamped later and fetched again next time
+    for (chunk = 0; chunk < BLOOM_CHUNKS && result == 0; chunk++) {
+        if (!(header.data[BLOOM_PAYLOAD_OFFSET + chunk / 8] & (1 << (chunk % 8)))) {
+            continue;
+        }
+        if (fetch_summary_part(sd, &server, chunk, &response) == -1 ||
+            (unsigned char)response.data[4] != chunk) {
+            result = -1;
+            break;
+        }
+        memcpy(filename_summary.bits + chunk * BLOOM_CHUNK_SIZE, response.data + BLOOM_PAYLOAD_OFFSET, BLOOM_CHUNK_SIZE);
+    }
+    if (result == 0) {
+        filename_summary.version = ntohl(version);
+        summary_fetched = time(NULL);
+    }
+    close(sd);
+    return result;
+}
+
+// Checks the local filename summary before asking the index server
+// Parameters:
+// - server_ip: IP address of the index server
+// - server_port: Port number of the index server
+// - filename: The file about to be searched for
+// Returns 0 if nobody has registered the file, 1 if it may be registered
+int filename_may_exist(const char *server_ip, int server_port, const char *filename) {
+    int result = 1;  // With no usable summary, let the index decide
+
+    pthread_mutex_lock(&summary_lock);
+    if (time(NULL) - summary_fetched < SUMMARY_REFRESH_SEC || refresh_summary(server_ip, server_port) == 0) {
+        result = bloom_may_contain(&filename_summary, filename);
+    }
+    pthread_mutex_unlock(&summary_lock);
+    return result;
+}
+
 // Searches for a file and lists active peers with the file
 // Parameters:
 // - server_ip: IP address of the index server
@@ -371,23 +896,29 @@ void *tcp_server_thread(void *args) {
 // - filename: The name of the file to search
 IpPortTuple search_content(const char *server_ip, int server_port, const char *peer_name, const char *filename) {
     int sd;
-    struct sockaddr_in server;
+    struct sockaddr_storage server;
     struct pdu request, response;
     socklen_t server_len = sizeof(server);
-    IpPortTuple result = {"", -1};  // Initialize with default values indicating an error
+    IpPortTuple result = {"", -1, ""};  // Initialize with default values indicating an error
+
+    // Names nobody registered are answered locally, without a round trip
+    if (!filename_may_exist(server_ip, server_port, filename)) {
+        printf("Error: File not found.\n");
+        return result;
+    }
+
+    // Resolve the index server, IPv4 or IPv6
+    if (netaddr_resolve(server_ip, server_port, SOCK_DGRAM, &server, &server_len) == -1) {
+        fprintf(stderr, "Cannot resolve index server %s\n", server_ip);
+        return result;
+    }
 
     // Create UDP socket
-    if ((sd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+    if ((sd = socket(server.ss_family, SOCK_DGRAM, 0)) == -1) {
         perror("Cannot create socket");
         return result;
     }
 
-    // Set up server address structure
-    bzero(&server, sizeof(server));
-    server.sin_family = AF_INET;
-    server.sin_port = htons(server_port);
-    inet_pton(AF_INET, server_ip, &server.sin_addr);
-
     // Prepare the search request
     request.type = SEARCH;
     snprintf(request.data, sizeof(request.data), "%-10s %-10s", peer_name, filename);
@@ -403,13 +934,17 @@ IpPortTuple search_content(const char *server_ip, int server_port, const char *p
     if (recvfrom(sd, &response, sizeof(response), 0, (struct sockaddr *)&server, &server_len) == -1) {
         perror("Failed to receive response");
     } else if (response.type == SEARCH) {
-        // Parse IP and port from the response data
-        char ip[INET_ADDRSTRLEN];
-        int port;
-
-        if (sscanf(response.data, "%15[^:]:%d", ip, &port) == 2) {
+        // Parse the host and port from the response data; IPv6 hosts come in brackets
+        int port = -1;
+        char *token;
+
+        response.data[sizeof(response.data) - 1] = '\0';
+        if ((token = strchr(response.data, ' ')) != NULL) {
+            *token++ = '\0';
+            snprintf(result.token, sizeof(result.token), "%s", token);
+        }
+        if (netaddr_split(response.data, result.ip, sizeof(result.ip), &port) == 0 && port != -1) {
             // Successfully parsed IP and port, set the result
-            strncpy(result.ip, ip, sizeof(result.ip));
             result.port = port;
             //printf("Found peer: IP = %s, Port = %d\n", result.ip, result.port);
         } else {
@@ -417,6 +952,8 @@ IpPortTuple search_content(const char *server_ip, int server_port, const char *p
         }
     } else if (response.type == ERROR) {
         printf("Error: %s\n", response.data);
+    } else if (response.type == SLOW_DOWN) {
+        report_slow_down(&response);
     }
 
     close(sd);
@@ -430,22 +967,22 @@ IpPortTuple search_content(const char *server_ip, int server_port, const char *p
 // - server_port: Port number of the index server
 void list_content(const char *server_ip, int server_port) {
     int sd;
-    struct sockaddr_in server;
+    struct sockaddr_storage server;
     struct pdu request, response;
     socklen_t server_len = sizeof(server);
 
+    // Resolve the index server, IPv4 or IPv6
+    if (netaddr_resolve(server_ip, server_port, SOCK_DGRAM, &server, &server_len) == -1) {
+        fprintf(stderr, "Cannot resolve index server %s\n", server_ip);
+        exit(1);
+    }
+
     // Create UDP socket
-    if ((sd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+    if ((sd = socket(server.ss_family, SOCK_DGRAM, 0)) == -1) {
         perror("Cannot create socket");
         exit(1);
     }
 
-    // Set up server address structure
-    bzero(&server, sizeof(server));
-    server.sin_family = AF_INET;
-    server.sin_port = htons(server_port);
-    inet_pton(AF_INET, server_ip, &server.sin_addr);
-
     // Prepare the search request
     request.type = LIST_CONTENT;
 
@@ -463,18 +1000,381 @@ void list_content(const char *server_ip, int server_port) {
         printf("Peers with files %s\n", response.data);
     } else if (response.type == ERROR) {
         printf("Error: %s\n", response.data);
+    } else if (response.type == SLOW_DOWN) {
+        report_slow_down(&response);
     }
 
     close(sd);
 }
 
+// Finds files matching a pattern, fetching the answer a page at a time
+// Parameters:
+// - server_ip: IP address of the index server
+// - server_port: Port number of the index server
+// - peer_glob: Pattern for peer names, "*" for any peer
+// - file_glob: Pattern for filenames, e.g. "abc*" for a prefix search
+void query_content(const char *server_ip, int server_port, const char *peer_glob, const char *file_glob) {
+    int sd;
+    struct sockaddr_storage server;
+    struct pdu request, response;
+    socklen_t server_len = sizeof(server);
+    char after_file[FILENAME_SIZE] = "";
+    char after_peer[PEER_NAME_SIZE] = "";
+    int more = 1;
+
+    // Resolve the index server, IPv4 or IPv6
+    if (netaddr_resolve(server_ip, server_port, SOCK_DGRAM, &server, &server_len) == -1) {
+        fprintf(stderr, "Cannot resolve index server %s\n", server_ip);
+        return;
+    }
+
+    // Create UDP socket
+    if ((sd = socket(server.ss_family, SOCK_DGRAM, 0)) == -1) {
+        perror("Cannot create socket");
+        return;
+    }
+
+    while (more) {
+        // Each page resumes after the last entry of the previous one
+        request.type = QUERY;
+        snprintf(request.data, sizeof(request.data), "%s %s %s %s", peer_glob, file_glob, after_file, after_peer);
+        if (sendto(sd, &request, sizeof(request), 0, (struct sockaddr *)&server, server_len) == -1) {
+            perror("Failed to send query request");
+            break;
+        }
+        if (recvfrom(sd, &response, sizeof(response), 0, (struct sockaddr *)&server, &server_len) == -1) {
+            perror("Failed to receive response");
+            break;
+        }
+        if (response.type == ERROR) {
+            printf("Error: %s\n", response.data);
+            break;
+        }
+        if (response.type == SLOW_DOWN) {
+            report_slow_down(&response);
+            break;
+        }
+        if (response.type != QUERY) {
+            break;
+        }
+
+        more = response.data[0] == '+';
+        if (response.data[2] != '\0') {
+            printf("%s\n", response.data + 2);
+        }
+
+        // The cursor is the last entry: "peer:file:ip:port"
+        char *last = strrchr(response.data, ',');
+        last = last ? last + 2 : response.data + 2;
+        if (sscanf(last, "%10[^:]:%10[^:]", after_peer, after_file) != 2) {
+            break;
+        }
+    }
+
+    close(sd);
+}
+
+// Finds the peers holding a file, so a download can fail over to them
+// Parameters:
+// - server_ip: IP address of the index server
+// - server_port: Port number of the index server
+// - filename: The file
+// - holders: Filled with the peers' names
+// - max: Size of holders
+// Returns the number of peers found
+int find_holders(const char *server_ip, int server_port, const char *filename, char holders[][PEER_NAME_SIZE], int max) {
+    int sd, count = 0, more = 1;
+    struct sockaddr_storage server;
+    struct pdu request, response;
+    socklen_t server_len = sizeof(server);
+    struct timeval timeout = { SUMMARY_TIMEOUT_SEC, 0 };
+    char after_peer[PEER_NAME_SIZE] = "";
+
+    if (netaddr_resolve(server_ip, server_port, SOCK_DGRAM, &server, &server_len) == -1 ||
+        (sd = socket(server.ss_family, SOCK_DGRAM, 0)) == -1) {
+        return 0;
+    }
+    setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    // The filename is an exact pattern, so every entry is "peer:filename:ip:port"
+    while (more && count < max) {
+        char *entry;
+        int before = count;
+        request.type = QUERY;
+        snprintf(request.data, sizeof(request.data), "* %s %s %s", filename, after_peer[0] ? filename : "", after_peer);
+        if (sendto(sd, &request, sizeof(request), 0, (struct sockaddr *)&server, server_len) == -1 ||
+            recvfrom(sd, &response, sizeof(response), 0, (struct sockaddr *)&server, &server_len) == -1 ||
+            response.type != QUERY) {
+            break;
+        }
+        response.data[sizeof(response.data) - 1] = '\0';
+        more = response.data[0] == '+';
+        for (entry = strtok(response.data + 2, ", "); entry != NULL && count < max; entry = strtok(NULL, ", ")) {
+            if (sscanf(entry, "%10[^:]", holders[count]) == 1) {
+                snprintf(after_peer, sizeof(after_peer), "%s", holders[count++]);
+            }
+        }
+        if (count == before) {
+            break;  // Nothing new, so no cursor to resume from
+        }
+    }
+    close(sd);
+    return count;
+}
+
+// Watches the index for changes, printing each one as it is pushed
+// Missed notifications are detected by sequence number, on arrival or when the
+// subscription is renewed, and repaired by listing the matching entries again.
+// Parameters:
+// - args: WatchArgs (heap allocated, freed here)
+void *watch_thread(void *args) {
+    WatchArgs watch = *(WatchArgs *)args;
+    int sd;
+    struct sockaddr_storage server;
+    struct pdu request, message;
+    struct timeval timeout = { 1, 0 };
+    socklen_t server_len;
+    char pattern[FILENAME_SIZE + 1];
+    unsigned int expected = 0, seq;
+    int synced = 0;
+    time_t renew = 0;
+    free(args);
+
+    // Resolve the index server, IPv4 or IPv6
+    if (netaddr_resolve(watch.server_ip, watch.server_port, SOCK_DGRAM, &server, &server_len) == -1) {
+        fprintf(stderr, "Cannot resolve index server %s\n", watch.server_ip);
+        return NULL;
+    }
+
+    if ((sd = socket(server.ss_family, SOCK_DGRAM, 0)) == -1) {
+        perror("Cannot create socket");
+        return NULL;
+    }
+    setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    snprintf(pattern, sizeof(pattern), "%s*", watch.prefix);
+
+    request.type = SUBSCRIBE;
+    snprintf(request.data, sizeof(request.data), "%s", watch.prefix);
+
+    while (1) {
+        // Renew well inside the lease; the answer also tells us if anything was lost
+        if (time(NULL) >= renew) {
+            sendto(sd, &request, sizeof(request), 0, (struct sockaddr *)&server, sizeof(server));
+            renew = time(NULL) + SUBSCRIPTION_LEASE_SEC / 3;
+        }
+
+        server_len = sizeof(server);
+        if (recvfrom(sd, &message, sizeof(message), 0, (struct sockaddr *)&server, &server_len) == -1) {
+            continue;
+        }
+        if (message.type == ACKNOWLEDGE && sscanf(message.data, "%u", &seq) == 1) {
+            if (!synced || seq != expected) {
+                if (synced) {
+                    printf("[watch] Missed changes, resynchronising\n");
+                }
+                expected = seq;
+                synced = 1;
+                printf("[watch] Files matching %s:\n", pattern);
+                query_content(watch.server_ip, watch.server_port, "*", pattern);
+            }
+        } else if (message.type == NOTIFY && synced) {
+            char change[BUFLEN];
+            if (sscanf(message.data, "%u %255s", &seq, change) != 2 || (int)(seq - expected) < 0) {
+                continue;  // Malformed, or a duplicate of something already shown
+            }
+            if (seq != expected) {
+                printf("[watch] Missed changes, resynchronising\n");
+                synced = 0;
+                renew = 0;
+                continue;
+            }
+            expected++;
+            printf("[watch] %s\n", change);
+        } else if (message.type == ERROR) {
+            printf("[watch] Error: %s\n", message.data);
+            break;
+        }
+        fflush(stdout);
+    }
+
+    close(sd);
+    return NULL;
+}
+
+// Reports a download to the index server, then registers the file and starts seeding it
+// Parameters:
+// - server_ip: IP address of the index server
+// - server_port: Port number of the index server
+// - peer_name: Our own peer name
+// - from_peer_name: The peer the file was downloaded from
+// - download: The finished download
+void seed_download(const char *server_ip, int server_port, const char *peer_name, const char *from_peer_name,
+                   const Download *download) {
+    report_transfer(server_ip, server_port, from_peer_name, download->filename, &download->stats);
+
+    int port = get_random_port();
+
+    register_content(server_ip, server_port, peer_name, download->filename, port);
+
+    pthread_t thread_id;
+    ServerArgs *args = malloc(sizeof(ServerArgs));
+    args->port = port;
+    strncpy(args->filename, download->filename, sizeof(args->filename) - 1);
+    pthread_create(&thread_id, NULL, tcp_server_thread, args);
+    pthread_detach(thread_id);
+
+    add_registry_entry(download->filename, port, thread_id);
+}
+
+// Tries one holder of a queued download's file
+// Parameters:
+// - queued: The download
+// - holder: The peer to ask
+// Returns 1 if the file was downloaded and is now seeded, 0 otherwise
+int try_holder(QueuedDownload *queued, const char *holder) {
+    char filename[sizeof(queued->download.filename)];
+
+    snprintf(filename, sizeof(filename), "%s", queued->download.filename);
+    IpPortTuple peer = search_content(queued->server_ip, queued->server_port, holder, filename);
+    if (peer.port == -1 || prepare_download(&queued->download, filename, &peer) == -1) {
+        return 0;
+    }
+    snprintf(queued->from_peer, sizeof(queued->from_peer), "%s", holder);
+    if (!download_file(holder, &queued->download)) {
+        return 0;
+    }
+    seed_download(queued->server_ip, queued->server_port, queued->own_name, holder, &queued->download);
+    return 1;
+}
+
+// Runs a queued download on a worker thread
+// The peer asked for goes first; if it fails, every other peer the index lists for the file is tried in turn
+// Parameters:
+// - job: The job; its payload is a QueuedDownload
+// Returns 0 once the file is downloaded, -1 to have the queue retry later
+int run_queued_download(Job *job) {
+    QueuedDownload *queued = job->payload;
+    char holders[FAILOVER_PEERS][PEER_NAME_SIZE];
+    int count, i, j;
+
+    if (strcmp(queued->peer_name, "*") != 0 && try_holder(queued, queued->peer_name)) {
+        return 0;
+    }
+    count = find_holders(queued->server_ip, queued->server_port, queued->download.filename, holders, FAILOVER_PEERS);
+    for (i = 0; i < count; i++) {
+        // Skip ourselves, the peer already tried, and peers that registered the file twice
+        int tried = strcmp(holders[i], queued->own_name) == 0 || strcmp(holders[i], queued->peer_name) == 0;
+        for (j = 0; j < i && !tried; j++) {
+            tried = strcmp(holders[i], holders[j]) == 0;
+        }
+        if (!tried && try_holder(queued, holders[i])) {
+            return 0;
+        }
+    }
+    printf("Error: No peer could provide %s (attempt %d of %d)\n", queued->download.filename, job->attempts,
+           JOBQUEUE_MAX_ATTEMPTS);
+    return -1;
+}
+
+// Queues a download
+// Parameters:
+// - server_ip: IP address of the index server
+// - server_port: Port number of the index server
+// - own_name: Our own peer name
+// - peer_name: Peer to ask first, "*" for any holder
+// - filename: The file to download
+// - priority: Higher runs first
+void queue_download(const char *server_ip, int server_port, const char *own_name, const char *peer_name,
+                    const char *filename, int priority) {
+    QueuedDownload *queued = calloc(1, sizeof(QueuedDownload));
+    int id;
+
+    if (queued == NULL) {
+        printf("Error: Cannot queue %s\n", filename);
+        return;
+    }
+    snprintf(queued->peer_name, sizeof(queued->peer_name), "%s", peer_name);
+    snprintf(queued->download.filename, sizeof(queued->download.filename), "%s", filename);
+    queued->server_ip = server_ip;
+    queued->server_port = server_port;
+    queued->own_name = own_name;
+    if ((id = jobqueue_add(queued, priority)) == -1) {
+        printf("Error: Cannot queue %s\n", filename);
+        free(queued);
+        return;
+    }
+    printf("Queued download %d: %s\n", id, filename);
+}
+
+// Checks whether a job is a queued or running download of a file
+// Parameters:
+// - job: The job
+// - arg: The filename; set to NULL on a match
+void match_pending(const Job *job, void *arg) {
+    const char **filename = arg;
+    const QueuedDownload *queued = job->payload;
+
+    if (*filename != NULL && (job->state == JOB_QUEUED || job->state == JOB_RUNNING) &&
+        strcmp(queued->download.filename, *filename) == 0) {
+        *filename = NULL;
+    }
+}
+
+// Checks whether a file is already queued, since two downloads of it would write the same file
+// Parameters:
+// - filename: The file
+// Returns 1 if a download of it is queued or running, 0 otherwise
+int is_download_pending(const char *filename) {
+    const char *match = filename;
+    jobqueue_each(match_pending, &match);
+    return match == NULL;
+}
+
+// Prints one line of the job listing
+// Parameters:
+// - job: The job
+// - arg: Unused
+void print_job(const Job *job, void *arg) {
+    const QueuedDownload *queued = job->payload;
+    long long bytes = queued->download.stats.bytes, size = queued->download.file.size;
+
+    (void)arg;
+    printf("%4d %-8s %4d  %-10s %-10s", job->id, jobqueue_state_name(job->state), job->priority,
+           queued->download.filename, queued->from_peer[0] ? queued->from_peer : "-");
+    if (job->state == JOB_RUNNING && size > 0) {
+        printf("  %lld/%lld bytes (%lld%%)", bytes, size, bytes * 100 / size);
+    } else if (job->state != JOB_QUEUED) {
+        printf("  %lld bytes", bytes);
+    }
+    if (job->attempts > 1) {
+        printf("  attempt %d", job->attempts);
+    }
+    printf("\n");
+}
+
 // Entry point of the P2P client
 // Parameters:
 // - argc: Number of command-line arguments
 // - argv: Array of command-line arguments
 int main(int argc, char *argv[]) {
     if (argc < 3) {
-        fprintf(stderr, "Usage: %s <index_server_ip> <index_server_port>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <index_server_ip> <index_server_port> [metrics_port]\n", argv[0]);
+        exit(1);
+    }
+
+    // Seeder threads log through the async ring; P2P_LOG_LEVEL picks the level
+    int level = getenv("P2P_LOG_LEVEL") ? log_parse_level(getenv("P2P_LOG_LEVEL")) : -1;
+    log_init(level != -1 ? level : LOG_LEVEL_INFO);
+
+    // Downloaders check our frames against a secret we register with the index; P2P_MAC=0 opts out
+    if (!(getenv("P2P_MAC") && strcmp(getenv("P2P_MAC"), "0") == 0) && mac_key_random(&transfer_secret) == -1) {
+        LOG_WARN("No random source, transfers will not be authenticated");
+    }
+
+    // Optionally expose the seeders' download counters in Prometheus text format
+    metrics_init("peer");
+    if (argc > 3 && metrics_start_server(atoi(argv[3])) == -1) {
         exit(1);
     }
 
@@ -486,9 +1386,16 @@ int main(int argc, char *argv[]) {
     char *index_server_ip = argv[1];
     int index_server_port = atoi(argv[2]);
 
+    // Downloads run in the background, P2P_DOWNLOADS at a time
+    int workers = getenv("P2P_DOWNLOADS") ? atoi(getenv("P2P_DOWNLOADS")) : DOWNLOAD_WORKERS;
+    if (jobqueue_start(workers, run_queued_download) == -1) {
+        perror("Cannot start download workers");
+        exit(1);
+    }
+
     char command[20];
     while (1) {
-        printf("\nEnter a command (register, download, list, search, deregister, or exit): ");
+        printf("\nEnter a command (register, download, queue, jobs, mirror, list, search, find, watch, deregister, or exit): ");
         scanf("%s", command);
 
         if (strcmp(command, "register") == 0) {
@@ -528,21 +1435,65 @@ int main(int argc, char *argv[]) {
             printf("Enter filename to download: ");
             scanf("%s", filename);
 
-            IpPortTuple ipAndPort = search_content(index_server_ip, index_server_port, download_from_peer_name, filename);
-            download_file(ipAndPort.ip, ipAndPort.port, filename);
+            // Fetched in the background; "jobs" shows how it is going
+            if (is_download_pending(filename)) {
+                printf("%s is already queued.\n", filename);
+                continue;
+            }
+            queue_download(index_server_ip, index_server_port, peer_name, download_from_peer_name, filename, 0);
 
-            int port = get_random_port();
+        } else if (strcmp(command, "queue") == 0) {
+            char filename[100];
+            char download_from_peer_name[PEER_NAME_SIZE];
+            int priority;
 
-            register_content(index_server_ip, index_server_port, peer_name, filename, port);
+            printf("Enter peer name to download from (* for any peer): ");
+            scanf("%10s", download_from_peer_name);
+            printf("Enter priority (higher runs first): ");
+            if (scanf("%d", &priority) != 1) {
+                priority = 0;
+            }
+            printf("Enter filenames to download, then . to finish: ");
+            while (scanf("%99s", filename) == 1 && strcmp(filename, ".") != 0) {
+                if (is_download_pending(filename)) {
+                    printf("%s is already queued.\n", filename);
+                    continue;
+                }
+                queue_download(index_server_ip, index_server_port, peer_name, download_from_peer_name, filename,
+                               priority);
+            }
 
-            pthread_t thread_id;
-            ServerArgs *args = malloc(sizeof(ServerArgs));
-            args->port = port;
-            strncpy(args->filename, filename, sizeof(args->filename) - 1);
-            pthread_create(&thread_id, NULL, tcp_server_thread, args);
-            pthread_detach(thread_id);
+        } else if (strcmp(command, "jobs") == 0) {
+            printf("  id state    prio  file       peer\n");
+            jobqueue_each(print_job, NULL);
 
-            add_registry_entry(filename, port, thread_id);
+        } else if (strcmp(command, "mirror") == 0) {
+            char filename[100];
+            char download_from_peer_name[PEER_NAME_SIZE];
+            Download *downloads = NULL;
+            int count = 0, i;
+
+            printf("Enter peer name to download from: ");
+            scanf("%s", download_from_peer_name);
+            printf("Enter filenames to download, then . to start: ");
+            while (scanf("%99s", filename) == 1 && strcmp(filename, ".") != 0) {
+                IpPortTuple ipAndPort = search_content(index_server_ip, index_server_port, download_from_peer_name, filename);
+                Download *grown = realloc(downloads, (count + 1) * sizeof(Download));
+                if (grown == NULL) {
+                    break;
+                }
+                downloads = grown;
+                if (ipAndPort.port != -1 && prepare_download(&downloads[count], filename, &ipAndPort) == 0) {
+                    count++;
+                }
+            }
+
+            // All the files come from the one peer, so they share its connections
+            download_files(download_from_peer_name, downloads, count);
+            for (i = 0; i < count; i++) {
+                seed_download(index_server_ip, index_server_port, peer_name, download_from_peer_name, &downloads[i]);
+            }
+            free(downloads);
 
         } else if (strcmp(command, "deregister") == 0) {
             char filename[100];
@@ -576,13 +1527,54 @@ int main(int argc, char *argv[]) {
             printf("%s %d %s %s\n", ipAndPort.ip, ipAndPort.port, search_from_peer_name, filename);
 
 
+        } else if (strcmp(command, "find") == 0) {
+            char file_glob[FILENAME_SIZE];
+            char peer_glob[PEER_NAME_SIZE];
+
+            printf("Enter filename pattern (e.g. abc* or *.txt): ");
+            scanf("%10s", file_glob);
+
+            printf("Enter peer name pattern (* for any peer): ");
+            scanf("%10s", peer_glob);
+
+            // List every holder of every matching file
+            query_content(index_server_ip, index_server_port, peer_glob, file_glob);
+
+        } else if (strcmp(command, "watch") == 0) {
+            static int watching = 0;
+            char prefix[FILENAME_SIZE];
+
+            printf("Enter filename prefix to watch (* for all files): ");
+            scanf("%10s", prefix);
+            if (watching) {
+                printf("Already watching for changes.\n");
+                continue;
+            }
+
+            // Changes are printed as "+peer:file:ip:port" or "-peer:file:ip:port" as they happen
+            WatchArgs *args = malloc(sizeof(WatchArgs));
+            strncpy(args->server_ip, index_server_ip, sizeof(args->server_ip) - 1);
+            args->server_ip[sizeof(args->server_ip) - 1] = '\0';
+            args->server_port = index_server_port;
+            snprintf(args->prefix, sizeof(args->prefix), "%s", strcmp(prefix, "*") == 0 ? "" : prefix);
+            pthread_t thread_id;
+            if (pthread_create(&thread_id, NULL, watch_thread, args) == 0) {
+                pthread_detach(thread_id);
+                watching = 1;
+            } else {
+                free(args);
+            }
+
         } else if (strcmp(command, "exit") == 0) {
+            // Queued downloads finish first, so a script can queue files and exit
+            jobqueue_drain();
             printf("Exiting and cleaning up...\n");
             cleanup_on_exit(index_server_ip, index_server_port);
+            connpool_clear();
             break;
 
         } else {
-            printf("Unknown command. Please enter 'register', 'download', 'list', 'search', 'deregister', or 'exit'.\n");
+            printf("Unknown command. Please enter 'register', 'download', 'queue', 'jobs', 'mirror', 'list', 'search', 'find', 'watch', 'deregister', or 'exit'.\n");
         }
     }
 
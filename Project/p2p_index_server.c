@@ -2,75 +2,197 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include "constants.h"
+#include "metrics.h"
+#include "p2p_log.h"
+#include "peer_policy.h"
+#include "index_proxy.h"
+#include "replication.h"
+#include "bloom.h"
+#include "netaddr.h"
+#include "ratelimit.h"
+#include "chunkmac.h"
+#include <pthread.h>
+#include <signal.h>
 #include <limits.h> 
+#include <fnmatch.h>
+#include <time.h>
+
+#define GLOB_SPECIALS "*?[\\"  // Characters that end the literal prefix of a filename pattern
 
 // Structure to store file information
 // filename: Name of the file to be shared
-// ip: IP address of the machine hosting the file
+// addr: Address of the machine hosting the file, IPv4 peers IPv4-mapped (see netaddr.h)
 // port: Port number where the file can be accessed
+// timeUsed: Number of times the entry was handed out by LIST_CONTENT
+// score: Measured throughput and RTT of the hosting peer
+// secret: Key the peer tags transfers with, all zero if it registered none (see chunkmac.h)
 typedef struct {
     char filename[FILENAME_SIZE];
-    char ip[INET_ADDRSTRLEN];
+    struct in6_addr addr;
     int port;
     int timeUsed;
     char peerName[PEER_NAME_SIZE];
+    PeerScore score;
+    MacKey secret;
 } FileEntry;
 
+#define MAX_PROXIES 16                            // Caching proxies that can subscribe at once
+#define PROXY_EXPIRY_SEC (3 * PROXY_HEARTBEAT_SEC) // A proxy that misses three heartbeats is dropped
+
+#define MAX_SUBSCRIBERS 64   // Clients that can watch for changes at once
+
+// Client watching for registry changes
+// addr: Address notifications are sent to
+// prefix: Only files starting with this are reported; empty for all
+// next_seq: Sequence number of the next notification
+// last_seen: Time of its latest SUBSCRIBE; the subscription lapses after SUBSCRIPTION_LEASE_SEC
 typedef struct {
-    char filename[FILENAME_SIZE];
-} FoundEntry;
+    struct sockaddr_storage addr;
+    char prefix[FILENAME_SIZE];
+    uint32_t next_seq;
+    time_t last_seen;
+} Subscriber;
+
+// Caching proxy subscribed to invalidations
+// addr: Address invalidations are sent to
+// last_seen: Time of its latest PROXY_JOIN
+typedef struct {
+    struct sockaddr_storage addr;
+    time_t last_seen;
+} ProxyEntry;
 
-// File registry to store registered files
+// File registry to store registered files, sorted by filename then peer name
 FileEntry file_registry[MAX_ENTRIES];  // Array to store registered files
 int entry_count = 0;                   // Current count of registered entries
+int selection_policy = POLICY_LEAST_USED;  // How LIST_CONTENT picks among peers holding a file
+ProxyEntry proxies[MAX_PROXIES];       // Subscribed caching proxies; unused slots have last_seen 0
+pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;  // Shared with the replication threads
+volatile sig_atomic_t promote_requested = 0;                // Set by SIGUSR1 on a replica
+CountingBloom filename_bloom;          // Summary of registered filenames served to clients
+Subscriber subscribers[MAX_SUBSCRIBERS];  // Unused slots have last_seen 0
+int server_sd = -1;                    // The index server's socket, for pushing notifications
+
+// Compares a registry entry with a (filename, peer name) key
+// Returns <0, 0 or >0 like strcmp
+int compare_entry(const FileEntry *entry, const char *filename, const char *peerName) {
+    int c = strcmp(entry->filename, filename);
+    return c != 0 ? c : strcmp(entry->peerName, peerName);
+}
+
+// Finds where a key is or would go in the sorted registry
+// Parameters:
+// - filename: The filename to look for
+// - peerName: The peer name to look for; "" finds the first entry for the filename
+// Returns the index of the first entry not less than the key
+int lower_bound(const char *filename, const char *peerName) {
+    int low = 0, high = entry_count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (compare_entry(&file_registry[mid], filename, peerName) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Pushes a registry change to every subscriber whose prefix matches
+// Parameters:
+// - change: '+' for a registration, '-' for a deregistration
+// - entry: The entry added or removed
+void notify_subscribers(char change, const FileEntry *entry) {
+    struct pdu notify;
+    char host[HOST_TEXT_SIZE] = "";  // Formatted once, for the first matching subscriber
+    time_t now = time(NULL);
+    int i;
+
+    if (server_sd == -1) {
+        return;
+    }
+    notify.type = NOTIFY;
+    memset(notify.data, 0, sizeof(notify.data));
+    for (i = 0; i < MAX_SUBSCRIBERS; i++) {
+        Subscriber *sub = &subscribers[i];
+        if (sub->last_seen == 0 || now - sub->last_seen > SUBSCRIPTION_LEASE_SEC ||
+            strncmp(entry->filename, sub->prefix, strlen(sub->prefix)) != 0) {
+            continue;
+        }
+        if (host[0] == '\0') {
+            netaddr_format(&entry->addr, host, sizeof(host));
+        }
+        snprintf(notify.data, sizeof(notify.data), "%u %c%s:%s:%s:%d", sub->next_seq++, change,
+                 entry->peerName, entry->filename, host, entry->port);
+        sendto(server_sd, &notify, sizeof(notify), 0, (struct sockaddr *)&sub->addr, sizeof(sub->addr));
+    }
+}
 
 // Adds a new file entry to the registry
 // Parameters:
 // - filename: The name of the file to register
-// - ip: The IP address of the machine hosting the file
+// - addr: The address of the machine hosting the file
 // - port: The port number for access
 // - peerName: The name of the peer hosting the file
-int add_file_entry(const char *filename, const char *ip, int port, char *peerName) {
+// - secret: The peer's transfer secret, all zero for none
+int add_file_entry(const char *filename, const struct in6_addr *addr, int port, char *peerName, const MacKey *secret) {
     if (entry_count >= MAX_ENTRIES) {
-        printf("Registry full, cannot register more files.\n");
+        LOG_WARN("Registry full, cannot register more files.");
         return -1;
     }
-    strncpy(file_registry[entry_count].filename, filename, FILENAME_SIZE);
-    strncpy(file_registry[entry_count].ip, ip, INET_ADDRSTRLEN);
-    strncpy(file_registry[entry_count].peerName, peerName, PEER_NAME_SIZE);
-    file_registry[entry_count].port = port;
-    file_registry[entry_count].timeUsed = 0;
+    // Keep the registry sorted: shift later entries up to open a slot
+    int at = lower_bound(filename, peerName);
+    memmove(&file_registry[at + 1], &file_registry[at], (entry_count - at) * sizeof(FileEntry));
+    memset(&file_registry[at], 0, sizeof(FileEntry));
+    strncpy(file_registry[at].filename, filename, FILENAME_SIZE - 1);
+    file_registry[at].addr = *addr;
+    strncpy(file_registry[at].peerName, peerName, PEER_NAME_SIZE - 1);
+    file_registry[at].port = port;
+    file_registry[at].timeUsed = 0;
+    file_registry[at].secret = *secret;
     entry_count++;
-    printf("Registered file: %s at %s:%d\n", filename, ip, port);
+    bloom_add(&filename_bloom, filename);
+    notify_subscribers('+', &file_registry[at]);
+    // A peer's link quality doesn't depend on the file, so inherit what is already known
+    int i;
+    for (i = 0; i < entry_count; i++) {
+        if (i != at && strcmp(file_registry[i].peerName, peerName) == 0 && memcmp(&file_registry[i].addr, addr, sizeof(*addr)) == 0) {
+            file_registry[at].score = file_registry[i].score;
+            break;
+        }
+    }
+    char host[HOST_TEXT_SIZE];
+    netaddr_format(addr, host, sizeof(host));
+    LOG_INFO("Registered file: %s at %s:%d", filename, host, port);
     return 0;
 }
 
 // Removes a file entry from the registry
 // Parameters:
 // - filename: The name of the file to deregister
-// - ip: The IP address associated with the file
+// - addr: The address associated with the file
 // - port: The port number associated with the file
-int remove_file_entry(const char *filename, const char *ip, int port) {
-    int i, j;
-    for (i = 0; i < entry_count; i++) {
-        if (strcmp(file_registry[i].filename, filename) == 0 &&
-            strcmp(file_registry[i].ip, ip) == 0 &&
-            file_registry[i].port == port) {
+int remove_file_entry(const char *filename, const struct in6_addr *addr, int port) {
+    char host[HOST_TEXT_SIZE];
+    int i;
+    netaddr_format(addr, host, sizeof(host));
+    for (i = lower_bound(filename, ""); i < entry_count && strcmp(file_registry[i].filename, filename) == 0; i++) {
+        if (memcmp(&file_registry[i].addr, addr, sizeof(*addr)) == 0 && file_registry[i].port == port) {
+            notify_subscribers('-', &file_registry[i]);
             // Shift remaining entries to fill the gap
-            for (j = i; j < entry_count - 1; j++) {
-                file_registry[j] = file_registry[j + 1];
-            }
+            memmove(&file_registry[i], &file_registry[i + 1], (entry_count - i - 1) * sizeof(FileEntry));
             entry_count--;
-            printf("Deregistered file: %s from IP: %s and port: %d\n", filename, ip, port);
+            bloom_remove(&filename_bloom, filename);
+            LOG_INFO("Deregistered file: %s from IP: %s and port: %d", filename, host, port);
             return 0;
         }
     }
-    printf("File not found in registry: %s at IP: %s and port: %d\n", filename, ip, port);
+    LOG_INFO("File not found in registry: %s at IP: %s and port: %d", filename, host, port);
     return -1;
 }
 
@@ -79,218 +201,674 @@ int remove_file_entry(const char *filename, const char *ip, int port) {
 // - filename: The name of the file to search
 // Returns a pointer to the file entry if found, otherwise NULL
 FileEntry *find_file_entry(const char *filename) {
+    int i = lower_bound(filename, "");
+    if (i < entry_count && strcmp(file_registry[i].filename, filename) == 0) {
+        return &file_registry[i];
+    }
+    return NULL;
+}
+
+// Handles a REGISTER request
+// Parameters:
+// - request: The received PDU
+// - response: The PDU to fill with the answer
+// - client_addr: The address the request came from
+// - from_proxy: Nonzero if a subscribed proxy forwarded the request on behalf of a peer
+void handle_register(const struct pdu *request, struct pdu *response, const struct in6_addr *client_addr, int from_proxy) {
+    LOG_DEBUG("Register request for content: %s", request->data);
+
+    // Parse filename and port from the request data
+    char filename[FILENAME_SIZE];
+    int tcp_port;
+    char peerName[PEER_NAME_SIZE];
+    char extra[BUFLEN];
+    struct in6_addr peer_addr;
+    MacKey secret = { 0, 0 };
+    int used = 0;
+    int fields = sscanf(request->data, "%10s %10s %d%n", peerName, filename, &tcp_port, &used);
+    if (fields >= 3) {
+        // Optional words follow: the peer's transfer secret, and the peer's own address if a proxy
+        // forwarded the request, which is trusted from nobody else
+        char *word, *save;
+        snprintf(extra, sizeof(extra), "%.*s", BUFLEN - used, request->data + used);
+        for (word = strtok_r(extra, " ", &save); word != NULL; word = strtok_r(NULL, " ", &save)) {
+            if (strncmp(word, "key=", 4) == 0) {
+                mac_key_parse(word + 4, &secret);
+            } else if (from_proxy && netaddr_parse(word, &peer_addr) == 0) {
+                client_addr = &peer_addr;
+            }
+        }
+        if (replication_is_replica()) {
+            response->type = ERROR;
+            snprintf(response->data, sizeof(response->data), "Read-only replica, register with the primary.");
+            return;
+        }
+        // Check if the same peer name and file already exists
+        int i = lower_bound(filename, peerName);
+        int conflict = i < entry_count && compare_entry(&file_registry[i], filename, peerName) == 0;
+
+        if (conflict) {
+            response->type = ERROR;
+            snprintf(response->data, sizeof(response->data), "Peer name conflict, choose another name.");
+        } else {
+            // Add file to registry
+            if (add_file_entry(filename, client_addr, tcp_port, peerName, &secret) == 0) {
+                Mutation m = { REGISTER };
+                strcpy(m.peer_name, peerName);
+                strcpy(m.filename, filename);
+                m.addr = *client_addr;
+                m.port = tcp_port;
+                m.secret = secret;
+                replication_append(&m);
+                response->type = ACKNOWLEDGE;
+                snprintf(response->data, sizeof(response->data), "Registration successful.");
+            } else {
+                response->type = ERROR;
+                snprintf(response->data, sizeof(response->data), "Registration failed.");
+            }
+        }
+    } else {
+        response->type = ERROR;
+        snprintf(response->data, sizeof(response->data), "Invalid registration format.");
+    }
+}
+
+// Handles a DEREGISTER request
+// Parameters:
+// - request: The received PDU
+// - response: The PDU to fill with the answer
+// - client_addr: The address the request came from
+// - from_proxy: Nonzero if a subscribed proxy forwarded the request on behalf of a peer
+void handle_deregister(const struct pdu *request, struct pdu *response, const struct in6_addr *client_addr, int from_proxy) {
+    LOG_DEBUG("Deregister request for content: %s", request->data);
+
+    // Parse filename, IP, and port from the request data
+    char filename[FILENAME_SIZE];
+    int client_port;
+    char peer_host[HOST_TEXT_SIZE];
+    struct in6_addr peer_addr;
+    int fields = sscanf(request->data, "%10[^:]:%d %47s", filename, &client_port, peer_host);
+    if (fields >= 2) {
+        if (fields == 3 && from_proxy && netaddr_parse(peer_host, &peer_addr) == 0) {
+            client_addr = &peer_addr;
+        }
+        if (replication_is_replica()) {
+            response->type = ERROR;
+            strcpy(response->data, "Read-only replica, deregister with the primary.");
+        } else if (remove_file_entry(filename, client_addr, client_port) == 0) {
+            Mutation m = { DEREGISTER };
+            strcpy(m.filename, filename);
+            m.addr = *client_addr;
+            m.port = client_port;
+            replication_append(&m);
+            response->type = ACKNOWLEDGE;
+            strcpy(response->data, "Deregistration successful.");
+        } else {
+            response->type = ERROR;
+            strcpy(response->data, "Deregistration failed.");
+        }
+    } else {
+        response->type = ERROR;
+        strcpy(response->data, "Invalid deregistration format.");
+    }
+}
+
+// Handles a LIST_CONTENT request by listing each file's least used server
+// Parameters:
+// - request: The received PDU
+// - response: The PDU to fill with the answer
+void handle_list_content(const struct pdu *request, struct pdu *response) {
+    LOG_DEBUG("List request for content");
+    response->type = LIST_CONTENT;
+    response->data[0] = '\0';  // Initialize response data as an empty string
+
+    int found = 0;
+    int i, j;
+
+    // Entries for the same filename are adjacent in the sorted registry
+    for (j = 0; j < entry_count; j = i) {
+        // Collect every peer holding the current filename and let the policy choose
+        PeerCandidate candidates[MAX_ENTRIES];
+        int candidate_count = 0;
+        int min_index;
+
+        for (i = j; i < entry_count && strcmp(file_registry[i].filename, file_registry[j].filename) == 0; i++) {
+            candidates[candidate_count].time_used = file_registry[i].timeUsed;
+            candidates[candidate_count].score = file_registry[i].score;
+            candidate_count++;
+        }
+        min_index = j + peer_policy_select(selection_policy, candidates, candidate_count);
+
+        // Add the chosen entry to the response
+        found++;
+        file_registry[min_index].timeUsed++;
+        char entry_info[FILENAME_SIZE + PEER_NAME_SIZE + HOST_TEXT_SIZE + 10];
+        char host[HOST_TEXT_SIZE];
+        netaddr_format(&file_registry[min_index].addr, host, sizeof(host));
+        snprintf(entry_info, sizeof(entry_info), "%s:%s:%s:%d", file_registry[min_index].peerName, file_registry[min_index].filename, host, file_registry[min_index].port);
+        strncat(response->data, entry_info, sizeof(response->data) - strlen(response->data) - 1);
+        strncat(response->data, ", ", sizeof(response->data) - strlen(response->data) - 1);
+    }
+
+    // Remove the trailing comma and space
+    if (strlen(response->data) > 2) {
+        response->data[strlen(response->data) - 2] = '\0';
+    }
+
+    if (!found) {
+        response->type = ERROR;
+        strcpy(response->data, "File(s) not found, no data registered.");
+    }
+}
+
+// Handles a REPORT of a completed download and updates the serving peer's score
+// Parameters:
+// - request: The received PDU
+// - response: The PDU to fill with the answer
+void handle_report(const struct pdu *request, struct pdu *response) {
+    char peer_name[PEER_NAME_SIZE];
+    char filename[FILENAME_SIZE];
+    double bytes, elapsed_us, rtt_us;
+    int found = -1;
     int i;
+
+    LOG_DEBUG("Transfer report: %s", request->data);
+    if (sscanf(request->data, "%10s %10s %lf %lf %lf", peer_name, filename, &bytes, &elapsed_us, &rtt_us) != 5) {
+        response->type = ERROR;
+        strcpy(response->data, "Invalid report format.");
+        return;
+    }
+
+    // Update the score once, then share it with every entry of the same peer
     for (i = 0; i < entry_count; i++) {
-        if (strcmp(file_registry[i].filename, filename) == 0) {
-            return &file_registry[i];
+        if (strcmp(file_registry[i].peerName, peer_name) == 0 && strcmp(file_registry[i].filename, filename) == 0) {
+            found = i;
+            peer_score_update(&file_registry[i].score, bytes, elapsed_us, rtt_us);
+            break;
+        }
+    }
+    if (found == -1) {
+        response->type = ERROR;
+        strcpy(response->data, "File not found.");
+        return;
+    }
+    for (i = 0; i < entry_count; i++) {
+        if (strcmp(file_registry[i].peerName, peer_name) == 0 &&
+            memcmp(&file_registry[i].addr, &file_registry[found].addr, sizeof(struct in6_addr)) == 0) {
+            file_registry[i].score = file_registry[found].score;
+        }
+    }
+    response->type = ACKNOWLEDGE;
+    strcpy(response->data, "Report recorded.");
+}
+
+// Handles a SEARCH request for a file hosted by a given peer
+// The answer is "ip:port", followed by " <token>" if the peer registered a transfer secret
+// Parameters:
+// - request: The received PDU
+// - response: The PDU to fill with the answer
+void handle_search(const struct pdu *request, struct pdu *response) {
+    // Search for a file
+    LOG_DEBUG("Search request for content");
+    response->type = SEARCH;
+    response->data[0] = '\0';  // Initialize response data as an empty string
+
+    char peer_name[PEER_NAME_SIZE] = {0};  // 10 bytes + null terminator
+    char filename[FILENAME_SIZE] = {0};
+    sscanf(request->data, "%10s %10s", peer_name, filename);
+    LOG_DEBUG("Requested data: %s (peer name: %s, filename: %s)", request->data, peer_name, filename);
+    int found = 0;
+    int i = lower_bound(filename, peer_name);
+    if (i < entry_count && compare_entry(&file_registry[i], filename, peer_name) == 0) {
+        char entry_info[HOST_TEXT_SIZE + 10 + MAC_TOKEN_SIZE];  // Buffer for host, port and token
+        char host[HOST_TEXT_SIZE];
+        char token[MAC_TOKEN_SIZE] = "";
+        netaddr_format(&file_registry[i].addr, host, sizeof(host));
+        // A fresh token per answer lets the downloader check the transfer came from this peer
+        if (mac_key_is_set(&file_registry[i].secret)) {
+            mac_token_issue(&file_registry[i].secret, token, sizeof(token));
+        }
+        snprintf(entry_info, sizeof(entry_info), "%s:%d%s%s", host, file_registry[i].port, token[0] ? " " : "", token);
+
+        strncat(response->data, entry_info, sizeof(response->data) - strlen(response->data) - 1);
+        found = 1;
+    }
+
+    if (!found) {
+        response->type = ERROR;
+        strcpy(response->data, "File not found.");
+    }
+}
+
+// Handles a QUERY: every holder of every file matching a pattern, one page at a time
+// Request data is "<peer pattern> <filename pattern> [<after filename> <after peer>]"; the
+// patterns are shell globs, so "*" matches any peer and "abc*" is a prefix search. A page
+// starts after the given entry. The answer starts with '+' if more pages follow or '.' if
+// not, then "peer:file:ip:port" entries separated by ", "; the last one is the next cursor.
+// Parameters:
+// - request: The received PDU
+// - response: The PDU to fill with the answer
+void handle_query(const struct pdu *request, struct pdu *response) {
+    char peer_glob[PEER_NAME_SIZE] = {0};
+    char file_glob[FILENAME_SIZE] = {0};
+    char after_file[FILENAME_SIZE] = {0};
+    char after_peer[PEER_NAME_SIZE] = {0};
+    size_t prefix_len, used = 2;
+    int i, found = 0, more = 0;
+
+    LOG_DEBUG("Query request: %s", request->data);
+    if (sscanf(request->data, "%10s %10s %10s %10s", peer_glob, file_glob, after_file, after_peer) < 2) {
+        response->type = ERROR;
+        strcpy(response->data, "Invalid query format.");
+        return;
+    }
+
+    // Only entries starting with the pattern's literal prefix can match
+    prefix_len = strcspn(file_glob, GLOB_SPECIALS);
+    char prefix[FILENAME_SIZE];
+    memcpy(prefix, file_glob, prefix_len);
+    prefix[prefix_len] = '\0';
+    i = lower_bound(prefix, "");
+    if (after_file[0] != '\0') {
+        int resume = lower_bound(after_file, after_peer);
+        if (resume < entry_count && compare_entry(&file_registry[resume], after_file, after_peer) == 0) {
+            resume++;
+        }
+        if (resume > i) {
+            i = resume;
+        }
+    }
+
+    response->type = QUERY;
+    strcpy(response->data, ". ");
+    for (; i < entry_count && strncmp(file_registry[i].filename, prefix, prefix_len) == 0; i++) {
+        char entry_info[FILENAME_SIZE + PEER_NAME_SIZE + HOST_TEXT_SIZE + 10];
+        char host[HOST_TEXT_SIZE];
+        int len;
+
+        if (fnmatch(file_glob, file_registry[i].filename, 0) != 0 ||
+            fnmatch(peer_glob, file_registry[i].peerName, 0) != 0) {
+            continue;
+        }
+        netaddr_format(&file_registry[i].addr, host, sizeof(host));
+        len = snprintf(entry_info, sizeof(entry_info), "%s%s:%s:%s:%d", found ? ", " : "",
+                       file_registry[i].peerName, file_registry[i].filename, host, file_registry[i].port);
+        if (used + len >= sizeof(response->data)) {
+            more = 1;
+            break;
+        }
+        memcpy(response->data + used, entry_info, len + 1);
+        used += len;
+        found++;
+    }
+    if (more) {
+        response->data[0] = '+';
+    }
+
+    if (!found && after_file[0] == '\0') {
+        response->type = ERROR;
+        strcpy(response->data, "File not found.");
+    }
+}
+
+// Handles a SUMMARY request for the Bloom filter of registered filenames
+// Parameters:
+// - request: The received PDU, "<known version> <chunk>" with chunk -1 for the header
+// - response: The PDU to fill with the answer (binary, see bloom.h)
+void handle_summary(const struct pdu *request, struct pdu *response) {
+    unsigned int known;
+    int chunk, c;
+    uint32_t version = htonl(filename_bloom.filter.version);
+    unsigned char *data = (unsigned char *)response->data;
+
+    if (sscanf(request->data, "%u %d", &known, &chunk) != 2 || chunk < -1 || chunk >= BLOOM_CHUNKS) {
+        response->type = ERROR;
+        strcpy(response->data, "Invalid summary request.");
+        return;
+    }
+    response->type = SUMMARY;
+    memset(response->data, 0, sizeof(response->data));
+    memcpy(data, &version, sizeof(version));
+    if (chunk == -1) {
+        // Header: which chunks changed since the client's copy
+        data[4] = BLOOM_HEADER_CHUNK;
+        for (c = 0; c < BLOOM_CHUNKS; c++) {
+            if (filename_bloom.chunk_version[c] > known) {
+                data[BLOOM_PAYLOAD_OFFSET + c / 8] |= 1 << (c % 8);
+            }
+        }
+    } else {
+        data[4] = chunk;
+        memcpy(data + BLOOM_PAYLOAD_OFFSET, filename_bloom.filter.bits + chunk * BLOOM_CHUNK_SIZE, BLOOM_CHUNK_SIZE);
+    }
+}
+
+// Handles a SUBSCRIBE: starts or renews a subscription to registry changes
+// Request data is an optional filename prefix. The answer is ACKNOWLEDGE with the sequence
+// number of the next notification; a subscriber expecting another number missed some and
+// should resync with QUERY.
+// Parameters:
+// - request: The received PDU
+// - response: The PDU to fill with the answer
+// - client: Address of the subscriber
+void handle_subscribe(const struct pdu *request, struct pdu *response, const struct sockaddr_storage *client) {
+    Subscriber *sub = NULL, *free_slot = NULL;
+    time_t now = time(NULL);
+    int i;
+
+    for (i = 0; i < MAX_SUBSCRIBERS; i++) {
+        Subscriber *s = &subscribers[i];
+        int live = s->last_seen != 0 && now - s->last_seen <= SUBSCRIPTION_LEASE_SEC;
+        if (live && netaddr_same(&s->addr, client)) {
+            sub = s;
+            break;
+        }
+        if (!live && free_slot == NULL) {
+            free_slot = s;
+        }
+    }
+    if (sub == NULL) {
+        if (free_slot == NULL) {
+            response->type = ERROR;
+            strcpy(response->data, "Too many subscribers.");
+            return;
+        }
+        // Lapsed slots keep counting, so a returning subscriber can't mistake old numbers for new
+        sub = free_slot;
+        sub->addr = *client;
+        sub->next_seq++;
+        struct in6_addr addr;
+        char host[HOST_TEXT_SIZE];
+        int port;
+        netaddr_from_sockaddr(client, &addr, &port);
+        netaddr_format(&addr, host, sizeof(host));
+        LOG_DEBUG("New subscriber at %s:%d", host, port);
+    }
+    memset(sub->prefix, 0, sizeof(sub->prefix));
+    sscanf(request->data, "%10s", sub->prefix);
+    sub->last_seen = now;
+
+    response->type = ACKNOWLEDGE;
+    snprintf(response->data, sizeof(response->data), "%u", sub->next_seq);
+}
+
+// Returns the subscribed proxy at an address, or NULL if there is none
+// Parameters:
+// - addr: Source address of a request
+ProxyEntry *find_proxy(const struct sockaddr_storage *addr) {
+    time_t now = time(NULL);
+    int i;
+    for (i = 0; i < MAX_PROXIES; i++) {
+        if (proxies[i].last_seen != 0 && now - proxies[i].last_seen <= PROXY_EXPIRY_SEC &&
+            netaddr_same(&proxies[i].addr, addr)) {
+            return &proxies[i];
         }
     }
     return NULL;
 }
 
+// Handles a PROXY_JOIN by subscribing the sender to invalidations
+// Parameters:
+// - client: Address of the proxy
+// - response: The PDU to fill with the answer
+void handle_proxy_join(const struct sockaddr_storage *client, struct pdu *response) {
+    ProxyEntry *proxy = find_proxy(client);
+    time_t now = time(NULL);
+    int i;
+
+    for (i = 0; proxy == NULL && i < MAX_PROXIES; i++) {
+        if (proxies[i].last_seen == 0 || now - proxies[i].last_seen > PROXY_EXPIRY_SEC) {
+            proxy = &proxies[i];
+            proxy->addr = *client;
+            struct in6_addr addr;
+            char host[HOST_TEXT_SIZE];
+            int port;
+            netaddr_from_sockaddr(client, &addr, &port);
+            netaddr_format(&addr, host, sizeof(host));
+            LOG_INFO("Caching proxy subscribed from %s:%d", host, port);
+        }
+    }
+    if (proxy == NULL) {
+        response->type = ERROR;
+        strcpy(response->data, "Too many proxies.");
+        return;
+    }
+    proxy->last_seen = now;
+    response->type = ACKNOWLEDGE;
+    strcpy(response->data, "Subscribed.");
+}
+
+// Tells every subscribed proxy that a registration changed a file's entries
+// Parameters:
+// - sd: The index server's socket
+// - request: The REGISTER or DEREGISTER that succeeded
+void notify_proxies(int sd, const struct pdu *request) {
+    struct pdu invalidate;
+    char peer_name[PEER_NAME_SIZE];
+    time_t now = time(NULL);
+    int i;
+
+    invalidate.type = INVALIDATE;
+    memset(invalidate.data, 0, sizeof(invalidate.data));
+    if (request->type == REGISTER) {
+        sscanf(request->data, "%10s %10s", peer_name, invalidate.data);
+    } else {
+        sscanf(request->data, "%10[^:]", invalidate.data);
+    }
+    for (i = 0; i < MAX_PROXIES; i++) {
+        if (proxies[i].last_seen != 0 && now - proxies[i].last_seen <= PROXY_EXPIRY_SEC) {
+            sendto(sd, &invalidate, sizeof(invalidate), 0, (struct sockaddr *)&proxies[i].addr, sizeof(proxies[i].addr));
+        }
+    }
+}
+
+// Applies a change streamed from the primary; called with registry_lock held
+// Parameters:
+// - m: The change
+void apply_mutation(const Mutation *m) {
+    if (m->op == REGISTER) {
+        add_file_entry(m->filename, &m->addr, m->port, (char *)m->peer_name, &m->secret);
+    } else {
+        remove_file_entry(m->filename, &m->addr, m->port);
+    }
+}
+
+// Copies the registry as a list of registrations; called with registry_lock held
+// Parameters:
+// - out: Filled with one REGISTER change per entry
+// - max: Capacity of out
+// Returns the number of entries copied
+int snapshot_registry(Mutation *out, int max) {
+    int i;
+    for (i = 0; i < entry_count && i < max; i++) {
+        memset(&out[i], 0, sizeof(Mutation));
+        out[i].op = REGISTER;
+        strcpy(out[i].peer_name, file_registry[i].peerName);
+        strcpy(out[i].filename, file_registry[i].filename);
+        out[i].addr = file_registry[i].addr;
+        out[i].port = file_registry[i].port;
+        out[i].secret = file_registry[i].secret;
+    }
+    return i;
+}
+
+// Empties the registry before a snapshot is loaded; called with registry_lock held
+void reset_registry(void) {
+    int i;
+    entry_count = 0;
+    bloom_reset(&filename_bloom);
+    // Removals aren't notified one by one; skipping a number makes subscribers resync
+    for (i = 0; i < MAX_SUBSCRIBERS; i++) {
+        subscribers[i].next_seq++;
+    }
+}
+
+// Asks a replica to take over as primary
+// Parameters:
+// - sig: Unused
+void request_promotion(int sig) {
+    (void)sig;
+    promote_requested = 1;
+}
+
+// Receives one request along with the time the kernel queued it
+// Parameters:
+// - sd: The server's socket, with SO_TIMESTAMPNS enabled
+// - request: Filled with the request
+// - client: Filled with the sender's address
+// - client_len: Size of client in, length of the address out
+// - queue_delay_us: Filled with how long the request waited in the socket buffer
+// Returns the number of bytes received, or -1 on error
+ssize_t receive_request(int sd, struct pdu *request, struct sockaddr_storage *client, socklen_t *client_len,
+                        uint64_t *queue_delay_us) {
+    struct iovec iov = { request, sizeof(*request) };
+    char control[CMSG_SPACE(sizeof(struct timespec))];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct timespec now;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = client;
+    msg.msg_namelen = *client_len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if ((n = recvmsg(sd, &msg, 0)) == -1) {
+        return -1;
+    }
+    *client_len = msg.msg_namelen;
+    *queue_delay_us = 0;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec queued;
+            int64_t delay;
+            memcpy(&queued, CMSG_DATA(cmsg), sizeof(queued));
+            clock_gettime(CLOCK_REALTIME, &now);
+            delay = (int64_t)(now.tv_sec - queued.tv_sec) * 1000000 + (now.tv_nsec - queued.tv_nsec) / 1000;
+            *queue_delay_us = delay > 0 ? delay : 0;
+        }
+    }
+    return n;
+}
+
+// Answers a refused request with SLOW_DOWN
+// Parameters:
+// - sd: The server's socket
+// - client: Address of the sender
+// - client_len: Length of client
+// - retry_ms: When the sender may try again
+// - reason: Text for the sender
+void send_slow_down(int sd, const struct sockaddr_storage *client, socklen_t client_len, uint32_t retry_ms,
+                    const char *reason) {
+    struct pdu response;
+
+    response.type = SLOW_DOWN;
+    memset(response.data, 0, sizeof(response.data));
+    snprintf(response.data, sizeof(response.data), "%u %s", retry_ms, reason);
+    sendto(sd, &response, sizeof(response), 0, (const struct sockaddr *)client, client_len);
+}
+
 // Main function for handling incoming UDP requests on the index server
 // Parameters:
 // - server_port: The port number for the server to listen on
 void index_server_udp(int server_port) {
     int sd;
-    struct sockaddr_in server, client;
+    struct sockaddr_storage client;
     struct pdu request, response;  // Protocol Data Unit to send and receive data
     socklen_t client_len;
-    char client_ip[INET_ADDRSTRLEN];
-
-    // Create UDP socket
-    if ((sd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
-        perror("Cannot create socket");
-        exit(1);
-    }
-
-    // Set up server address structure
-    bzero(&server, sizeof(server));
-    server.sin_family = AF_INET;
-    server.sin_port = htons(server_port);  // Use provided server port
-    server.sin_addr.s_addr = htonl(INADDR_ANY);
-
-    // Bind the socket to the server address
-    if (bind(sd, (struct sockaddr *)&server, sizeof(server)) == -1) {
+    struct in6_addr client_addr;
+    ssize_t n;
+    uint64_t start, queue_delay_us;
+    uint32_t retry_ms;
+    int admit, on = 1;
+
+    // Create a dual-stack UDP socket that takes IPv4 and IPv6 requests alike
+    if ((sd = netaddr_listen(SOCK_DGRAM, server_port)) == -1) {
         perror("Cannot bind socket");
-        close(sd);
         exit(1);
     }
+    // Arrival timestamps tell how far behind the loop is, for load shedding
+    setsockopt(sd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
 
-    printf("Index server is listening on port %d\n", server_port);
+    LOG_INFO("Index server is listening on port %d", server_port);
+    pthread_mutex_lock(&registry_lock);
+    server_sd = sd;  // Replicated changes are pushed to subscribers from another thread
+    pthread_mutex_unlock(&registry_lock);
 
     // Infinite loop to handle incoming requests
     while (1) {
         client_len = sizeof(client);
         // Receive request from the client
-        if (recvfrom(sd, &request, sizeof(request), 0, (struct sockaddr *)&client, &client_len) == -1) {
-            perror("Failed to receive message");
+        n = receive_request(sd, &request, &client, &client_len, &queue_delay_us);
+        if (promote_requested) {
+            promote_requested = 0;
+            replication_promote();
+        }
+        if (n == -1) {
+            if (errno != EINTR) {
+                LOG_WARN("Failed to receive message: %s", strerror(errno));
+            }
             continue;
         }
+        start = metrics_now_us();
 
-        // Capture the client's IP address
-        inet_ntop(AF_INET, &client.sin_addr, client_ip, INET_ADDRSTRLEN);
+        // Capture the client's address
+        netaddr_from_sockaddr(&client, &client_addr, NULL);
 
-        // Handle REGISTER request
-        if (request.type == REGISTER) {
-            printf("Register request for content: %s\n", request.data);
-
-            // Parse filename and port from the request data
-            char filename[FILENAME_SIZE];
-            int tcp_port;
-            char peerName[PEER_NAME_SIZE];
-            if (sscanf(request.data, "%10s %10s %d", peerName, filename, &tcp_port) == 3) {
-                // Check if the same peer name and file already exists
-                int conflict = 0;
-                int i;
-                for (i = 0; i < entry_count; i++) {
-                    if (strcmp(file_registry[i].filename, filename) == 0 && strcmp(file_registry[i].peerName, peerName) == 0) {
-                        conflict = 1;
-                        break;
-                    }
-                }
-
-                if (conflict) {
-                    response.type = ERROR;
-                    snprintf(response.data, sizeof(response.data), "Peer name conflict, choose another name.");
-                } else {
-                    // Add file to registry
-                    if (add_file_entry(filename, client_ip, tcp_port, peerName) == 0) {
-                        response.type = ACKNOWLEDGE;
-                        snprintf(response.data, sizeof(response.data), "Registration successful.");
-                    } else {
-                        response.type = ERROR;
-                        snprintf(response.data, sizeof(response.data), "Registration failed.");
-                    }
-                }
-            } else {
-                response.type = ERROR;
-                snprintf(response.data, sizeof(response.data), "Invalid registration format.");
+        // Admission control looks only at the type byte and the source, before any parsing or locking.
+        // Proxies speak for many peers at once, so they are exempt from the per-source limits.
+        admit = ratelimit_admit(&client_addr, request.type, start, &retry_ms);
+        if (admit != RATE_ADMIT && find_proxy(&client) == NULL) {
+            if (admit == RATE_WARN) {
+                send_slow_down(sd, &client, client_len, retry_ms, "Rate limit exceeded.");
             }
-            // Send response to the client
-            sendto(sd, &response, sizeof(response), 0, (struct sockaddr *)&client, client_len);
+            metrics_refused(request.type, 0);
+            continue;
+        }
+        if (ratelimit_shed(request.type, queue_delay_us)) {
+            send_slow_down(sd, &client, client_len, SHED_RETRY_MS, "Server overloaded, try SEARCH.");
+            metrics_refused(request.type, 1);
+            continue;
+        }
 
-        // Handle DEREGISTER request
-        } else if (request.type == DEREGISTER) {
-            printf("Deregister request for content: %s\n", request.data);
-
-            // Parse filename, IP, and port from the request data
-            char filename[FILENAME_SIZE];
-            int client_port;
-            if (sscanf(request.data, "%99[^:]:%d", filename, &client_port) == 2) {
-                if (remove_file_entry(filename, client_ip, client_port) == 0) {
-                    response.type = ACKNOWLEDGE;
-                    strcpy(response.data, "Deregistration successful.");
-                } else {
-                    response.type = ERROR;
-                    strcpy(response.data, "Deregistration failed.");
-                }
-            } else {
-                response.type = ERROR;
-                strcpy(response.data, "Invalid deregistration format.");
-            }
-            // Send response to the client
-            sendto(sd, &response, sizeof(response), 0, (struct sockaddr *)&client, client_len);
+        // Replication threads change the registry too
+        pthread_mutex_lock(&registry_lock);
 
-        // Handle LIST_CONTENT request to find each file's least used server
+        if (request.type == REGISTER) {
+            handle_register(&request, &response, &client_addr, find_proxy(&client) != NULL);
+        } else if (request.type == DEREGISTER) {
+            handle_deregister(&request, &response, &client_addr, find_proxy(&client) != NULL);
+        } else if (request.type == PROXY_JOIN) {
+            handle_proxy_join(&client, &response);
         } else if (request.type == LIST_CONTENT) {
-            printf("List request for content\n");
-            response.type = LIST_CONTENT;
-            response.data[0] = '\0';  // Initialize response data as an empty string
-
-            int found = 0;
-            FoundEntry files_found[MAX_ENTRIES];
-            int i, j, k;
-
-            for (j = 0; j < entry_count; j++) {
-                int exists = 0;
-                for (k = 0; k < found; k++) {
-                    if (strcmp(file_registry[j].filename, files_found[k].filename) == 0) {
-                        exists = 1;
-                        break;
-                    }
-                }
-
-                if (!exists) {
-                    // Find the least used entry for the current filename
-                    int min_time_used = INT_MAX;
-                    int min_index = -1;
-
-                    for (i = 0; i < entry_count; i++) {
-                        if (strcmp(file_registry[i].filename, file_registry[j].filename) == 0 &&
-                            file_registry[i].timeUsed < min_time_used) {
-                            min_time_used = file_registry[i].timeUsed;
-                            min_index = i;
-                        }
-                    }
-
-                    // Add the least used entry to the response
-                    if (min_index != -1) {
-                        strcpy(files_found[found].filename, file_registry[min_index].filename);
-                        found++;
-
-                        file_registry[min_index].timeUsed++;
-                        char entry_info[FILENAME_SIZE + PEER_NAME_SIZE + INET_ADDRSTRLEN + 10];
-                        snprintf(entry_info, sizeof(entry_info), "%s:%s:%s:%d", file_registry[min_index].peerName, file_registry[min_index].filename, file_registry[min_index].ip, file_registry[min_index].port);
-                        strncat(response.data, entry_info, sizeof(response.data) - strlen(response.data) - 1);
-                        strncat(response.data, ", ", sizeof(response.data) - strlen(response.data) - 1);
-                    }
-                }
-            }
-
-            // Remove the trailing comma and space
-            if (strlen(response.data) > 2) {
-                response.data[strlen(response.data) - 2] = '\0';
-            }
-
-            if (found) {
-                // Send response with all entries found
-                sendto(sd, &response, sizeof(response), 0, (struct sockaddr *)&client, client_len);
-            } else {
-                response.type = ERROR;
-                strcpy(response.data, "File(s) not found, no data registered.");
-                // Send response to the client
-                sendto(sd, &response, sizeof(response), 0, (struct sockaddr *)&client, client_len);
-            }
+            handle_list_content(&request, &response);
+        } else if (request.type == SEARCH) {
+            handle_search(&request, &response);
+        } else if (request.type == REPORT) {
+            handle_report(&request, &response);
+        } else if (request.type == QUERY) {
+            handle_query(&request, &response);
+        } else if (request.type == SUMMARY) {
+            handle_summary(&request, &response);
+        } else if (request.type == SUBSCRIBE) {
+            handle_subscribe(&request, &response, &client);
+        } else {
+            pthread_mutex_unlock(&registry_lock);
+            metrics_request(request.type, 1, metrics_now_us() - start);
+            metrics_bytes(n, 0);
+            continue;  // Unknown requests are not answered
         }
-        // Handle SEARCH request
-        else if (request.type == SEARCH) {
-            // Search for a file
-            printf("Search request for content\n");
-            response.type = SEARCH;
-            response.data[0] = '\0';  // Initialize response data as an empty string
-
-            char peer_name[PEER_NAME_SIZE] = {0};  // 10 bytes + null terminator
-            char filename[FILENAME_SIZE] = {0};
-            sscanf(request.data, "%10s %10s", peer_name, filename);
-            printf("Requested data: %s\n", request.data);
-            printf("Peer name: %s, Filename: %s\n", peer_name, filename);
-            int found = 0;
-            int i;
-            for (i = 0; i < entry_count; i++) {
-                if (strcmp(file_registry[i].filename, filename) == 0) {
-                    // Check if the peer name matches
-                    if (strcmp(file_registry[i].peerName, peer_name) == 0) {
-                        char entry_info[INET_ADDRSTRLEN + 10];  // Buffer for IP and port
-                        snprintf(entry_info, sizeof(entry_info), "%s:%d", file_registry[i].ip, file_registry[i].port);
-                        
-                        strncat(response.data, entry_info, sizeof(response.data) - strlen(response.data) - 1);
-                        found = 1;
-                    }
-                }
-            }
+        pthread_mutex_unlock(&registry_lock);
 
-            if (found) {
-                // Send response with the found entry
-                sendto(sd, &response, sizeof(response), 0, (struct sockaddr *)&client, client_len);
-            } else {
-                response.type = ERROR;
-                strcpy(response.data, "File not found.");
-                // Send response to the client
-                sendto(sd, &response, sizeof(response), 0, (struct sockaddr *)&client, client_len);
-            }
+        // Send response to the client
+        sendto(sd, &response, sizeof(response), 0, (struct sockaddr *)&client, client_len);
+        if ((request.type == REGISTER || request.type == DEREGISTER) && response.type == ACKNOWLEDGE) {
+            notify_proxies(sd, &request);
         }
-
+        metrics_request(request.type, response.type == ERROR, metrics_now_us() - start);
+        metrics_bytes(n, sizeof(response));
     }
     close(sd);
 }
@@ -301,12 +879,115 @@ void index_server_udp(int server_port) {
 // - argv: Array of command-line arguments
 int main(int argc, char *argv[]) {
     int server_port = SERVER_PORT;  // Default server port
+    int metrics_port = 0;           // Stats server is off unless a port is given
+    int level = LOG_LEVEL_INFO;
+    char upstream_ip[HOST_TEXT_SIZE] = "";   // Proxy mode when set
+    int upstream_port = SERVER_PORT;
+    int cache_ttl_ms = PROXY_DEFAULT_TTL_MS;
+    int rate_percent = 100;                  // Scales the per-source rate limits, 0 turns them off
+    int replication_port = 0;                // Stream changes to replicas when set
+    char primary_ip[HOST_TEXT_SIZE] = "";    // Replica mode when set
+    int primary_port = 0;
+    int opt;
+
+    if (getenv("P2P_LOG_LEVEL") && (opt = log_parse_level(getenv("P2P_LOG_LEVEL"))) != -1) {
+        level = opt;
+    }
+    while ((opt = getopt(argc, argv, "m:l:p:u:t:R:r:L:")) != -1) {
+        switch (opt) {
+        case 'm':
+            metrics_port = atoi(optarg);
+            break;
+        case 'p':
+            if ((selection_policy = peer_policy_parse(optarg)) == -1) {
+                fprintf(stderr, "Unknown peer selection policy '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'u':
+            if (netaddr_split(optarg, upstream_ip, sizeof(upstream_ip), &upstream_port) == -1) {
+                fprintf(stderr, "Invalid upstream index '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 't':
+            cache_ttl_ms = atoi(optarg);
+            break;
+        case 'L':
+            rate_percent = atoi(optarg);
+            break;
+        case 'R':
+            replication_port = atoi(optarg);
+            break;
+        case 'r':
+            if (netaddr_split(optarg, primary_ip, sizeof(primary_ip), &primary_port) == -1 || primary_port <= 0) {
+                fprintf(stderr, "Invalid primary '%s', expected ip:port\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'l':
+            if ((level = log_parse_level(optarg)) == -1) {
+                fprintf(stderr, "Unknown log level '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-m metrics_port] [-l error|warn|info|debug]\n"
+                            "          [-p least-used|fastest|weighted-random|p2c]\n"
+                            "          [-u upstream_host[:port] [-t cache_ttl_ms]] [-L rate_limit_percent]\n"
+                            "          [-R replication_port] [-r primary_host:replication_port] [port]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (optind < argc) {
+        server_port = atoi(argv[optind]);  // Use specified port if provided
+    }
+
+    // Only the request loop may take SIGUSR1, so keep it blocked in every thread started below
+    sigset_t usr1;
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &usr1, NULL);
 
-    if (argc > 1) {
-        server_port = atoi(argv[1]);  // Use specified port if provided
+    // Handlers log through the async ring so stdout never stalls the request loop
+    log_init(level);
+    srand(time(NULL) ^ getpid());
+
+    // Expose request counters and latency histograms in Prometheus text format
+    metrics_init(upstream_ip[0] ? "index_proxy" : "index_server");
+    ratelimit_init(rate_percent);
+    if (metrics_port > 0 && metrics_start_server(metrics_port) == -1) {
+        exit(1);
+    }
+
+    // Answer from a local cache and forward the rest to another index server
+    if (upstream_ip[0]) {
+        index_proxy_udp(server_port, upstream_ip, upstream_port, cache_ttl_ms);
+        return 0;
+    }
+    LOG_INFO("Peer selection policy: %s", peer_policy_name(selection_policy));
+
+    bloom_reset(&filename_bloom);
+
+    // Replicas follow a primary's change stream and can themselves feed further replicas
+    ReplicationHooks hooks = { apply_mutation, snapshot_registry, reset_registry };
+    replication_init(&registry_lock, &hooks);
+    if (replication_port > 0 && replication_serve(replication_port) == -1) {
+        exit(1);
+    }
+    if (primary_ip[0]) {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = request_promotion;  // No SA_RESTART, so recvfrom returns and sees the flag
+        sigaction(SIGUSR1, &action, NULL);
+        if (replication_follow(primary_ip, primary_port) == -1) {
+            exit(1);
+        }
+        LOG_INFO("Running as a replica of %s:%d; send SIGUSR1 to promote", primary_ip, primary_port);
     }
 
     // Start the index server to handle UDP requests
+    pthread_sigmask(SIG_UNBLOCK, &usr1, NULL);
     index_server_udp(server_port);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,496 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "constants.h"
+#include "histogram.h"
+
+// Load generator for the index server
+//
+// Simulates a population of virtual peers that issue a weighted mix of
+// REGISTER, DEREGISTER, SEARCH and LIST_CONTENT requests at a fixed target
+// rate. Each in-flight request owns one UDP socket, so a response is always
+// matched with its request; a request that is not answered within the
+// timeout is counted as dropped and its socket is replaced so a late answer
+// can't be credited to the next request.
+//
+// Latency is measured from the time a request was scheduled, not the time it
+// was actually sent, so a server that falls behind can't hide its queueing
+// delay by slowing the generator down.
+
+#define MAX_FILES_PER_PEER 32   // Registration state is kept in a 32-bit mask
+#define BASE_PEER_PORT 20000    // Virtual peer i claims to serve on BASE_PEER_PORT + i
+#define NUM_OPS 4
+
+enum { OP_REGISTER, OP_DEREGISTER, OP_SEARCH, OP_LIST };
+
+static const char *op_names[NUM_OPS] = { "REGISTER", "DEREGISTER", "SEARCH", "LIST" };
+
+// Load generator settings
+// server: Address of the index server
+// peers: Number of virtual peers
+// files_per_peer: Number of distinct files each peer may register
+// concurrency: Maximum number of requests in flight (one socket each)
+// rate: Target request rate per second
+// duration: Length of the run in seconds
+// timeout_ms: Time after which an unanswered request counts as dropped
+// weights: Relative weight of each operation in the mix
+typedef struct {
+    struct sockaddr_in server;
+    int peers;
+    int files_per_peer;
+    int concurrency;
+    double rate;
+    int duration;
+    int timeout_ms;
+    int weights[NUM_OPS];
+} LoadConfig;
+
+// State of a virtual peer
+// registered: Bit f is set once file f is registered with the index
+// pending: Bit f is set while a REGISTER or DEREGISTER for file f is in flight
+typedef struct {
+    unsigned int registered;
+    unsigned int pending;
+} VirtualPeer;
+
+// A socket carrying at most one outstanding request
+// sd: UDP socket
+// busy: Whether a request is outstanding
+// op: Operation of the outstanding request
+// peer, file: Virtual peer and file slot the request refers to
+// scheduled_ns: Time the request was scheduled to be sent
+typedef struct {
+    int sd;
+    int busy;
+    int op;
+    int peer;
+    int file;
+    uint64_t scheduled_ns;
+} Slot;
+
+// Per-operation results
+typedef struct {
+    uint64_t sent;
+    uint64_t ok;
+    uint64_t errors;
+    uint64_t dropped;
+    Histogram latency;
+} OpStats;
+
+static LoadConfig config;
+static VirtualPeer *peers;
+static Slot *slots;
+static int *free_slots;
+static int free_count;
+static int epfd;
+static OpStats stats[NUM_OPS];
+static uint64_t unsent;         // Requests skipped because every slot was busy
+
+// Returns a monotonic timestamp in nanoseconds
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Opens a fresh socket for a slot and adds it to the epoll set
+// Parameters:
+// - index: The slot to (re)open
+static void open_slot(int index) {
+    struct epoll_event ev;
+
+    if ((slots[index].sd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+        perror("Cannot create socket");
+        exit(1);
+    }
+    ev.events = EPOLLIN;
+    ev.data.u32 = (uint32_t)index;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, slots[index].sd, &ev) == -1) {
+        perror("Cannot add socket to epoll");
+        exit(1);
+    }
+    slots[index].busy = 0;
+}
+
+// Marks a slot idle and clears the pending bit of its request
+// Parameters:
+// - index: The slot to release
+static void release_slot(int index) {
+    Slot *slot = &slots[index];
+    if (slot->op == OP_REGISTER || slot->op == OP_DEREGISTER) {
+        peers[slot->peer].pending &= ~(1u << slot->file);
+    }
+    slot->busy = 0;
+    free_slots[free_count++] = index;
+}
+
+// Picks an operation according to the configured weights
+static int pick_op(void) {
+    int total = 0, r, i;
+    for (i = 0; i < NUM_OPS; i++) {
+        total += config.weights[i];
+    }
+    r = rand() % total;
+    for (i = 0; i < NUM_OPS; i++) {
+        if (r < config.weights[i]) {
+            return i;
+        }
+        r -= config.weights[i];
+    }
+    return OP_SEARCH;
+}
+
+// Picks a (peer, file) pair whose registration state matches the wanted state
+// Parameters:
+// - want_registered: 1 to find a registered pair, 0 for an unregistered one
+// - peer, file: Set to the chosen pair
+// Returns 0 on success, -1 if no suitable pair was found after a few tries
+static int pick_pair(int want_registered, int *peer, int *file) {
+    int attempt;
+    for (attempt = 0; attempt < 16; attempt++) {
+        int p = rand() % config.peers;
+        int f = rand() % config.files_per_peer;
+        unsigned int bit = 1u << f;
+        if (peers[p].pending & bit) {
+            continue;
+        }
+        if (((peers[p].registered & bit) != 0) == want_registered) {
+            *peer = p;
+            *file = f;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Builds and sends one request on a free slot
+// Parameters:
+// - scheduled_ns: The time the request was due
+static void send_request(uint64_t scheduled_ns) {
+    struct pdu request;
+    int index, op, p, f;
+    Slot *slot;
+
+    if (free_count == 0) {
+        unsent++;
+        return;
+    }
+
+    op = pick_op();
+    if (op == OP_REGISTER && pick_pair(0, &p, &f) == -1) {
+        op = OP_DEREGISTER;
+    }
+    if (op == OP_DEREGISTER && pick_pair(1, &p, &f) == -1) {
+        if (pick_pair(0, &p, &f) == -1) {
+            unsent++;
+            return;
+        }
+        op = OP_REGISTER;
+    }
+    if (op == OP_SEARCH || op == OP_LIST) {
+        p = rand() % config.peers;
+        f = rand() % config.files_per_peer;
+    }
+
+    memset(&request, 0, sizeof(request));
+    switch (op) {
+    case OP_REGISTER:
+        request.type = REGISTER;
+        snprintf(request.data, sizeof(request.data), "vp%08d lg%08d %d", p, f, BASE_PEER_PORT + p);
+        break;
+    case OP_DEREGISTER:
+        request.type = DEREGISTER;
+        snprintf(request.data, sizeof(request.data), "lg%08d:%d", f, BASE_PEER_PORT + p);
+        break;
+    case OP_SEARCH:
+        request.type = SEARCH;
+        snprintf(request.data, sizeof(request.data), "vp%08d lg%08d", p, f);
+        break;
+    default:
+        request.type = LIST_CONTENT;
+        break;
+    }
+
+    index = free_slots[--free_count];
+    slot = &slots[index];
+    if (sendto(slot->sd, &request, sizeof(request), 0,
+               (struct sockaddr *)&config.server, sizeof(config.server)) == -1) {
+        free_slots[free_count++] = index;
+        stats[op].sent++;
+        stats[op].errors++;
+        return;
+    }
+
+    slot->busy = 1;
+    slot->op = op;
+    slot->peer = p;
+    slot->file = f;
+    slot->scheduled_ns = scheduled_ns;
+    if (op == OP_REGISTER || op == OP_DEREGISTER) {
+        peers[p].pending |= 1u << f;
+    }
+    stats[op].sent++;
+}
+
+// Reads and accounts for the response waiting on a slot
+// Parameters:
+// - index: The slot that became readable
+static void receive_response(int index) {
+    struct pdu response;
+    Slot *slot = &slots[index];
+    uint64_t latency_us;
+    int ok;
+
+    if (recv(slot->sd, &response, sizeof(response), 0) == -1 || !slot->busy) {
+        return;
+    }
+
+    latency_us = (now_ns() - slot->scheduled_ns) / 1000;
+    histogram_record(&stats[slot->op].latency, latency_us);
+
+    ok = (response.type != ERROR && response.type != SLOW_DOWN);
+    if (ok) {
+        stats[slot->op].ok++;
+        if (slot->op == OP_REGISTER) {
+            peers[slot->peer].registered |= 1u << slot->file;
+        } else if (slot->op == OP_DEREGISTER) {
+            peers[slot->peer].registered &= ~(1u << slot->file);
+        }
+    } else {
+        stats[slot->op].errors++;
+    }
+    release_slot(index);
+}
+
+// Drops requests that have waited longer than the timeout
+// Parameters:
+// - now: Current time in nanoseconds
+static void expire_requests(uint64_t now) {
+    uint64_t timeout_ns = (uint64_t)config.timeout_ms * 1000000ULL;
+    int i;
+    for (i = 0; i < config.concurrency; i++) {
+        if (slots[i].busy && now - slots[i].scheduled_ns > timeout_ns) {
+            stats[slots[i].op].dropped++;
+            // Replace the socket so a late response isn't matched to the next request
+            epoll_ctl(epfd, EPOLL_CTL_DEL, slots[i].sd, NULL);
+            close(slots[i].sd);
+            open_slot(i);
+            release_slot(i);
+        }
+    }
+}
+
+// Prints a single latency summary line
+// Parameters:
+// - name: Label for the line
+// - h: The latency histogram in microseconds
+static void print_latency(const char *name, const Histogram *h) {
+    printf("%-10s n=%-9llu mean=%-8.0f p50=%-7llu p90=%-7llu p99=%-7llu p99.9=%-7llu max=%llu\n",
+           name, (unsigned long long)h->total, histogram_mean(h),
+           (unsigned long long)histogram_percentile(h, 50.0),
+           (unsigned long long)histogram_percentile(h, 90.0),
+           (unsigned long long)histogram_percentile(h, 99.0),
+           (unsigned long long)histogram_percentile(h, 99.9),
+           (unsigned long long)h->max);
+}
+
+// Prints the final report
+// Parameters:
+// - elapsed_s: Wall-clock length of the run in seconds
+static void print_report(double elapsed_s) {
+    Histogram all;
+    uint64_t sent = 0, ok = 0, errors = 0, dropped = 0;
+    int i;
+
+    histogram_init(&all);
+    for (i = 0; i < NUM_OPS; i++) {
+        sent += stats[i].sent;
+        ok += stats[i].ok;
+        errors += stats[i].errors;
+        dropped += stats[i].dropped;
+        histogram_merge(&all, &stats[i].latency);
+    }
+
+    printf("\n--- Index server load test: %.1f s ---\n", elapsed_s);
+    printf("Sent: %llu  Answered: %llu  Errors: %llu  Dropped: %llu  Not sent (all slots busy): %llu\n",
+           (unsigned long long)sent, (unsigned long long)(ok + errors),
+           (unsigned long long)errors, (unsigned long long)dropped, (unsigned long long)unsent);
+    printf("Throughput: %.0f answers/s (target %.0f req/s)\n", (double)(ok + errors) / elapsed_s, config.rate);
+    printf("Drop rate: %.3f%%\n", sent ? 100.0 * (double)dropped / (double)sent : 0.0);
+    printf("\nPer operation:\n");
+    for (i = 0; i < NUM_OPS; i++) {
+        printf("%-10s sent=%-9llu ok=%-9llu errors=%-9llu dropped=%llu\n", op_names[i],
+               (unsigned long long)stats[i].sent, (unsigned long long)stats[i].ok,
+               (unsigned long long)stats[i].errors, (unsigned long long)stats[i].dropped);
+    }
+    printf("\nLatency (us):\n");
+    for (i = 0; i < NUM_OPS; i++) {
+        print_latency(op_names[i], &stats[i].latency);
+    }
+    print_latency("ALL", &all);
+}
+
+// Parses a mix of the form R:D:S:L into the operation weights
+// Parameters:
+// - mix: The mix string from the command line
+// Returns 0 on success, -1 on a malformed mix
+static int parse_mix(const char *mix) {
+    int *w = config.weights;
+    if (sscanf(mix, "%d:%d:%d:%d", &w[0], &w[1], &w[2], &w[3]) != 4) {
+        return -1;
+    }
+    if (w[0] < 0 || w[1] < 0 || w[2] < 0 || w[3] < 0 || w[0] + w[1] + w[2] + w[3] == 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Prints usage information and exits
+// Parameters:
+// - prog: Name of the program
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-s server_ip] [-p port] [-n peers] [-f files_per_peer] [-c concurrency]\n"
+            "          [-r rate] [-d seconds] [-t timeout_ms] [-m register:deregister:search:list]\n",
+            prog);
+    exit(1);
+}
+
+// Entry point of the load generator
+// Parameters:
+// - argc: Number of command-line arguments
+// - argv: Array of command-line arguments
+int main(int argc, char *argv[]) {
+    const char *server_ip = "127.0.0.1";
+    int server_port = SERVER_PORT;
+    struct epoll_event events[256];
+    uint64_t start, now, next_send, end, interval_ns, next_report;
+    uint64_t last_answered = 0;
+    int opt, i, n;
+
+    config.peers = 1000;
+    config.files_per_peer = 4;
+    config.concurrency = 256;
+    config.rate = 10000;
+    config.duration = 10;
+    config.timeout_ms = 1000;
+    parse_mix("20:10:60:10");
+
+    while ((opt = getopt(argc, argv, "s:p:n:f:c:r:d:t:m:")) != -1) {
+        switch (opt) {
+        case 's': server_ip = optarg; break;
+        case 'p': server_port = atoi(optarg); break;
+        case 'n': config.peers = atoi(optarg); break;
+        case 'f': config.files_per_peer = atoi(optarg); break;
+        case 'c': config.concurrency = atoi(optarg); break;
+        case 'r': config.rate = atof(optarg); break;
+        case 'd': config.duration = atoi(optarg); break;
+        case 't': config.timeout_ms = atoi(optarg); break;
+        case 'm':
+            if (parse_mix(optarg) == -1) {
+                fprintf(stderr, "Invalid mix '%s'\n", optarg);
+                usage(argv[0]);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (config.peers < 1 || config.peers > 65535 - BASE_PEER_PORT ||
+        config.files_per_peer < 1 || config.files_per_peer > MAX_FILES_PER_PEER ||
+        config.concurrency < 1 || config.rate <= 0 || config.duration < 1 || config.timeout_ms < 1) {
+        usage(argv[0]);
+    }
+
+    bzero(&config.server, sizeof(config.server));
+    config.server.sin_family = AF_INET;
+    config.server.sin_port = htons(server_port);
+    if (inet_pton(AF_INET, server_ip, &config.server.sin_addr) <= 0) {
+        fprintf(stderr, "Invalid server IP address\n");
+        exit(1);
+    }
+
+    peers = calloc(config.peers, sizeof(VirtualPeer));
+    slots = calloc(config.concurrency, sizeof(Slot));
+    free_slots = calloc(config.concurrency, sizeof(int));
+    if (!peers || !slots || !free_slots) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    if ((epfd = epoll_create1(0)) == -1) {
+        perror("Cannot create epoll instance");
+        exit(1);
+    }
+    for (i = 0; i < config.concurrency; i++) {
+        open_slot(i);
+        free_slots[free_count++] = i;
+    }
+    for (i = 0; i < NUM_OPS; i++) {
+        histogram_init(&stats[i].latency);
+    }
+    srand((unsigned int)time(NULL));
+
+    printf("Load test against %s:%d: %d peers, %.0f req/s for %d s, %d in flight max\n",
+           server_ip, server_port, config.peers, config.rate, config.duration, config.concurrency);
+
+    interval_ns = (uint64_t)(1e9 / config.rate);
+    if (interval_ns == 0) {
+        interval_ns = 1;
+    }
+    start = now_ns();
+    next_send = start;
+    next_report = start + 1000000000ULL;
+    end = start + (uint64_t)config.duration * 1000000000ULL;
+
+    while ((now = now_ns()) < end) {
+        int timeout_ms;
+
+        // Send everything that is due, measuring latency from its due time
+        while (next_send <= now && next_send < end) {
+            send_request(next_send);
+            next_send += interval_ns;
+        }
+
+        timeout_ms = next_send > now ? (int)((next_send - now) / 1000000) : 0;
+        n = epoll_wait(epfd, events, 256, timeout_ms);
+        for (i = 0; i < n; i++) {
+            receive_response((int)events[i].data.u32);
+        }
+
+        now = now_ns();
+        expire_requests(now);
+
+        if (now >= next_report) {
+            uint64_t answered = 0;
+            int k;
+            for (k = 0; k < NUM_OPS; k++) {
+                answered += stats[k].ok + stats[k].errors;
+            }
+            printf("[%3llus] %llu answers/s, %d in flight\n",
+                   (unsigned long long)((now - start) / 1000000000ULL),
+                   (unsigned long long)(answered - last_answered), config.concurrency - free_count);
+            last_answered = answered;
+            next_report += 1000000000ULL;
+        }
+    }
+
+    // Give outstanding requests up to one timeout to come back
+    while (free_count < config.concurrency && (now = now_ns()) < end + (uint64_t)config.timeout_ms * 1000000ULL) {
+        n = epoll_wait(epfd, events, 256, 10);
+        for (i = 0; i < n; i++) {
+            receive_response((int)events[i].data.u32);
+        }
+    }
+    expire_requests(UINT64_MAX / 2);
+
+    print_report((double)(now_ns() - start) / 1e9);
+    return 0;
+}
@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+#include "p2p_log.h"
+
+#define LOG_RING_SIZE 4096        // Must be a power of two
+#define LOG_MESSAGE_SIZE 240      // Longer messages are truncated
+#define LOG_IDLE_SLEEP_NS 2000000 // Drain thread poll interval when the ring is empty
+
+// One ring entry; sequence tells producers and the consumer who owns it
+typedef struct {
+    _Atomic size_t sequence;
+    int level;
+    char text[LOG_MESSAGE_SIZE];
+} LogCell;
+
+int log_level = LOG_LEVEL_INFO;
+
+static LogCell ring[LOG_RING_SIZE];
+static _Atomic size_t enqueue_pos = 0;
+static size_t dequeue_pos = 0;                  // Guarded by drain_lock
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic uint64_t dropped = 0;
+static int started = 0;
+
+static const char *level_prefix[] = { "[ERROR] ", "[WARN] ", "", "[DEBUG] " };
+
+// Writes every queued message to stdout
+// Returns the number of messages written
+static int drain(void) {
+    int count = 0;
+    uint64_t lost;
+
+    pthread_mutex_lock(&drain_lock);
+    while (1) {
+        LogCell *cell = &ring[dequeue_pos & (LOG_RING_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        if (seq != dequeue_pos + 1) {
+            break;  // Empty, or the producer is still writing this cell
+        }
+        fputs(level_prefix[cell->level], stdout);
+        fputs(cell->text, stdout);
+        fputc('\n', stdout);
+        atomic_store_explicit(&cell->sequence, dequeue_pos + LOG_RING_SIZE, memory_order_release);
+        dequeue_pos++;
+        count++;
+    }
+    if ((lost = atomic_exchange(&dropped, 0)) > 0) {
+        printf("[WARN] log ring full, %llu messages dropped\n", (unsigned long long)lost);
+        count++;
+    }
+    if (count > 0) {
+        fflush(stdout);
+    }
+    pthread_mutex_unlock(&drain_lock);
+    return count;
+}
+
+// Background thread that drains the ring
+// Parameters:
+// - arg: Unused
+static void *drain_thread(void *arg) {
+    struct timespec idle = { 0, LOG_IDLE_SLEEP_NS };
+    (void)arg;
+    while (1) {
+        if (drain() == 0) {
+            nanosleep(&idle, NULL);
+        }
+    }
+    return NULL;
+}
+
+// Sets the log level and starts the drain thread
+// Parameters:
+// - level: Most verbose level to emit
+void log_init(int level) {
+    pthread_t thread_id;
+    size_t i;
+
+    log_level = level;
+    if (started) {
+        return;
+    }
+    for (i = 0; i < LOG_RING_SIZE; i++) {
+        atomic_init(&ring[i].sequence, i);
+    }
+    if (pthread_create(&thread_id, NULL, drain_thread, NULL) != 0) {
+        return;  // Stay synchronous
+    }
+    pthread_detach(thread_id);
+    atexit(log_flush);
+    started = 1;
+}
+
+// Parses a level name
+// Parameters:
+// - name: One of "error", "warn", "info" or "debug"
+// Returns the level, or -1 if the name is unknown
+int log_parse_level(const char *name) {
+    if (strcasecmp(name, "error") == 0) return LOG_LEVEL_ERROR;
+    if (strcasecmp(name, "warn") == 0) return LOG_LEVEL_WARN;
+    if (strcasecmp(name, "info") == 0) return LOG_LEVEL_INFO;
+    if (strcasecmp(name, "debug") == 0) return LOG_LEVEL_DEBUG;
+    return -1;
+}
+
+// Applies the per call site rate limit
+// Parameters:
+// - site: The call site's limiter
+// - file, line: Location of the call site, for the suppression notice
+// Returns 1 if the message may be logged, 0 if it is suppressed
+int log_site_allow(LogSite *site, const char *file, int line) {
+    uint64_t now = (uint64_t)time(NULL);
+    uint64_t second = atomic_load_explicit(&site->second, memory_order_relaxed);
+
+    if (second != now && atomic_compare_exchange_strong(&site->second, &second, now)) {
+        uint32_t suppressed = atomic_exchange(&site->suppressed, 0);
+        atomic_store(&site->count, 0);
+        if (suppressed > 0) {
+            log_write(LOG_LEVEL_WARN, "%u messages suppressed at %s:%d", suppressed, file, line);
+        }
+    }
+    if (atomic_fetch_add_explicit(&site->count, 1, memory_order_relaxed) < LOG_SITE_BURST) {
+        return 1;
+    }
+    atomic_fetch_add_explicit(&site->suppressed, 1, memory_order_relaxed);
+    return 0;
+}
+
+// Formats a message and queues it for the drain thread
+// Parameters:
+// - level: Level of the message
+// - fmt: printf style format, without a trailing newline
+void log_write(int level, const char *fmt, ...) {
+    va_list args;
+    LogCell *cell;
+    size_t pos;
+
+    va_start(args, fmt);
+    if (!started) {
+        // Not initialised: write synchronously
+        fputs(level_prefix[level], stdout);
+        vprintf(fmt, args);
+        fputc('\n', stdout);
+        va_end(args);
+        return;
+    }
+
+    // Claim a cell (bounded MPMC queue; producers never wait for the consumer)
+    pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+    while (1) {
+        size_t seq;
+        intptr_t diff;
+        cell = &ring[pos & (LOG_RING_SIZE - 1)];
+        seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+            va_end(args);
+            return;
+        } else {
+            pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    cell->level = level;
+    vsnprintf(cell->text, sizeof(cell->text), fmt, args);
+    va_end(args);
+    atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+}
+
+// Writes out everything queued so far; registered with atexit
+void log_flush(void) {
+    if (started) {
+        drain();
+    }
+}
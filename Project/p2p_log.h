@@ -0,0 +1,59 @@
+// p2p_log.h
+#ifndef P2P_LOG_H
+#define P2P_LOG_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Leveled, asynchronous logging.
+//
+// LOG_* calls format the message in the calling thread and push it onto a
+// lock-free ring buffer; a background thread drains the ring to stdout, so
+// request handlers never block on a terminal or pipe. When the ring is full
+// the message is dropped and counted rather than waiting.
+//
+// Every call site is rate limited to LOG_SITE_BURST messages per second;
+// the number of suppressed messages is reported once the next second starts.
+// LOG_DEBUG compiles to nothing when NDEBUG is defined (release builds).
+
+enum {
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG
+};
+
+#define LOG_SITE_BURST 20   // Messages allowed per call site per second
+
+// Rate limiter state, one per call site
+typedef struct {
+    _Atomic uint64_t second;
+    _Atomic uint32_t count;
+    _Atomic uint32_t suppressed;
+} LogSite;
+
+extern int log_level;
+
+void log_init(int level);
+int log_parse_level(const char *name);
+int log_site_allow(LogSite *site, const char *file, int line);
+void log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void log_flush(void);
+
+#define LOG_AT(level, ...) do { \
+        static LogSite log_site_; \
+        if ((level) <= log_level && log_site_allow(&log_site_, __FILE__, __LINE__)) { \
+            log_write((level), __VA_ARGS__); \
+        } \
+    } while (0)
+
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#ifdef NDEBUG
+#define LOG_DEBUG(...) do { } while (0)
+#else
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#endif
+
+#endif // P2P_LOG_H
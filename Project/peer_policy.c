@@ -0,0 +1,160 @@
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include "peer_policy.h"
+
+typedef int (*PolicyFunction)(const PeerCandidate *candidates, int count);
+
+// Returns the expected throughput of a PEER_REFERENCE_BYTES download
+// Parameters:
+// - candidate: The candidate to rate
+// - unmeasured: Value used for peers nobody has reported on yet
+static double expected_rate(const PeerCandidate *candidate, double unmeasured) {
+    const PeerScore *s = &candidate->score;
+    if (s->samples == 0 || s->bandwidth <= 0) {
+        return unmeasured;
+    }
+    return PEER_REFERENCE_BYTES / (s->rtt_us / 1e6 + PEER_REFERENCE_BYTES / s->bandwidth);
+}
+
+// Returns the mean expected rate over measured candidates, or 1 if none are measured
+static double mean_rate(const PeerCandidate *candidates, int count) {
+    double sum = 0;
+    int measured = 0, i;
+    for (i = 0; i < count; i++) {
+        if (candidates[i].score.samples > 0) {
+            sum += expected_rate(&candidates[i], 0);
+            measured++;
+        }
+    }
+    return measured ? sum / measured : 1.0;
+}
+
+// Picks the candidate that was handed out the fewest times
+static int select_least_used(const PeerCandidate *candidates, int count) {
+    int best = 0, i;
+    for (i = 1; i < count; i++) {
+        if (candidates[i].time_used < candidates[best].time_used) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+// Picks the candidate with the best expected rate; unmeasured peers go first
+// so every peer gets measured, and ties go to the least used
+static int select_fastest(const PeerCandidate *candidates, int count) {
+    int best = 0, i;
+    for (i = 1; i < count; i++) {
+        double a = expected_rate(&candidates[i], DBL_MAX);
+        double b = expected_rate(&candidates[best], DBL_MAX);
+        if (a > b || (a == b && candidates[i].time_used < candidates[best].time_used)) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+// Picks a candidate at random, weighted by expected rate; unmeasured peers
+// are weighted like an average measured one
+static int select_weighted_random(const PeerCandidate *candidates, int count) {
+    double fallback = mean_rate(candidates, count);
+    double total = 0, r;
+    int i;
+    for (i = 0; i < count; i++) {
+        total += expected_rate(&candidates[i], fallback);
+    }
+    r = (double)rand() / ((double)RAND_MAX + 1.0) * total;
+    for (i = 0; i < count; i++) {
+        r -= expected_rate(&candidates[i], fallback);
+        if (r < 0) {
+            return i;
+        }
+    }
+    return count - 1;
+}
+
+// Picks two candidates at random and keeps the better one
+static int select_power_of_two(const PeerCandidate *candidates, int count) {
+    double fallback, a, b;
+    int i, j;
+    if (count == 1) {
+        return 0;
+    }
+    fallback = mean_rate(candidates, count);
+    i = rand() % count;
+    j = rand() % (count - 1);
+    if (j >= i) {
+        j++;
+    }
+    a = expected_rate(&candidates[i], fallback);
+    b = expected_rate(&candidates[j], fallback);
+    if (a == b) {
+        return candidates[i].time_used <= candidates[j].time_used ? i : j;
+    }
+    return a > b ? i : j;
+}
+
+static const char *policy_names[POLICY_COUNT] = { "least-used", "fastest", "weighted-random", "p2c" };
+static const PolicyFunction policies[POLICY_COUNT] = {
+    select_least_used, select_fastest, select_weighted_random, select_power_of_two
+};
+
+// Parses a policy name
+// Parameters:
+// - name: One of "least-used", "fastest", "weighted-random" or "p2c"
+// Returns the policy, or -1 if the name is unknown
+int peer_policy_parse(const char *name) {
+    int i;
+    for (i = 0; i < POLICY_COUNT; i++) {
+        if (strcmp(name, policy_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Returns the name of a policy
+// Parameters:
+// - policy: The policy
+const char *peer_policy_name(int policy) {
+    return policy >= 0 && policy < POLICY_COUNT ? policy_names[policy] : "unknown";
+}
+
+// Folds one completed transfer into a peer's score
+// Parameters:
+// - score: The score to update
+// - bytes: Bytes transferred
+// - elapsed_us: Transfer time in microseconds
+// - rtt_us: Connect time in microseconds
+void peer_score_update(PeerScore *score, double bytes, double elapsed_us, double rtt_us) {
+    double bandwidth;
+    if (bytes <= 0 || elapsed_us <= 0) {
+        return;
+    }
+    bandwidth = bytes / (elapsed_us / 1e6);
+    if (score->samples == 0) {
+        score->bandwidth = bandwidth;
+        score->rtt_us = rtt_us;
+    } else {
+        score->bandwidth = PEER_SCORE_ALPHA * bandwidth + (1 - PEER_SCORE_ALPHA) * score->bandwidth;
+        score->rtt_us = PEER_SCORE_ALPHA * rtt_us + (1 - PEER_SCORE_ALPHA) * score->rtt_us;
+    }
+    score->samples++;
+}
+
+// Chooses one of several candidates
+// Parameters:
+// - policy: The selection policy
+// - candidates: The peers holding the file
+// - count: Number of candidates, at least 1
+// Returns the index of the chosen candidate
+int peer_policy_select(int policy, const PeerCandidate *candidates, int count) {
+    if (count <= 1) {
+        return 0;
+    }
+    if (policy < 0 || policy >= POLICY_COUNT) {
+        policy = POLICY_LEAST_USED;
+    }
+    return policies[policy](candidates, count);
+}
@@ -0,0 +1,42 @@
+// peer_policy.h
+#ifndef PEER_POLICY_H
+#define PEER_POLICY_H
+
+// Policies for choosing which peer a LIST_CONTENT answer points at when
+// several peers hold the same file.
+
+#define PEER_SCORE_ALPHA 0.3          // Weight of the newest sample in the moving averages
+#define PEER_REFERENCE_BYTES 1048576  // Transfer size used to turn bandwidth and RTT into one score
+
+// Measured link quality of a peer, from downloaders' REPORT PDUs
+// bandwidth: Exponentially weighted throughput in bytes per second
+// rtt_us: Exponentially weighted connect time in microseconds
+// samples: Number of reports folded in so far
+typedef struct {
+    double bandwidth;
+    double rtt_us;
+    int samples;
+} PeerScore;
+
+// A peer that can serve the requested file
+// time_used: Number of times the entry was handed out
+// score: The peer's measured link quality
+typedef struct {
+    int time_used;
+    PeerScore score;
+} PeerCandidate;
+
+enum {
+    POLICY_LEAST_USED,
+    POLICY_FASTEST,
+    POLICY_WEIGHTED_RANDOM,
+    POLICY_POWER_OF_TWO,
+    POLICY_COUNT
+};
+
+int peer_policy_parse(const char *name);
+const char *peer_policy_name(int policy);
+void peer_score_update(PeerScore *score, double bytes, double elapsed_us, double rtt_us);
+int peer_policy_select(int policy, const PeerCandidate *candidates, int count);
+
+#endif // PEER_POLICY_H
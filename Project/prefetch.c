@@ -0,0 +1,185 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include "p2p_log.h"
+#include "prefetch.h"
+
+// Monotonic clock in microseconds
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Keeps the readahead window in front of the reader, sized to the consumer's rate
+static void advance_window(Prefetcher *prefetcher) {
+    uint64_t elapsed, consumed;
+    off_t window = PREFETCH_MIN_WINDOW, from;
+
+    pthread_mutex_lock(&prefetcher->lock);
+    elapsed = now_us() - prefetcher->start_us;
+    consumed = prefetcher->consumed;
+    pthread_mutex_unlock(&prefetcher->lock);
+    // The first chunks leave the buffers faster than any peer takes them, so wait for a real rate
+    if (elapsed >= 100000) {
+        uint64_t rate = consumed * 1000000 / elapsed;
+        window = rate * PREFETCH_WINDOW_MS / 1000;
+        window = window < PREFETCH_MIN_WINDOW ? PREFETCH_MIN_WINDOW : window;
+        window = window > PREFETCH_MAX_WINDOW ? PREFETCH_MAX_WINDOW : window;
+    }
+
+    // Top the window up once the reader is halfway through it
+    if (prefetcher->offset + window / 2 < prefetcher->ahead) {
+        return;
+    }
+    from = prefetcher->ahead > prefetcher->offset ? prefetcher->ahead : prefetcher->offset;
+    if (readahead(prefetcher->fd, from, prefetcher->offset + window - from) == -1) {
+        posix_fadvise(prefetcher->fd, from, prefetcher->offset + window - from, POSIX_FADV_WILLNEED);
+    }
+    prefetcher->ahead = prefetcher->offset + window;
+}
+
+// Reads up to len bytes, stopping early only at the end of the file
+// Returns the bytes read, -1 on error
+static ssize_t read_full(int fd, unsigned char *buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = read(fd, buf + got, len - got);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        got += n;
+    }
+    return got;
+}
+
+// Reader thread: fills free buffers in turn until the file ends or the consumer stops
+static void *reader_thread(void *arg) {
+    Prefetcher *prefetcher = arg;
+
+    while (1) {
+        int index;
+        ssize_t n;
+
+        pthread_mutex_lock(&prefetcher->lock);
+        while (!prefetcher->stop && prefetcher->filled + prefetcher->held == PREFETCH_BUFFERS) {
+            pthread_cond_wait(&prefetcher->changed, &prefetcher->lock);
+        }
+        if (prefetcher->stop) {
+            pthread_mutex_unlock(&prefetcher->lock);
+            break;
+        }
+        index = prefetcher->fill_index;
+        pthread_mutex_unlock(&prefetcher->lock);
+
+        advance_window(prefetcher);
+        n = read_full(prefetcher->fd, prefetcher->buffers[index], prefetcher->chunk_size);
+        if (n == -1) {
+            LOG_WARN("Read failed while serving a file: %s", strerror(errno));
+        } else {
+            prefetcher->offset += n;
+        }
+
+        pthread_mutex_lock(&prefetcher->lock);
+        prefetcher->lengths[index] = n;
+        prefetcher->fill_index = (index + 1) % PREFETCH_BUFFERS;
+        prefetcher->filled++;
+        pthread_cond_signal(&prefetcher->changed);
+        pthread_mutex_unlock(&prefetcher->lock);
+        if (n <= 0) {
+            break;  // The consumer finds the end or the error in the last buffer
+        }
+    }
+    return NULL;
+}
+
+// Starts reading a file ahead from its current position
+// Parameters:
+// - prefetcher: Filled in
+// - fd: The file; the prefetcher reads it until prefetch_stop()
+// - chunk_size: Bytes per chunk handed out
+// Returns 0 on success, -1 if the buffers or the thread couldn't be set up
+int prefetch_start(Prefetcher *prefetcher, int fd, size_t chunk_size) {
+    int i;
+
+    memset(prefetcher, 0, sizeof(*prefetcher));
+    prefetcher->fd = fd;
+    prefetcher->chunk_size = chunk_size;
+    prefetcher->offset = lseek(fd, 0, SEEK_CUR);
+    prefetcher->ahead = prefetcher->offset;
+    prefetcher->start_us = now_us();
+    for (i = 0; i < PREFETCH_BUFFERS; i++) {
+        if ((prefetcher->buffers[i] = malloc(chunk_size)) == NULL) {
+            goto fail;
+        }
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);  // Larger kernel readahead, and pages behind us go first
+    pthread_mutex_init(&prefetcher->lock, NULL);
+    pthread_cond_init(&prefetcher->changed, NULL);
+    if (pthread_create(&prefetcher->thread, NULL, reader_thread, prefetcher) != 0) {
+        pthread_mutex_destroy(&prefetcher->lock);
+        pthread_cond_destroy(&prefetcher->changed);
+        goto fail;
+    }
+    return 0;
+fail:
+    for (i = 0; i < PREFETCH_BUFFERS; i++) {
+        free(prefetcher->buffers[i]);
+    }
+    return -1;
+}
+
+// Takes the next chunk, handing the previous one back to the reader
+// Parameters:
+// - prefetcher: The file being read
+// - data: Set to the chunk, valid until the next call
+// Returns the chunk's length, 0 at the end of the file, -1 on a read error
+ssize_t prefetch_next(Prefetcher *prefetcher, const unsigned char **data) {
+    ssize_t n;
+
+    pthread_mutex_lock(&prefetcher->lock);
+    if (prefetcher->held) {
+        prefetcher->held = 0;
+        pthread_cond_signal(&prefetcher->changed);
+    }
+    while (prefetcher->filled == 0) {
+        pthread_cond_wait(&prefetcher->changed, &prefetcher->lock);
+    }
+    n = prefetcher->lengths[prefetcher->take_index];
+    *data = prefetcher->buffers[prefetcher->take_index];
+    if (n > 0) {
+        // The last buffer stays filled, so asking again returns the end or the error again
+        prefetcher->take_index = (prefetcher->take_index + 1) % PREFETCH_BUFFERS;
+        prefetcher->filled--;
+        prefetcher->held = 1;
+        prefetcher->consumed += n;
+    }
+    pthread_mutex_unlock(&prefetcher->lock);
+    return n;
+}
+
+// Stops the reader and frees the buffers; the file stays open
+void prefetch_stop(Prefetcher *prefetcher) {
+    int i;
+
+    pthread_mutex_lock(&prefetcher->lock);
+    prefetcher->stop = 1;
+    pthread_cond_signal(&prefetcher->changed);
+    pthread_mutex_unlock(&prefetcher->lock);
+    pthread_join(prefetcher->thread, NULL);
+    pthread_mutex_destroy(&prefetcher->lock);
+    pthread_cond_destroy(&prefetcher->changed);
+    for (i = 0; i < PREFETCH_BUFFERS; i++) {
+        free(prefetcher->buffers[i]);
+    }
+}
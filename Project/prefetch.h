@@ -0,0 +1,56 @@
+// prefetch.h
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+// Read stage for seeders: reads a file ahead of the socket.
+//
+// A reader thread fills two chunk buffers in turn, so the next chunk comes
+// off the disk while the current one is compressed, tagged and sent. The
+// file is opened for sequential access (POSIX_FADV_SEQUENTIAL), and the
+// reader keeps a readahead() window in front of itself so the kernel has
+// large requests queued instead of waiting on each read. The window covers
+// PREFETCH_WINDOW_MS of sending at the rate the consumer has managed so far,
+// between PREFETCH_MIN_WINDOW and PREFETCH_MAX_WINDOW bytes: a slow peer
+// doesn't pin much of the page cache, and a fast one isn't starved by a
+// cold file.
+
+#define PREFETCH_BUFFERS 2                    // Chunks in flight between reader and sender
+#define PREFETCH_WINDOW_MS 500                // Sending time the readahead window covers
+#define PREFETCH_MIN_WINDOW (1024 * 1024)     // Smallest readahead window
+#define PREFETCH_MAX_WINDOW (64 * 1024 * 1024) // Largest readahead window
+
+// A file being read ahead of its consumer
+// lengths: Bytes in each buffer, 0 at the end of the file, -1 after a read error
+// filled: Buffers the reader has filled and the consumer hasn't taken
+// held: Whether the consumer still holds the buffer it took last
+// offset: Where the reader reads next
+// ahead: End of the range handed to readahead() so far
+// consumed: Bytes the consumer has taken, for the rate
+typedef struct {
+    int fd;
+    size_t chunk_size;
+    unsigned char *buffers[PREFETCH_BUFFERS];
+    ssize_t lengths[PREFETCH_BUFFERS];
+    int filled;
+    int held;
+    int fill_index;
+    int take_index;
+    int stop;
+    off_t offset;
+    off_t ahead;
+    uint64_t start_us;
+    uint64_t consumed;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} Prefetcher;
+
+int prefetch_start(Prefetcher *prefetcher, int fd, size_t chunk_size);
+ssize_t prefetch_next(Prefetcher *prefetcher, const unsigned char **data);
+void prefetch_stop(Prefetcher *prefetcher);
+
+#endif // PREFETCH_H
@@ -0,0 +1,137 @@
+#include <string.h>
+#include "constants.h"
+#include "ratelimit.h"
+
+// Sustained requests per second and burst size of each class at 100%
+static const double base_rate[RATE_CLASSES] = { 10, 50, 5 };
+static const double base_burst[RATE_CLASSES] = { 20, 100, 10 };
+
+// One source's buckets
+// addr: The source; last_seen 0 marks a free way
+// tokens: Requests each class may still make right now
+// refilled_us: When tokens were last topped up
+// warned_us: When the source was last sent SLOW_DOWN
+typedef struct {
+    struct in6_addr addr;
+    double tokens[RATE_CLASSES];
+    uint64_t refilled_us;
+    uint64_t warned_us;
+    uint64_t last_seen;
+} RateEntry;
+
+static RateEntry table[RATE_SETS][RATE_WAYS];
+static double rate[RATE_CLASSES];
+static double burst[RATE_CLASSES];
+static int enabled = 1;
+static uint64_t queue_delay_avg_us = 0;
+
+// Maps a PDU type to its request class
+static int rate_class(char pdu_type) {
+    switch (pdu_type) {
+    case REGISTER:
+    case DEREGISTER:
+    case REPORT:
+        return RATE_CLASS_WRITE;
+    case LIST_CONTENT:
+    case QUERY:
+        return RATE_CLASS_BULK;
+    default:
+        return RATE_CLASS_READ;
+    }
+}
+
+// Sets the limits
+// Parameters:
+// - percent: Scales every rate and burst; 100 for the defaults, 0 turns per-source limits off
+void ratelimit_init(int percent) {
+    int i;
+
+    memset(table, 0, sizeof(table));
+    enabled = percent > 0;
+    for (i = 0; i < RATE_CLASSES; i++) {
+        rate[i] = base_rate[i] * percent / 100;
+        burst[i] = base_burst[i] * percent / 100;
+        if (burst[i] < 1) {
+            burst[i] = 1;
+        }
+    }
+}
+
+// Finds a source's buckets, taking over the least recently seen way of its set if it has none
+static RateEntry *rate_entry(const struct in6_addr *addr, uint64_t now_us) {
+    uint32_t hash = 2166136261u;
+    RateEntry *set, *victim;
+    int i, way;
+
+    for (i = 0; i < (int)sizeof(*addr); i++) {
+        hash = (hash ^ addr->s6_addr[i]) * 16777619u;
+    }
+    set = table[hash & (RATE_SETS - 1)];
+    victim = &set[0];
+    for (way = 0; way < RATE_WAYS; way++) {
+        if (set[way].last_seen != 0 && memcmp(&set[way].addr, addr, sizeof(*addr)) == 0) {
+            return &set[way];
+        }
+        if (set[way].last_seen < victim->last_seen) {
+            victim = &set[way];
+        }
+    }
+    // A newcomer starts with full buckets
+    memset(victim, 0, sizeof(*victim));
+    victim->addr = *addr;
+    for (i = 0; i < RATE_CLASSES; i++) {
+        victim->tokens[i] = burst[i];
+    }
+    victim->refilled_us = now_us;
+    return victim;
+}
+
+// Checks a request against its source's bucket for the request's class
+// Parameters:
+// - addr: Source address of the request
+// - pdu_type: Type byte of the request, the only part looked at
+// - now_us: Current time, on the metrics_now_us clock
+// - retry_ms: Filled with when a token will be available, if the request is refused
+// Returns RATE_ADMIT, RATE_WARN or RATE_DROP
+int ratelimit_admit(const struct in6_addr *addr, char pdu_type, uint64_t now_us, uint32_t *retry_ms) {
+    RateEntry *entry;
+    int class = rate_class(pdu_type), i;
+
+    if (!enabled) {
+        return RATE_ADMIT;
+    }
+    entry = rate_entry(addr, now_us);
+    entry->last_seen = now_us;
+    for (i = 0; i < RATE_CLASSES; i++) {
+        entry->tokens[i] += rate[i] * (now_us - entry->refilled_us) / 1e6;
+        if (entry->tokens[i] > burst[i]) {
+            entry->tokens[i] = burst[i];
+        }
+    }
+    entry->refilled_us = now_us;
+
+    if (entry->tokens[class] >= 1) {
+        entry->tokens[class] -= 1;
+        return RATE_ADMIT;
+    }
+    *retry_ms = rate[class] > 0 ? (uint32_t)((1 - entry->tokens[class]) * 1000 / rate[class]) + 1 : SHED_RETRY_MS;
+    if (now_us - entry->warned_us >= RATE_WARN_INTERVAL_US) {
+        entry->warned_us = now_us;
+        return RATE_WARN;
+    }
+    return RATE_DROP;
+}
+
+// Decides whether to shed a request because the server as a whole is behind
+// Parameters:
+// - pdu_type: Type byte of the request
+// - queue_delay_us: How long the request waited in the socket buffer
+// Returns 1 if the request should be refused with SLOW_DOWN, 0 to handle it
+int ratelimit_shed(char pdu_type, uint64_t queue_delay_us) {
+    // Smooth over a few requests so a single stall doesn't flip the mode
+    queue_delay_avg_us = (queue_delay_avg_us * 7 + queue_delay_us) / 8;
+    if (queue_delay_avg_us <= SHED_QUEUE_DELAY_US) {
+        return 0;
+    }
+    return rate_class(pdu_type) == RATE_CLASS_BULK || pdu_type == REPORT;
+}
@@ -0,0 +1,53 @@
+// ratelimit.h
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+// Admission control for the index server's request loop.
+//
+// Every source address gets a token bucket per class of request, so a peer
+// flooding REGISTER or LIST_CONTENT runs out of its own tokens without
+// touching anyone else's. Buckets live in a fixed set-associative table
+// keyed by the binary address; a busy set evicts its least recently seen
+// source. The check looks only at the PDU type byte and the source address,
+// so a refused request is never parsed and never takes the registry lock.
+// The first refusal in a while is answered with SLOW_DOWN, the rest are
+// dropped without an answer so a flood can't turn the server into a
+// reflector.
+//
+// Separately, the server sheds load as a whole when requests sit in the
+// socket buffer too long: while the smoothed queueing delay is above
+// SHED_QUEUE_DELAY_US, expensive requests (LIST_CONTENT, QUERY) and
+// expendable ones (REPORT) get SLOW_DOWN, and cheap SEARCHes keep their
+// bounded latency.
+//
+// SLOW_DOWN answer data: "<retry after ms> <reason>".
+
+#define RATE_SETS 1024                 // Sets in the per-source table, a power of two
+#define RATE_WAYS 4                    // Sources per set
+#define RATE_WARN_INTERVAL_US 1000000  // A refused source is told to slow down at most this often
+#define SHED_QUEUE_DELAY_US 20000      // Smoothed queueing delay that counts as overload
+#define SHED_RETRY_MS 1000             // Retry hint given with shed requests
+
+// Request classes, each with its own bucket per source
+enum {
+    RATE_CLASS_WRITE,   // REGISTER, DEREGISTER, REPORT
+    RATE_CLASS_READ,    // SEARCH, SUMMARY, SUBSCRIBE and anything else cheap
+    RATE_CLASS_BULK,    // LIST_CONTENT and QUERY, which walk the registry
+    RATE_CLASSES
+};
+
+// Outcome of an admission check
+enum {
+    RATE_ADMIT,   // Handle the request
+    RATE_WARN,    // Refuse it and answer SLOW_DOWN
+    RATE_DROP     // Refuse it silently
+};
+
+void ratelimit_init(int percent);
+int ratelimit_admit(const struct in6_addr *addr, char pdu_type, uint64_t now_us, uint32_t *retry_ms);
+int ratelimit_shed(char pdu_type, uint64_t queue_delay_us);
+
+#endif // RATELIMIT_H
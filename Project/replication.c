@@ -0,0 +1,428 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "replication.h"
+#include "netaddr.h"
+#include "p2p_log.h"
+
+#define REPLICATION_BATCH 64   // Changes sent per write
+#define RECORD_SIZE 160        // Longest formatted record, with room to spare
+
+static pthread_mutex_t *registry_lock;
+static ReplicationHooks hooks;
+static pthread_cond_t log_changed = PTHREAD_COND_INITIALIZER;
+
+// The change log, guarded by registry_lock
+static Mutation change_log[REPLICATION_LOG_SIZE];
+static uint64_t log_head = 1;    // Sequence number of the next change
+static uint64_t log_oldest = 1;  // Oldest sequence number still in change_log
+
+static _Atomic int replica = 0;  // Nonzero while following a primary
+static int follow_sd = -1;       // Connection to the primary, guarded by registry_lock
+
+// Sets up replication
+// Parameters:
+// - lock: Mutex guarding the registry; held by every hook call
+// - registry_hooks: How to read and change the registry
+void replication_init(pthread_mutex_t *lock, const ReplicationHooks *registry_hooks) {
+    registry_lock = lock;
+    hooks = *registry_hooks;
+}
+
+// Writes a whole buffer to a socket
+// Returns 0 on success, -1 if the peer went away
+static int send_all(int sd, const char *buf, size_t len) {
+    ssize_t n;
+    while (len > 0) {
+        if ((n = send(sd, buf, len, MSG_NOSIGNAL)) <= 0) {
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Formats one record of the stream
+// Parameters:
+// - buf: Buffer of at least RECORD_SIZE bytes
+// - seq: Sequence number, or 0 for a snapshot entry
+// - m: The change
+// Returns the length of the record
+static int format_record(char *buf, uint64_t seq, const Mutation *m) {
+    int len = 0;
+    if (seq != 0) {
+        len = snprintf(buf, RECORD_SIZE, "%llu ", (unsigned long long)seq);
+    }
+    char ip[INET6_ADDRSTRLEN];
+    inet_ntop(AF_INET6, &m->addr, ip, sizeof(ip));
+    if (m->op == REGISTER) {
+        char key[MAC_KEY_TEXT_SIZE] = "";
+        if (mac_key_is_set(&m->secret)) {
+            mac_key_format(&m->secret, key);
+        }
+        len += snprintf(buf + len, RECORD_SIZE - len, "R %s %s %s %d%s%s\n", m->peer_name, m->filename, ip, m->port,
+                        key[0] ? " " : "", key);
+    } else {
+        len += snprintf(buf + len, RECORD_SIZE - len, "T %s %s %d\n", m->filename, ip, m->port);
+    }
+    return len;
+}
+
+// Parses the change part of a record ("R ..." or "T ...")
+// Returns 0 on success, -1 if the record is malformed
+static int parse_record(const char *text, Mutation *m) {
+    char ip[INET6_ADDRSTRLEN], key[MAC_KEY_TEXT_SIZE];
+    memset(m, 0, sizeof(*m));
+    int fields = sscanf(text, "R %10s %10s %45s %d %32s", m->peer_name, m->filename, ip, &m->port, key);
+    if (fields >= 4) {
+        m->op = REGISTER;
+        if (fields == 5 && mac_key_parse(key, &m->secret) == -1) {
+            return -1;
+        }
+    } else if (sscanf(text, "T %10s %45s %d", m->filename, ip, &m->port) == 3) {
+        m->op = DEREGISTER;
+    } else {
+        return -1;
+    }
+    return inet_pton(AF_INET6, ip, &m->addr) == 1 ? 0 : -1;
+}
+
+// Records a change so replicas receive it; call with the registry lock held
+// Parameters:
+// - m: The change, already applied to the registry
+void replication_append(const Mutation *m) {
+    change_log[log_head % REPLICATION_LOG_SIZE] = *m;
+    log_head++;
+    if (log_head - log_oldest > REPLICATION_LOG_SIZE) {
+        log_oldest = log_head - REPLICATION_LOG_SIZE;
+    }
+    pthread_cond_broadcast(&log_changed);
+}
+
+// Sends a snapshot of the registry; call with the registry lock held, returns with it held
+// Parameters:
+// - sd: Connection to the replica
+// - next: Set to the sequence number the replica needs after the snapshot
+// Returns 0 on success, -1 if the replica went away
+static int send_snapshot(int sd, uint64_t *next) {
+    Mutation entries[MAX_ENTRIES];
+    char *buf, *p;
+    int count, i, result;
+
+    count = hooks.snapshot(entries, MAX_ENTRIES);
+    *next = log_head;
+    pthread_mutex_unlock(registry_lock);
+
+    p = buf = malloc(RECORD_SIZE * (count + 1));
+    p += snprintf(p, RECORD_SIZE, "S %llu %d\n", (unsigned long long)*next, count);
+    for (i = 0; i < count; i++) {
+        p += format_record(p, 0, &entries[i]);
+    }
+    result = send_all(sd, buf, p - buf);
+    free(buf);
+
+    pthread_mutex_lock(registry_lock);
+    return result;
+}
+
+// Streams the change log to one replica
+// Parameters:
+// - arg: Connected socket, cast to a pointer
+static void *replica_sender(void *arg) {
+    int sd = (int)(intptr_t)arg;
+    char hello[64], buf[RECORD_SIZE * REPLICATION_BATCH];
+    unsigned long long wanted;
+    uint64_t next;
+    size_t len = 0;
+    ssize_t n;
+
+    // The replica opens with "HELLO <next sequence number>", 0 if it has nothing
+    while (len < sizeof(hello) - 1 && (n = recv(sd, hello + len, 1, 0)) == 1 && hello[len] != '\n') {
+        len++;
+    }
+    hello[len] = '\0';
+    if (sscanf(hello, "HELLO %llu", &wanted) != 1) {
+        close(sd);
+        return NULL;
+    }
+    next = wanted;
+    LOG_INFO("Replica connected, resuming at change %llu", wanted);
+
+    pthread_mutex_lock(registry_lock);
+    while (1) {
+        int count = 0;
+        char *p = buf;
+
+        if (next == 0 || next < log_oldest || next > log_head) {
+            // New replica, or the changes it missed are gone
+            if (send_snapshot(sd, &next) == -1) {
+                break;
+            }
+            continue;
+        }
+        if (next == log_head) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += REPLICATION_HEARTBEAT_SEC;
+            if (pthread_cond_timedwait(&log_changed, registry_lock, &deadline) == ETIMEDOUT) {
+                len = snprintf(buf, sizeof(buf), "H %llu\n", (unsigned long long)log_head);
+                pthread_mutex_unlock(registry_lock);
+                n = send_all(sd, buf, len);
+                pthread_mutex_lock(registry_lock);
+                if (n == -1) {
+                    break;
+                }
+            }
+            continue;
+        }
+
+        while (next + count < log_head && count < REPLICATION_BATCH) {
+            p += format_record(p, next + count, &change_log[(next + count) % REPLICATION_LOG_SIZE]);
+            count++;
+        }
+        pthread_mutex_unlock(registry_lock);
+        n = send_all(sd, buf, p - buf);
+        pthread_mutex_lock(registry_lock);
+        if (n == -1) {
+            break;
+        }
+        next += count;
+    }
+    pthread_mutex_unlock(registry_lock);
+
+    LOG_WARN("Replica disconnected");
+    close(sd);
+    return NULL;
+}
+
+// Accepts replica connections
+// Parameters:
+// - arg: Listening socket, cast to a pointer
+static void *replication_listener(void *arg) {
+    int sd = (int)(intptr_t)arg;
+    int new_sd;
+    pthread_t thread_id;
+
+    while (1) {
+        if ((new_sd = accept(sd, NULL, NULL)) == -1) {
+            LOG_WARN("Replica accept failed: %s", strerror(errno));
+            continue;
+        }
+        if (pthread_create(&thread_id, NULL, replica_sender, (void *)(intptr_t)new_sd) != 0) {
+            close(new_sd);
+            continue;
+        }
+        pthread_detach(thread_id);
+    }
+    return NULL;
+}
+
+// Starts streaming changes to replicas that connect
+// Parameters:
+// - port: TCP port for replicas to connect to
+// Returns 0 on success, -1 on failure
+int replication_serve(int port) {
+    int sd;
+    pthread_t thread_id;
+
+    if ((sd = netaddr_listen(SOCK_STREAM, port)) == -1 || listen(sd, 5) == -1) {
+        perror("Cannot bind replication socket");
+        if (sd != -1) {
+            close(sd);
+        }
+        return -1;
+    }
+    if (pthread_create(&thread_id, NULL, replication_listener, (void *)(intptr_t)sd) != 0) {
+        close(sd);
+        return -1;
+    }
+    pthread_detach(thread_id);
+    LOG_INFO("Streaming changes to replicas on port %d", port);
+    return 0;
+}
+
+// Receives a snapshot and replaces the registry with it
+// Parameters:
+// - in: The stream, positioned after the "S" header
+// - seq: Sequence number the snapshot was taken at
+// - count: Number of entries that follow
+// Returns 0 on success, -1 if the stream broke
+static int apply_snapshot(FILE *in, uint64_t seq, int count) {
+    Mutation *entries = malloc(sizeof(Mutation) * (count > 0 ? count : 1));
+    char line[RECORD_SIZE * 2];
+    int i;
+
+    // Read it all first so readers never see half a registry
+    for (i = 0; i < count; i++) {
+        if (fgets(line, sizeof(line), in) == NULL || parse_record(line, &entries[i]) == -1) {
+            free(entries);
+            return -1;
+        }
+    }
+    pthread_mutex_lock(registry_lock);
+    hooks.reset();
+    for (i = 0; i < count; i++) {
+        hooks.apply(&entries[i]);
+    }
+    log_head = log_oldest = seq;
+    pthread_mutex_unlock(registry_lock);
+    free(entries);
+    LOG_INFO("Loaded snapshot of %d entries at change %llu", count, (unsigned long long)seq);
+    return 0;
+}
+
+// Follows the primary's stream until promoted, reconnecting when it drops
+// Parameters:
+// - arg: Address of the primary (heap allocated, freed here)
+static void *replication_follower(void *arg) {
+    struct sockaddr_storage primary = *(struct sockaddr_storage *)arg;
+    struct timeval timeout = { REPLICATION_TIMEOUT_SEC, 0 };
+    char line[RECORD_SIZE * 2];
+    int synced = 0;  // Set once we hold a consistent copy; until then ask for a snapshot
+    free(arg);
+
+    while (atomic_load(&replica)) {
+        int sd;
+        unsigned long long seq;
+        int count;
+        FILE *in;
+
+        if ((sd = socket(primary.ss_family, SOCK_STREAM, 0)) == -1 ||
+            connect(sd, (struct sockaddr *)&primary, primary.ss_family == AF_INET6 ?
+                    sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in)) == -1) {
+            if (sd != -1) {
+                close(sd);
+            }
+            sleep(REPLICATION_RETRY_SEC);
+            continue;
+        }
+        setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        pthread_mutex_lock(registry_lock);
+        snprintf(line, sizeof(line), "HELLO %llu\n", synced ? (unsigned long long)log_head : 0ULL);
+        pthread_mutex_unlock(registry_lock);
+        if (send_all(sd, line, strlen(line)) == -1 || (in = fdopen(sd, "r")) == NULL) {
+            close(sd);
+            sleep(REPLICATION_RETRY_SEC);
+            continue;
+        }
+        pthread_mutex_lock(registry_lock);
+        follow_sd = sd;
+        pthread_mutex_unlock(registry_lock);
+        struct in6_addr addr;
+        char host[HOST_TEXT_SIZE];
+        int port;
+        netaddr_from_sockaddr(&primary, &addr, &port);
+        netaddr_format(&addr, host, sizeof(host));
+        LOG_INFO("Following primary %s:%d", host, port);
+
+        while (atomic_load(&replica) && fgets(line, sizeof(line), in) != NULL) {
+            Mutation m;
+            char *text;
+
+            if (line[0] == 'H') {
+                continue;
+            }
+            if (sscanf(line, "S %llu %d", &seq, &count) == 2) {
+                if (apply_snapshot(in, seq, count) == -1) {
+                    break;
+                }
+                synced = 1;
+                continue;
+            }
+            seq = strtoull(line, &text, 10);
+            if (text == line || parse_record(text + 1, &m) == -1) {
+                LOG_WARN("Malformed replication record: %s", line);
+                break;
+            }
+
+            pthread_mutex_lock(registry_lock);
+            if (seq != log_head || !atomic_load(&replica)) {
+                // A gap means our copy is no longer trustworthy
+                pthread_mutex_unlock(registry_lock);
+                LOG_WARN("Replication gap: expected change %llu, got %llu", (unsigned long long)log_head, seq);
+                synced = 0;
+                break;
+            }
+            hooks.apply(&m);
+            replication_append(&m);
+            pthread_mutex_unlock(registry_lock);
+        }
+
+        pthread_mutex_lock(registry_lock);
+        follow_sd = -1;
+        pthread_mutex_unlock(registry_lock);
+        fclose(in);
+        if (atomic_load(&replica)) {
+            LOG_WARN("Lost the primary, reconnecting");
+            sleep(REPLICATION_RETRY_SEC);
+        }
+    }
+    return NULL;
+}
+
+// Turns this server into a read-only replica of a primary
+// Parameters:
+// - primary_host: Name or address of the primary, IPv4 or IPv6
+// - primary_port: Replication port of the primary
+// Returns 0 on success, -1 on failure
+int replication_follow(const char *primary_host, int primary_port) {
+    struct sockaddr_storage *primary = malloc(sizeof(*primary));
+    socklen_t len;
+    pthread_t thread_id;
+
+    if (netaddr_resolve(primary_host, primary_port, SOCK_STREAM, primary, &len) == -1) {
+        fprintf(stderr, "Invalid primary address %s\n", primary_host);
+        free(primary);
+        return -1;
+    }
+
+    atomic_store(&replica, 1);
+    if (pthread_create(&thread_id, NULL, replication_follower, primary) != 0) {
+        atomic_store(&replica, 0);
+        free(primary);
+        return -1;
+    }
+    pthread_detach(thread_id);
+    return 0;
+}
+
+// Stops following the primary and starts accepting writes
+void replication_promote(void) {
+    if (!atomic_exchange(&replica, 0)) {
+        return;
+    }
+    pthread_mutex_lock(registry_lock);
+    if (follow_sd != -1) {
+        shutdown(follow_sd, SHUT_RDWR);  // Wakes the follower; it closes the socket
+    }
+    LOG_INFO("Promoted to primary at change %llu", (unsigned long long)log_head);
+    pthread_mutex_unlock(registry_lock);
+}
+
+// Returns nonzero while this server is a read-only replica
+int replication_is_replica(void) {
+    return atomic_load(&replica);
+}
+
+// Returns the sequence number the next change will get
+uint64_t replication_sequence(void) {
+    uint64_t seq;
+    pthread_mutex_lock(registry_lock);
+    seq = log_head;
+    pthread_mutex_unlock(registry_lock);
+    return seq;
+}
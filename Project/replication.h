@@ -0,0 +1,66 @@
+// replication.h
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include "constants.h"
+#include "chunkmac.h"
+
+// Primary/replica replication of the index server's registry.
+//
+// The primary numbers every successful REGISTER and DEREGISTER and keeps the
+// most recent REPLICATION_LOG_SIZE of them in memory. Replicas connect over
+// TCP, say which sequence number they need next, and receive the log from
+// there as text lines; a replica that is new or too far behind first gets a
+// snapshot of the whole registry. Replicas apply the stream in order, serve
+// SEARCH and LIST_CONTENT, and refuse writes until they are promoted, after
+// which they accept writes and keep numbering from the last applied change.
+//
+// Stream format (one record per line):
+//   S <seq> <count>                    snapshot as of <seq>, followed by
+//   R <peer> <file> <ip> <port> [<key>]        <count> entries
+//   <seq> R <peer> <file> <ip> <port> [<key>]  a registration
+//   <seq> T <file> <ip> <port>         a deregistration
+//   H <seq>                            heartbeat while there is nothing to send
+// <ip> is always in IPv6 form, IPv4 peers as ::ffff:a.b.c.d. <key> is the
+// peer's transfer secret in hex, present if it registered one.
+
+#define REPLICATION_LOG_SIZE 4096      // Changes kept for replicas catching up
+#define REPLICATION_RETRY_SEC 1        // Delay before a replica reconnects
+#define REPLICATION_HEARTBEAT_SEC 1    // Idle primary sends a heartbeat this often
+#define REPLICATION_TIMEOUT_SEC 3      // Replica gives up on a silent primary after this long
+
+// One change to the registry
+// op: REGISTER or DEREGISTER; peer_name is unused for DEREGISTER
+// addr: Address of the hosting peer, IPv4 peers IPv4-mapped
+// secret: Key the peer tags transfers with, all zero if it registered none
+typedef struct {
+    char op;
+    char peer_name[PEER_NAME_SIZE];
+    char filename[FILENAME_SIZE];
+    struct in6_addr addr;
+    int port;
+    MacKey secret;
+} Mutation;
+
+// Provided by the index server; all are called with the registry lock held
+// apply: Applies a change received from the primary
+// snapshot: Fills out with the registry as REGISTER changes, returns the count
+// reset: Empties the registry before a snapshot is applied
+typedef struct {
+    void (*apply)(const Mutation *m);
+    int (*snapshot)(Mutation *out, int max);
+    void (*reset)(void);
+} ReplicationHooks;
+
+void replication_init(pthread_mutex_t *registry_lock, const ReplicationHooks *hooks);
+int replication_serve(int port);
+int replication_follow(const char *primary_host, int primary_port);
+void replication_append(const Mutation *m);
+void replication_promote(void);
+int replication_is_replica(void);
+uint64_t replication_sequence(void);
+
+#endif // REPLICATION_H
@@ -0,0 +1,549 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <endian.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+#include "constants.h"
+#include "p2p_log.h"
+#include "chunkmac.h"
+#include "filewriter.h"
+#include "prefetch.h"
+#include "transfer.h"
+
+#define CACHE_MAGIC "P2PZ"
+
+// Header of a cached frame stream
+// size, mtime_sec, mtime_nsec: The source file the frames were made from
+typedef struct {
+    char magic[4];
+    int64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+} CacheHeader;
+
+// Extensions of formats that are compressed already
+static const char *compressed_extensions[] = {
+    ".gz", ".tgz", ".zip", ".bz2", ".xz", ".zst", ".lz4", ".7z", ".rar", ".jpg", ".jpeg",
+    ".png", ".gif", ".webp", ".mp3", ".mp4", ".mkv", ".mov", ".ogg", ".flac", NULL
+};
+
+// Magic numbers of the same, matched against the start of the file
+static const struct { const char *bytes; size_t len; } compressed_magics[] = {
+    { "\x1f\x8b", 2 }, { "PK\x03\x04", 4 }, { "BZh", 3 }, { "\xfd" "7zXZ", 5 }, { "\x28\xb5\x2f\xfd", 4 },
+    { "\x04\x22\x4d\x18", 4 }, { "7z\xbc\xaf", 4 }, { "\xff\xd8\xff", 3 }, { "\x89PNG", 4 }, { "GIF8", 4 },
+    { NULL, 0 }
+};
+
+// Writes a whole buffer to a socket
+// Parameters:
+// - flags: Extra send() flags, MSG_MORE when more follows at once
+// Returns 0 on success, -1 if the peer went away
+static int send_all(int sd, const void *buf, size_t len, int flags) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = send(sd, p, len, flags | MSG_NOSIGNAL);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Writes a whole buffer to a file descriptor
+// Returns 0 on success, -1 on failure
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Reads exactly len bytes from a socket
+// Returns 0 on success, -1 if the stream ended first
+static int recv_all(int sd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = recv(sd, p, len, 0);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Frames going out on one connection
+// key: The download's key if frames are tagged, otherwise NULL
+// seq: Frames sent so far, which the next tag covers
+// sent: Bytes written to the socket
+typedef struct {
+    int sd;
+    const MacKey *key;
+    uint64_t seq;
+    uint64_t sent;
+} FrameSender;
+
+// Fills in a frame header
+// Parameters:
+// - frame: At least TRANSFER_HEADER_SIZE bytes
+// - type: Frame type
+// - len: Payload length
+static void frame_header(unsigned char *frame, char type, uint32_t len) {
+    uint32_t be = htonl(len);
+    frame[0] = type;
+    memcpy(frame + 1, &be, sizeof(be));
+}
+
+// Sends one frame, followed by its tag if the transfer is authenticated
+// Parameters:
+// - out: The connection
+// - frame: Header and payload
+// - len: Length of frame
+// Returns 0 on success, -1 if the peer went away
+static int send_frame(FrameSender *out, const unsigned char *frame, size_t len) {
+    uint64_t tag;
+
+    if (out->key == NULL) {
+        if (send_all(out->sd, frame, len, 0) == -1) {
+            return -1;
+        }
+        out->sent += len;
+        return 0;
+    }
+    tag = htole64(mac_tag(out->key, out->seq++, frame, TRANSFER_HEADER_SIZE, frame + TRANSFER_HEADER_SIZE,
+                          len - TRANSFER_HEADER_SIZE));
+    if (send_all(out->sd, frame, len, MSG_MORE) == -1 || send_all(out->sd, &tag, MAC_TAG_SIZE, 0) == -1) {
+        return -1;
+    }
+    out->sent += len + MAC_TAG_SIZE;
+    return 0;
+}
+
+// Sends a frame with a text payload
+static int send_text_frame(FrameSender *out, char type, const char *text) {
+    unsigned char frame[TRANSFER_HEADER_SIZE + BUFLEN];
+    size_t len = strlen(text) < BUFLEN ? strlen(text) : BUFLEN;
+
+    frame_header(frame, type, len);
+    memcpy(frame + TRANSFER_HEADER_SIZE, text, len);
+    return send_frame(out, frame, TRANSFER_HEADER_SIZE + len);
+}
+
+// Reads the capabilities a downloader offered
+// Parameters:
+// - request_data: Data of a DOWNLOAD request, "<filename> [capability ...]"
+// - nonce: Set to the nonce of the downloader's token if it asked for tagged frames
+// Returns a mask of TRANSFER_CAP_* bits, 0 for a legacy downloader
+int transfer_parse_caps(const char *request_data, uint64_t *nonce) {
+    char copy[BUFLEN + 1], *word, *save;
+    unsigned long long n;
+    int caps = 0;
+
+    strncpy(copy, request_data, BUFLEN);
+    copy[BUFLEN] = '\0';
+    if ((word = strtok_r(copy, " ", &save)) == NULL) {
+        return 0;
+    }
+    while ((word = strtok_r(NULL, " ", &save)) != NULL) {
+        if (strcmp(word, "frames") == 0) {
+            caps |= TRANSFER_CAP_FRAMES;
+        } else if (strcmp(word, "deflate") == 0) {
+            caps |= TRANSFER_CAP_DEFLATE;
+        } else if (strcmp(word, "keepalive") == 0) {
+            caps |= TRANSFER_CAP_KEEPALIVE;
+        } else if (sscanf(word, "mac=%16llx", &n) == 1) {
+            caps |= TRANSFER_CAP_MAC;
+            *nonce = n;
+        }
+    }
+    // Compressed and tagged chunks only exist inside frames
+    return caps & TRANSFER_CAP_FRAMES ? caps : 0;
+}
+
+// Builds the data of a DOWNLOAD request offering capabilities
+// Parameters:
+// - data: Output buffer
+// - size: Size of data
+// - filename: File to download
+// - caps: TRANSFER_CAP_* bits to offer
+// - nonce: Nonce of the token from the SEARCH answer, used with TRANSFER_CAP_MAC
+void transfer_format_request(char *data, size_t size, const char *filename, int caps, uint64_t nonce) {
+    size_t len;
+
+    memset(data, 0, size);
+    snprintf(data, size, "%s%s%s", filename, caps & TRANSFER_CAP_FRAMES ? " frames" : "",
+             caps & TRANSFER_CAP_DEFLATE ? " deflate" : "");
+    if (caps & TRANSFER_CAP_MAC) {
+        len = strlen(data);
+        snprintf(data + len, size - len, " mac=%016llx", (unsigned long long)nonce);
+    }
+    if (caps & TRANSFER_CAP_KEEPALIVE) {
+        len = strlen(data);
+        snprintf(data + len, size - len, " keepalive");
+    }
+}
+
+// Checks whether a file is compressed already, so compressing it again would only cost CPU
+// Parameters:
+// - filename: Name of the file
+// - data: Its first bytes
+// - len: Number of bytes in data
+static int looks_compressed(const char *filename, const unsigned char *data, size_t len) {
+    const char *dot = strrchr(filename, '.');
+    int i;
+
+    for (i = 0; dot != NULL && compressed_extensions[i] != NULL; i++) {
+        if (strcasecmp(dot, compressed_extensions[i]) == 0) {
+            return 1;
+        }
+    }
+    for (i = 0; compressed_magics[i].bytes != NULL; i++) {
+        if (len >= compressed_magics[i].len && memcmp(data, compressed_magics[i].bytes, compressed_magics[i].len) == 0) {
+            return 1;
+        }
+    }
+    // MP4 and QuickTime: a box size, then "ftyp"
+    return len >= 8 && memcmp(data + 4, "ftyp", 4) == 0;
+}
+
+// Builds the path of a file's cached frames
+static void cache_path(char *path, size_t size, const char *cache_dir, const char *filename) {
+    const char *base = strrchr(filename, '/');
+    snprintf(path, size, "%s/%s.p2pz", cache_dir, base ? base + 1 : filename);
+}
+
+// Sends cached frames if they were made from the current version of the file
+// Untagged frames go out with sendfile(); tagged ones are read back one at a time to be tagged
+// Parameters:
+// - out: The connection
+// - path: The cache file
+// - st: Status of the source file
+// - frame: Buffer for one frame
+// - frame_size: Size of frame
+// Returns 0 if the frames were sent, 1 if there is no usable cache, -1 if sending failed
+static int send_cached(FrameSender *out, const char *path, const struct stat *st, unsigned char *frame, size_t frame_size) {
+    CacheHeader header;
+    struct stat cache_st;
+    off_t offset = sizeof(header);
+    uint32_t len;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) == -1) {
+        return 1;
+    }
+    if (read(fd, &header, sizeof(header)) != sizeof(header) || memcmp(header.magic, CACHE_MAGIC, 4) != 0 ||
+        header.size != st->st_size || header.mtime_sec != st->st_mtim.tv_sec ||
+        header.mtime_nsec != st->st_mtim.tv_nsec || fstat(fd, &cache_st) == -1) {
+        close(fd);
+        return 1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    while (out->key == NULL && offset < cache_st.st_size) {
+        ssize_t n = sendfile(out->sd, fd, &offset, cache_st.st_size - offset);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            close(fd);
+            return -1;
+        }
+        out->sent += n;
+    }
+    while (out->key != NULL && offset < cache_st.st_size) {
+        if (pread(fd, frame, TRANSFER_HEADER_SIZE, offset) != TRANSFER_HEADER_SIZE) {
+            break;
+        }
+        memcpy(&len, frame + 1, 4);
+        len = ntohl(len);
+        if (len > frame_size - TRANSFER_HEADER_SIZE ||
+            pread(fd, frame + TRANSFER_HEADER_SIZE, len, offset + TRANSFER_HEADER_SIZE) != (ssize_t)len ||
+            send_frame(out, frame, TRANSFER_HEADER_SIZE + len) == -1) {
+            break;
+        }
+        offset += TRANSFER_HEADER_SIZE + len;
+    }
+    close(fd);
+    return offset == cache_st.st_size ? 0 : -1;
+}
+
+// Answers a framed downloader with an error instead of a file
+// The downloader expects an ACKNOWLEDGE first, then learns of the error in a frame
+// Parameters:
+// - sd: Connected socket; the DOWNLOAD request has been read
+// - caps: Capabilities the downloader offered
+// - key: Key to tag frames with, or NULL to send them untagged
+// - message: What went wrong
+// - sent: Set to the bytes written to the socket
+// Returns 1 if the answer was sent, so the connection is still in step, -1 otherwise
+int transfer_send_error(int sd, int caps, const MacKey *key, const char *message, uint64_t *sent) {
+    FrameSender out = { sd, NULL, 0, 0 };
+    char accepted[32];
+    int result;
+
+    if (key != NULL && (caps & TRANSFER_CAP_MAC)) {
+        out.key = key;
+    }
+    snprintf(accepted, sizeof(accepted), "frames%s%s", out.key ? " mac" : "",
+             caps & TRANSFER_CAP_KEEPALIVE ? " keepalive" : "");
+    result = send_text_frame(&out, ACKNOWLEDGE, accepted) == 0 && send_text_frame(&out, ERROR, message) == 0 ? 1 : -1;
+    *sent = out.sent;
+    return result;
+}
+
+// Serves a file to a framed downloader
+// Parameters:
+// - sd: Connected socket; the DOWNLOAD request has been read
+// - filename: File to send
+// - caps: Capabilities the downloader offered
+// - cache_dir: Directory for precompressed frames, or NULL for none
+// - key: Key to tag frames with, or NULL to send them untagged
+// - sent: Set to the bytes written to the socket
+// Returns 0 if the whole file was sent, 1 if the file couldn't be opened and ERROR was sent instead, -1 otherwise
+int transfer_send_file(int sd, const char *filename, int caps, const char *cache_dir, const MacKey *key, uint64_t *sent) {
+    size_t frame_size = TRANSFER_HEADER_SIZE + 4 + compressBound(TRANSFER_CHUNK_SIZE);
+    const unsigned char *chunk = NULL;
+    unsigned char *frame = NULL;
+    char path[PATH_MAX], temp[PATH_MAX + 32], accepted[64];
+    int fd, cache_fd = -1, compress_level = TRANSFER_LEVEL, result = -1;
+    FrameSender out = { sd, NULL, 0, 0 };
+    Prefetcher reader;
+    struct stat st;
+    ssize_t n = -1;
+
+    if (key != NULL && (caps & TRANSFER_CAP_MAC)) {
+        out.key = key;
+    }
+    // Chunks are read from the disk while the previous one is compressed and sent
+    if ((fd = open(filename, O_RDONLY)) == -1 || fstat(fd, &st) == -1 ||
+        prefetch_start(&reader, fd, TRANSFER_CHUNK_SIZE) == -1) {
+        // The downloader expects an ACKNOWLEDGE first, then learns of the error in a frame
+        LOG_WARN("File not found: %s: %s", filename, strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        return transfer_send_error(sd, caps, key, "File not found", sent);
+    }
+    frame = malloc(frame_size);
+    n = prefetch_next(&reader, &chunk);
+    if (n > 0 && looks_compressed(filename, chunk, n)) {
+        caps &= ~TRANSFER_CAP_DEFLATE;
+    }
+
+    // Tell the downloader what it will get, and how big the file is so it can preallocate it
+    snprintf(accepted, sizeof(accepted), "frames%s%s%s size=%lld", caps & TRANSFER_CAP_DEFLATE ? " deflate" : "",
+             out.key ? " mac" : "", caps & TRANSFER_CAP_KEEPALIVE ? " keepalive" : "", (long long)st.st_size);
+    if (send_text_frame(&out, ACKNOWLEDGE, accepted) == -1) {
+        goto done;
+    }
+
+    if ((caps & TRANSFER_CAP_DEFLATE) && cache_dir != NULL) {
+        int cached;
+        cache_path(path, sizeof(path), cache_dir, filename);
+        if ((cached = send_cached(&out, path, &st, frame, frame_size)) <= 0) {
+            result = cached;
+            goto final;
+        }
+        // Build the cache while sending; a better ratio pays off on every later send
+        snprintf(temp, sizeof(temp), "%s.%d.%lu", path, (int)getpid(), (unsigned long)pthread_self());
+        if ((cache_fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) != -1) {
+            CacheHeader header;
+            memcpy(header.magic, CACHE_MAGIC, 4);
+            header.size = st.st_size;
+            header.mtime_sec = st.st_mtim.tv_sec;
+            header.mtime_nsec = st.st_mtim.tv_nsec;
+            if (write_all(cache_fd, &header, sizeof(header)) == -1) {
+                close(cache_fd);
+                unlink(temp);
+                cache_fd = -1;
+            } else {
+                compress_level = TRANSFER_CACHE_LEVEL;
+            }
+        }
+    }
+
+    for (; n > 0; n = prefetch_next(&reader, &chunk)) {
+        size_t frame_len = 0;
+        if (caps & TRANSFER_CAP_DEFLATE) {
+            uLongf packed = frame_size - TRANSFER_HEADER_SIZE - 4;
+            uint32_t raw_len = htonl(n);
+            if (compress2(frame + TRANSFER_HEADER_SIZE + 4, &packed, chunk, n, compress_level) == Z_OK &&
+                packed * 100 <= (uLongf)n * (100 - TRANSFER_MIN_SAVING_PERCENT)) {
+                frame_header(frame, COMPRESSED_DATA, packed + 4);
+                memcpy(frame + TRANSFER_HEADER_SIZE, &raw_len, 4);
+                frame_len = TRANSFER_HEADER_SIZE + 4 + packed;
+            } else if (cache_fd == -1) {
+                // Not worth it for this file; a cached copy is kept consistent instead
+                caps &= ~TRANSFER_CAP_DEFLATE;
+            }
+        }
+        if (frame_len == 0) {
+            frame_header(frame, CONTENT_DATA, n);
+            memcpy(frame + TRANSFER_HEADER_SIZE, chunk, n);
+            frame_len = TRANSFER_HEADER_SIZE + n;
+        }
+        // The cache holds untagged frames; tags depend on the download
+        if (cache_fd != -1 && write_all(cache_fd, frame, frame_len) == -1) {
+            close(cache_fd);
+            unlink(temp);
+            cache_fd = -1;
+        }
+        if (send_frame(&out, frame, frame_len) == -1) {
+            goto done;
+        }
+    }
+    if (n == 0) {
+        result = 0;
+    }
+
+final:
+    if (result == 0) {
+        // FINAL is tagged too, so a cut-off transfer can't pass for a complete one
+        frame_header(frame, FINAL, 0);
+        result = send_frame(&out, frame, TRANSFER_HEADER_SIZE);
+    }
+done:
+    if (cache_fd != -1) {
+        // Publish the cache only if it holds the whole file
+        if (close(cache_fd) == 0 && n == 0 && rename(temp, path) == 0) {
+            LOG_DEBUG("Cached compressed frames of %s in %s", filename, path);
+        } else {
+            unlink(temp);
+        }
+    }
+    prefetch_stop(&reader);
+    close(fd);
+    free(frame);
+    *sent = out.sent;
+    return result;
+}
+
+// Receives a file from a framed seeder
+// Parameters:
+// - sd: Connected socket; the ACKNOWLEDGE frame's type byte has been read
+// - file: Where the file goes; preallocated once the seeder announces the size
+// - key: Key the seeder must tag frames with, or NULL to accept untagged frames
+// - accepted: Set to the TRANSFER_CAP_* bits the seeder accepted
+// - bytes: Set to the file bytes written
+// - wire_bytes: Set to the bytes received from the socket
+// - error: Filled with what went wrong, the seeder's message if it sent ERROR
+// - error_size: Size of error
+// Returns 0 once FINAL arrives, 1 if the seeder answered with ERROR, -1 otherwise
+int transfer_receive_file(int sd, FileWriter *file, const MacKey *key, int *accepted, long long *bytes,
+                          long long *wire_bytes, char *error, size_t error_size) {
+    size_t payload_size = 4 + compressBound(TRANSFER_CHUNK_SIZE);
+    unsigned char header[TRANSFER_HEADER_SIZE], *payload = malloc(payload_size), *chunk = malloc(TRANSFER_CHUNK_SIZE);
+    uint64_t seq = 0, tag;
+    int result = -1, tagged = 0;
+    long long announced = 0;
+    uint32_t len;
+
+    *accepted = 0;
+    *bytes = 0;
+    *wire_bytes = 1;
+    snprintf(error, error_size, "Transfer interrupted");
+    // The ACKNOWLEDGE frame's type byte was read by the caller to tell us from a legacy seeder
+    header[0] = ACKNOWLEDGE;
+    if (recv_all(sd, header + 1, TRANSFER_HEADER_SIZE - 1) == -1) {
+        goto done;
+    }
+    *wire_bytes += TRANSFER_HEADER_SIZE - 1;
+    while (1) {
+        memcpy(&len, header + 1, 4);
+        len = ntohl(len);
+        if (len > payload_size || recv_all(sd, payload, len) == -1) {
+            break;
+        }
+        *wire_bytes += len;
+
+        if (header[0] == ACKNOWLEDGE) {
+            // Frames are tagged if and only if the seeder says so
+            char words[BUFLEN + 1], *size;
+            uint64_t unused;
+            // Parsed like a request, after a placeholder where the filename would be
+            snprintf(words, sizeof(words), "- %.*s", (int)(len < BUFLEN - 2 ? len : BUFLEN - 2), (char *)payload);
+            *accepted = transfer_parse_caps(words, &unused);
+            tagged = strstr(words, " mac") != NULL;
+            announced = (size = strstr(words, "size=")) != NULL ? atoll(size + 5) : 0;
+            if (key != NULL && !tagged) {
+                snprintf(error, error_size, "Seeder did not authenticate the transfer");
+                break;
+            }
+        }
+        if (tagged) {
+            if (key == NULL || recv_all(sd, &tag, MAC_TAG_SIZE) == -1) {
+                break;
+            }
+            *wire_bytes += MAC_TAG_SIZE;
+            if (le64toh(tag) != mac_tag(key, seq++, header, TRANSFER_HEADER_SIZE, payload, len)) {
+                snprintf(error, error_size, "Frame %llu failed authentication", (unsigned long long)seq - 1);
+                break;
+            }
+        }
+
+        if (header[0] == ACKNOWLEDGE) {
+            // Only once the ACKNOWLEDGE checked out, so nobody else picks how much disk we reserve
+            file_writer_reserve(file, announced);
+        } else if (header[0] == CONTENT_DATA) {
+            if (file_writer_write(file, payload, len) == -1) {
+                break;
+            }
+            *bytes += len;
+        } else if (header[0] == COMPRESSED_DATA) {
+            uint32_t raw_len;
+            uLongf unpacked = TRANSFER_CHUNK_SIZE;
+            if (len < 4) {
+                break;
+            }
+            memcpy(&raw_len, payload, 4);
+            if (uncompress(chunk, &unpacked, payload + 4, len - 4) != Z_OK || unpacked != ntohl(raw_len) ||
+                file_writer_write(file, chunk, unpacked) == -1) {
+                break;
+            }
+            *bytes += unpacked;
+        } else if (header[0] == FINAL) {
+            result = 0;
+            break;
+        } else if (header[0] == ERROR) {
+            snprintf(error, error_size, "%.*s", (int)len, (char *)payload);
+            result = 1;  // The answer ended cleanly, so the connection can carry another request
+            break;
+        }
+
+        if (recv_all(sd, header, TRANSFER_HEADER_SIZE) == -1) {
+            break;
+        }
+        *wire_bytes += TRANSFER_HEADER_SIZE;
+    }
+done:
+    free(payload);
+    free(chunk);
+    return result;
+}
@@ -0,0 +1,66 @@
+// transfer.h
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "chunkmac.h"
+#include "filewriter.h"
+
+// Framed, optionally compressed file transfer between peers.
+//
+// A downloader that understands frames lists its capabilities after the
+// filename in the DOWNLOAD request ("<filename> frames deflate"). Seeders
+// that predate frames ignore the request data and answer with the legacy
+// stream of bare CONTENT_DATA PDUs; a framed seeder answers with an
+// ACKNOWLEDGE frame naming the capabilities it will use, then the file.
+//
+// Frame: type (1 byte), payload length (4 bytes, big endian), payload.
+//   ACKNOWLEDGE      accepted capabilities, space separated, then "size=<bytes>"
+//   CONTENT_DATA     up to TRANSFER_CHUNK_SIZE bytes of the file
+//   COMPRESSED_DATA  original length (4 bytes, big endian), then one zlib stream
+//   ERROR            message
+//   FINAL            empty; the file is complete
+//
+// A downloader holding a token from the SEARCH answer (see chunkmac.h) also
+// offers "mac=<nonce>". The seeder then accepts "mac" and follows every
+// frame, the ACKNOWLEDGE included, with a MAC_TAG_SIZE tag over the frame and
+// its sequence number. A downloader that offered a tag refuses a transfer
+// without one, so an impostor can't just fall back to the legacy stream.
+//
+// A downloader that offers "keepalive" may send further DOWNLOAD requests
+// on the same connection, back to back without waiting; a seeder that
+// accepts "keepalive" answers them in order and closes the connection only
+// once it has been idle a while. A downloader pipelines requests only after
+// a seeder accepted, since a seeder that closes with requests unread may
+// reset the connection under the answer to the first.
+//
+// Each chunk is compressed on its own, so the seeder streams and the
+// downloader never holds more than a chunk. Files that look compressed
+// already (by extension or magic number) are sent raw, and so is the rest of
+// a file once a chunk fails to shrink by TRANSFER_MIN_SAVING_PERCENT.
+//
+// With a cache directory set, the first compressed send of a file also
+// stores its frames there; later sends copy them with sendfile() until the
+// source file's size or modification time changes. Tagged transfers read the
+// cached frames back to tag them, which still saves compressing them again.
+
+#define TRANSFER_CHUNK_SIZE 65536          // File bytes per frame
+#define TRANSFER_HEADER_SIZE 5             // Frame type and payload length
+#define TRANSFER_MIN_SAVING_PERCENT 10     // A chunk saving less than this ends compression for the file
+#define TRANSFER_LEVEL 1                   // zlib level for compressing as we send
+#define TRANSFER_CACHE_LEVEL 6             // zlib level when the result is cached for later sends
+
+#define TRANSFER_CAP_FRAMES 0x1            // Length-prefixed frames
+#define TRANSFER_CAP_DEFLATE 0x2           // COMPRESSED_DATA frames
+#define TRANSFER_CAP_MAC 0x4               // Tagged frames
+#define TRANSFER_CAP_KEEPALIVE 0x8         // More DOWNLOAD requests may follow on the connection
+
+int transfer_parse_caps(const char *request_data, uint64_t *nonce);
+void transfer_format_request(char *data, size_t size, const char *filename, int caps, uint64_t nonce);
+int transfer_send_error(int sd, int caps, const MacKey *key, const char *message, uint64_t *sent);
+int transfer_send_file(int sd, const char *filename, int caps, const char *cache_dir, const MacKey *key, uint64_t *sent);
+int transfer_receive_file(int sd, FileWriter *file, const MacKey *key, int *accepted, long long *bytes,
+                          long long *wire_bytes, char *error, size_t error_size);
+
+#endif // TRANSFER_H